@@ -1,7 +1,13 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE /* sync_file_range, syncfs, renameat2 */
+#endif
+
 #include <archive.h>
 #include <archive_entry.h>
+#include <zstd.h>
 
 #include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -13,9 +19,65 @@
 #if (defined(_WIN32) || defined(__WIN32__))
 #include <direct.h> /* _mkdir */
 #define mkdir(x, y) _mkdir(x)
+#else
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#if defined(__linux__)
+#include <linux/fs.h> /* FICLONE */
+#include <sys/syscall.h>
+#elif defined(__APPLE__)
+#include <sys/clonefile.h>
+#endif
+#endif
+
+#if (defined(__x86_64__) || defined(__i386__)) &&                             \
+    (defined(__GNUC__) || defined(__clang__))
+#define SHA256_X86 1
+#define CKSUM_X86 1
+#include <cpuid.h>
+#include <immintrin.h>
+#elif defined(__aarch64__) && (defined(__GNUC__) || defined(__clang__))
+/*
+ * The crypto extension kernels carry their own target attribute, so a
+ * generic build has them too. Linux checks the hwcaps before using them;
+ * elsewhere they are only built when the baseline already has the
+ * extension.
+ */
+#if defined(__linux__)
+#define SHA256_ARMV8 1
+#define CKSUM_ARMV8 1
+#include <sys/auxv.h>
+#if !defined(HWCAP_PMULL)
+#define HWCAP_PMULL (1 << 4)
+#endif
+#if !defined(HWCAP_SHA2)
+#define HWCAP_SHA2 (1 << 6)
+#endif
+#else
+#if defined(__ARM_FEATURE_SHA2)
+#define SHA256_ARMV8 1
+#endif
+#if defined(__ARM_FEATURE_AES) || defined(__ARM_FEATURE_CRYPTO)
+#define CKSUM_ARMV8 1
+#endif
+#endif
+#if defined(SHA256_ARMV8) || defined(CKSUM_ARMV8)
+#include <arm_neon.h>
+#define ARMV8_CRYPTO __attribute__((target("+crypto")))
+#endif
 #endif
 
 #define BSIZE (8 * 1024)
+#define SPARSE_BLOCK 4096
+#define INPUT_BLOCK (1024 * 1024)
+#define WRITEBACK_WINDOW (8 * 1024 * 1024)
+#define WRITEBACK_QUEUE 64
+#define DIRECT_ALIGN 4096
+#define DIRECT_BUFFER (1024 * 1024)
+#define ALIGNED_POOL_SIZE 8
+#define MAX_WORKERS 64
+#define DEDUP_BUFFER_MAX (1024 * 1024)
 
 static const char *short_options = "EfhvX";
 
@@ -31,20 +93,76 @@ enum {
   opt_include = 256,
   opt_exclude,
   opt_strip_components,
+  opt_sparse,
+  opt_cache_policy,
+  opt_direct_io,
+  opt_sync,
+  opt_replace,
+  opt_incremental,
+  opt_dedup,
+  opt_link_dest,
+  opt_result_cache,
+  opt_result_cache_size,
+  opt_payload_cache,
+  opt_pbzx_cache,
+  opt_pbzx_cache_size,
+  opt_view,
+  opt_flat,
+  opt_output_format,
+  opt_store,
+  opt_materialize,
+  opt_hash_manifest,
+  opt_verify_bom,
+  opt_verify,
+  opt_repair,
+  opt_payload_files,
+  opt_json,
+  opt_precreate_dirs,
+  opt_skeleton,
+  opt_diff,
+  opt_cat,
 };
 
 static const struct option {
   const char *name;
   int required;
   int equivalent;
-} pkg_longopts[] = {{"expand", 0, 'X'},
+} pkg_longopts[] = {{"cache-policy", 1, opt_cache_policy},
+                    {"cat", 1, opt_cat},
+                    {"dedup", 1, opt_dedup},
+                    {"diff", 0, opt_diff},
+                    {"direct-io", 1, opt_direct_io},
+                    {"expand", 0, 'X'},
                     {"expand-full", 0, 'E'},
+                    {"flat", 1, opt_flat},
                     {"force", 0, 'f'},
+                    {"hash-manifest", 1, opt_hash_manifest},
                     {"help", 0, 'h'},
                     {"include", 1, opt_include},
+                    {"incremental", 1, opt_incremental},
                     {"exclude", 1, opt_exclude},
+                    {"json", 0, opt_json},
+                    {"link-dest", 1, opt_link_dest},
+                    {"materialize", 0, opt_materialize},
+                    {"output-format", 1, opt_output_format},
+                    {"payload-files", 0, opt_payload_files},
+                    {"payload-cache", 1, opt_payload_cache},
+                    {"pbzx-cache", 1, opt_pbzx_cache},
+                    {"pbzx-cache-size", 1, opt_pbzx_cache_size},
+                    {"precreate-dirs", 0, opt_precreate_dirs},
+                    {"repair", 0, opt_repair},
+                    {"replace", 0, opt_replace},
+                    {"result-cache", 1, opt_result_cache},
+                    {"result-cache-size", 1, opt_result_cache_size},
+                    {"skeleton", 0, opt_skeleton},
+                    {"sparse", 0, opt_sparse},
+                    {"store", 1, opt_store},
                     {"strip-components", 1, opt_strip_components},
+                    {"sync", 1, opt_sync},
                     {"verbose", 0, 'v'},
+                    {"verify", 0, opt_verify},
+                    {"verify-bom", 0, opt_verify_bom},
+                    {"view", 1, opt_view},
                     {NULL, 0, 0}};
 
 static void fail_archive(struct archive *a, const char *ctx) {
@@ -70,14 +188,75 @@ static void usage(FILE *out) {
           "  --include PATTERN      Only include paths matching PATTERN\n"
           "  --exclude PATTERN      Exclude paths matching PATTERN\n"
           "  --strip-components N   Strip N leading path components\n"
+          "  --sparse               Skip zero-filled blocks when writing "
+          "files\n"
+          "  --cache-policy POLICY  Page cache use: keep (default) or drop\n"
+          "  --direct-io SIZE       Bypass the page cache for files of at "
+          "least SIZE\n"
+          "  --sync MODE            Durability: none (default), end or "
+          "per-file\n"
+          "  --replace              Extract next to DIR and swap it in "
+          "atomically\n"
+          "  --incremental MODE     Only rewrite files that changed, by mtime "
+          "or content\n"
+          "  --dedup MODE           Share identical files as hardlink or "
+          "reflink\n"
+          "  --link-dest DIR        Link unchanged files from a previous "
+          "extraction in DIR\n"
+          "  --result-cache DIR     Reuse earlier extractions of the same "
+          "pkg and filters\n"
+          "  --result-cache-size SIZE  Evict least recently used results "
+          "above SIZE\n"
+          "  --payload-cache DIR    Keep decoded Payloads in DIR as seekable "
+          "zstd\n"
+          "  --pbzx-cache DIR       Reuse decoded pbzx chunks from DIR\n"
+          "  --pbzx-cache-size SIZE  Evict least recently used chunks above "
+          "SIZE\n"
+          "  --view DIR             Also fill DIR in the same pass; later "
+          "--include,\n"
+          "                         --exclude and --strip-components apply "
+          "to it\n"
+          "  --flat DIR             With --expand-full, also write flat "
+          "entries to DIR\n"
+          "  --output-format FORMAT  Write dir (default), tar, tar.zst, "
+          "squashfs or cas;\n"
+          "                         DIR - is stdout for tar formats and "
+          "cas\n"
+          "  --store DIR            Blob store for cas output and "
+          "--materialize\n"
+          "  --hash-manifest FILE   Write SHA-256 sums of extracted files "
+          "to FILE\n"
+          "  --verify-bom           Check Payload files against the Bom "
+          "checksums\n"
+          "  --repair               With --verify, extract missing and "
+          "modified files again\n"
+          "  --json                 Print --payload-files as JSON\n"
+          "  --precreate-dirs       Create the directories listed in each "
+          "Bom before\n"
+          "                         its Payload is extracted\n"
+          "  --skeleton             Build Payload paths from the Bom: "
+          "directories,\n"
+          "                         symlinks and sparse files of the listed "
+          "size\n"
           "File Commands:\n"
           "  --expand PKG DIR       Write flat package entries to DIR\n"
-          "  --expand-full PKG DIR  Fully expand package contents to DIR\n");
+          "  --expand-full PKG DIR  Fully expand package contents to DIR\n"
+          "  --materialize MANIFEST DIR  Build DIR from a cas manifest with "
+          "hardlinks\n"
+          "  --verify PKG DIR       Check an expanded DIR against the Boms "
+          "in PKG\n"
+          "  --payload-files PKG    List the Payload paths recorded in the "
+          "Boms of PKG\n"
+          "  --diff OLD NEW         Compare the Boms of two pkgs without "
+          "reading Payloads\n"
+          "  --cat PATH PKG         Write the pkg path PATH to stdout\n");
 }
 
 static char *strip_components_path(const char *path, int strip);
 static int apply_strip_components(struct archive_entry *e, int strip);
 static int path_component_count(const char *path);
+static int parse_size(const char *arg, la_int64_t *out);
+static int worker_count(void);
 static char *normalize_rel_path(const char *path);
 struct pattern_list {
   char **items;
@@ -86,11 +265,53 @@ struct pattern_list {
 };
 static void pattern_list_add(struct pattern_list *list, const char *pattern);
 static void pattern_list_free(struct pattern_list *list);
+struct string_map_slot {
+  char *key;
+  void *value;
+};
+struct string_map {
+  struct string_map_slot *slots;
+  size_t cap;
+  size_t len;
+};
+static void *string_map_get(const struct string_map *map, const char *key);
+static int string_map_put(struct string_map *map, const char *key,
+                          void *value);
+static void string_map_free(struct string_map *map,
+                           void (*free_value)(void *));
 static int should_extract_path(struct archive *matching, const char *path);
 static char *join_prefix_path(const char *prefix, const char *path);
 static int has_include_descendant(const struct pattern_list *includes,
                                   const char *path);
 
+/*
+ * Additional output trees filled from the same decode pass. Each view has
+ * its own filters and strip count; entry data is written once and the
+ * other views get copies of that file, cloned where the filesystem can.
+ * Only --dedup hardlink makes them share the inode.
+ */
+struct view {
+  const char *outdir;
+  char *root;
+  int dirfd;
+  struct archive *matching;
+  struct pattern_list includes;
+  int strip;
+  struct archive *disk;
+  int flat; /* --flat: the xar entries themselves, unfiltered */
+};
+struct view_list {
+  struct view *items;
+  size_t len;
+  int link;
+};
+static struct archive_entry *view_entry_clone(const struct view_list *views,
+                                              struct archive_entry *e);
+static int views_want_nested(const struct view_list *views, const char *path);
+static void route_to_views(struct archive *a, struct archive_entry *orig,
+                           const char *prefix, struct archive_entry *primary,
+                           const struct view_list *views);
+
 static int pkg_getopt(int *argc, char ***argv, const char **arg) {
   enum { state_start = 0, state_next_word, state_short, state_long };
   static int state = state_start;
@@ -212,6 +433,7 @@ struct astream {
   size_t pos;
   la_int64_t off;
   int eof;
+  struct archive *tee; /* also receives every block read, if set */
 };
 
 static int astream_fill(struct astream *s) {
@@ -230,6 +452,11 @@ static int astream_fill(struct astream *s) {
   if (r != ARCHIVE_OK) {
     return (r);
   }
+  if (s->tee != NULL &&
+      archive_write_data_block(s->tee, s->blk, s->blksz, s->off) !=
+          ARCHIVE_OK) {
+    fail_archive(s->tee, "write flat entry");
+  }
 
   return (ARCHIVE_OK);
 }
@@ -269,360 +496,7512 @@ static int astream_close_cb(struct archive *a, void *client_data) {
   return (ARCHIVE_OK);
 }
 
-static void extract_nested_archive_from_stream(struct astream *in,
-                                               const char *outdir, int flags,
-                                               struct archive *matching,
-                                               int strip_components,
-                                               const char *prefix) {
-  struct archive *a = archive_read_new();
-  struct archive *disk = archive_write_disk_new();
-  struct archive_entry *e;
-  int r;
-  char *cwd = NULL;
+typedef void (*sha256_blocks_fn)(uint32_t state[8], const unsigned char *p,
+                                 size_t nblocks);
 
-  if (a == NULL || disk == NULL) {
-    fail_errno("archive allocation");
-  }
+struct sha256_ctx {
+  uint32_t state[8];
+  uint64_t bytes;
+  unsigned char block[64];
+  size_t fill;
+  sha256_blocks_fn blocks;
+};
 
-  archive_read_support_filter_all(a);
-  archive_read_support_format_all(a);
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
 
-  if (archive_read_open(a, in, astream_open_cb, astream_read_cb,
-                        astream_close_cb) != ARCHIVE_OK) {
-    fail_archive(a, "open nested archive");
-  }
+static uint32_t load_be32(const unsigned char *p) {
+  return ((uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 |
+          (uint32_t)p[3]);
+}
 
-  archive_write_disk_set_options(disk, flags);
-  archive_write_disk_set_standard_lookup(disk);
+static void store_be32(unsigned char *p, uint32_t v) {
+  p[0] = (unsigned char)(v >> 24);
+  p[1] = (unsigned char)(v >> 16);
+  p[2] = (unsigned char)(v >> 8);
+  p[3] = (unsigned char)v;
+}
 
-  cwd = getcwd(NULL, 0);
-  if (cwd == NULL) {
-    fail_errno("getcwd");
-  }
-  if (chdir(outdir) != 0) {
-    fail_errno("chdir(outdir)");
-  }
+#define ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
 
-  for (;;) {
-    r = archive_read_next_header(a, &e);
-    if (r == ARCHIVE_EOF) {
-      break;
+static void sha256_blocks_generic(uint32_t state[8], const unsigned char *p,
+                                  size_t nblocks) {
+  while (nblocks-- > 0) {
+    uint32_t w[64];
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+
+    for (int i = 0; i < 16; i++) {
+      w[i] = load_be32(p + 4 * i);
     }
-    if (r != ARCHIVE_OK) {
-      fail_archive(a, "read nested header");
+    for (int i = 16; i < 64; i++) {
+      uint32_t s0 = ROTR32(w[i - 15], 7) ^ ROTR32(w[i - 15], 18) ^
+                    (w[i - 15] >> 3);
+      uint32_t s1 = ROTR32(w[i - 2], 17) ^ ROTR32(w[i - 2], 19) ^
+                    (w[i - 2] >> 10);
+      w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    for (int i = 0; i < 64; i++) {
+      uint32_t t1 = h + (ROTR32(e, 6) ^ ROTR32(e, 11) ^ ROTR32(e, 25)) +
+                    ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+      uint32_t t2 = (ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22)) +
+                    ((a & b) ^ (a & c) ^ (b & c));
+      h = g;
+      g = f;
+      f = e;
+      e = d + t1;
+      d = c;
+      c = b;
+      b = a;
+      a = t1 + t2;
     }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+    p += 64;
+  }
+}
 
-    const char *p = archive_entry_pathname(e);
-    char *rel = normalize_rel_path(p);
-    archive_entry_set_pathname(e, rel);
+/*
+ * Hardware SHA-256: the four-round instructions take two state halves and
+ * four message-plus-constant words; the message schedule instructions
+ * extend the 16 loaded words four at a time.
+ */
+#if defined(SHA256_X86)
+__attribute__((target("sha,ssse3,sse4.1"))) static void
+sha256_blocks_shani(uint32_t state[8], const unsigned char *p,
+                    size_t nblocks) {
+  const __m128i bswap =
+      _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+  __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)state),
+                                  0xb1); /* CDAB */
+  __m128i s1 = _mm_shuffle_epi32(
+      _mm_loadu_si128((const __m128i *)(state + 4)), 0x1b); /* EFGH */
+  __m128i s0 = _mm_alignr_epi8(tmp, s1, 8);                  /* ABEF */
+  s1 = _mm_blend_epi16(s1, tmp, 0xf0);                       /* CDGH */
 
-    char *logical_path = join_prefix_path(prefix, rel);
-    if (!should_extract_path(matching, logical_path)) {
-      archive_read_data_skip(a);
-      free(logical_path);
-      free(rel);
-      continue;
-    }
-    free(logical_path);
+  while (nblocks-- > 0) {
+    __m128i abef = s0;
+    __m128i cdgh = s1;
+    __m128i m[4];
 
-    if (apply_strip_components(e, strip_components)) {
-      archive_read_data_skip(a);
-      free(rel);
-      continue;
+    for (int i = 0; i < 4; i++) {
+      m[i] = _mm_shuffle_epi8(
+          _mm_loadu_si128((const __m128i *)(p + 16 * i)), bswap);
     }
-
-    r = archive_read_extract2(a, e, disk);
-    if (r != ARCHIVE_OK) {
-      free(rel);
-      fail_archive(a, "extract nested entry");
+    for (int i = 0; i < 16; i++) {
+      __m128i wk = _mm_add_epi32(
+          m[i & 3], _mm_loadu_si128((const __m128i *)&sha256_k[4 * i]));
+      s1 = _mm_sha256rnds2_epu32(s1, s0, wk);
+      s0 = _mm_sha256rnds2_epu32(s0, s1, _mm_shuffle_epi32(wk, 0x0e));
+      if (i < 12) {
+        __m128i w = _mm_sha256msg1_epu32(m[i & 3], m[(i + 1) & 3]);
+        w = _mm_add_epi32(w,
+                          _mm_alignr_epi8(m[(i + 3) & 3], m[(i + 2) & 3], 4));
+        m[i & 3] = _mm_sha256msg2_epu32(w, m[(i + 3) & 3]);
+      }
     }
-    free(rel);
+    s0 = _mm_add_epi32(s0, abef);
+    s1 = _mm_add_epi32(s1, cdgh);
+    p += 64;
   }
 
-  archive_write_free(disk);
-  archive_read_free(a);
+  tmp = _mm_shuffle_epi32(s0, 0x1b);   /* FEBA */
+  s1 = _mm_shuffle_epi32(s1, 0xb1);    /* DCHG */
+  s0 = _mm_blend_epi16(tmp, s1, 0xf0); /* DCBA */
+  s1 = _mm_alignr_epi8(s1, tmp, 8);    /* HGFE */
+  _mm_storeu_si128((__m128i *)state, s0);
+  _mm_storeu_si128((__m128i *)(state + 4), s1);
+}
+#elif defined(SHA256_ARMV8)
+ARMV8_CRYPTO static void sha256_blocks_armv8(uint32_t state[8],
+                                             const unsigned char *p,
+                                             size_t nblocks) {
+  uint32x4_t s0 = vld1q_u32(state);
+  uint32x4_t s1 = vld1q_u32(state + 4);
 
-  if (chdir(cwd) != 0) {
-    fail_errno("chdir(cwd)");
+  while (nblocks-- > 0) {
+    uint32x4_t abcd = s0;
+    uint32x4_t efgh = s1;
+    uint32x4_t m[4];
+
+    for (int i = 0; i < 4; i++) {
+      m[i] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(p + 16 * i)));
+    }
+    for (int i = 0; i < 16; i++) {
+      uint32x4_t wk = vaddq_u32(m[i & 3], vld1q_u32(&sha256_k[4 * i]));
+      uint32x4_t prev = s0;
+      s0 = vsha256hq_u32(s0, s1, wk);
+      s1 = vsha256h2q_u32(s1, prev, wk);
+      if (i < 12) {
+        m[i & 3] = vsha256su1q_u32(vsha256su0q_u32(m[i & 3], m[(i + 1) & 3]),
+                                   m[(i + 2) & 3], m[(i + 3) & 3]);
+      }
+    }
+    s0 = vaddq_u32(s0, abcd);
+    s1 = vaddq_u32(s1, efgh);
+    p += 64;
   }
-  free(cwd);
+  vst1q_u32(state, s0);
+  vst1q_u32(state + 4, s1);
 }
+#endif
 
-static int should_be_treated_as_nested_archive(const char *path) {
-  if (path == NULL) {
-    return (0);
+/* Set by sha256_kernel_init() in main(), before any worker thread. */
+static sha256_blocks_fn sha256_blocks_chosen = sha256_blocks_generic;
+
+static void sha256_kernel_init(void) {
+#if defined(SHA256_X86)
+  unsigned int a, b, c, d;
+  if (__get_cpuid(1, &a, &b, &c, &d) && (c & bit_SSE4_1) &&
+      (c & bit_SSSE3) && __get_cpuid_count(7, 0, &a, &b, &c, &d) &&
+      (b & (1u << 29))) {
+    sha256_blocks_chosen = sha256_blocks_shani;
   }
-  const char *base = strrchr(path, '/');
-  const char *name = base != NULL ? base + 1 : path;
-  for (size_t i = 0; nested_archive_names[i] != NULL; i++) {
-    if (strcmp(name, nested_archive_names[i]) == 0) {
-      return (1);
+#elif defined(SHA256_ARMV8) && defined(__linux__)
+  if ((getauxval(AT_HWCAP) & HWCAP_SHA2) != 0) {
+    sha256_blocks_chosen = sha256_blocks_armv8;
+  }
+#elif defined(SHA256_ARMV8)
+  sha256_blocks_chosen = sha256_blocks_armv8;
+#endif
+}
+
+static void sha256_init(struct sha256_ctx *ctx) {
+  static const uint32_t iv[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372,
+                                 0xa54ff53a, 0x510e527f, 0x9b05688c,
+                                 0x1f83d9ab, 0x5be0cd19};
+  memcpy(ctx->state, iv, sizeof(iv));
+  ctx->bytes = 0;
+  ctx->fill = 0;
+  ctx->blocks = sha256_blocks_chosen;
+}
+
+static void sha256_update(struct sha256_ctx *ctx, const void *data,
+                          size_t len) {
+  const unsigned char *p = data;
+
+  ctx->bytes += len;
+  if (ctx->fill > 0) {
+    size_t n = 64 - ctx->fill < len ? 64 - ctx->fill : len;
+    memcpy(ctx->block + ctx->fill, p, n);
+    ctx->fill += n;
+    p += n;
+    len -= n;
+    if (ctx->fill < 64) {
+      return;
     }
+    ctx->blocks(ctx->state, ctx->block, 1);
+    ctx->fill = 0;
   }
-  return (0);
+  ctx->blocks(ctx->state, p, len / 64);
+  p += len - len % 64;
+  len %= 64;
+  memcpy(ctx->block, p, len);
+  ctx->fill = len;
 }
 
-static char *strip_components_path(const char *path, int strip) {
-  const char *p = path;
-  int remaining = strip;
+static void sha256_final(struct sha256_ctx *ctx, unsigned char out[32]) {
+  uint64_t bits = ctx->bytes * 8;
 
-  if (p == NULL) {
-    return (NULL);
+  ctx->block[ctx->fill++] = 0x80;
+  if (ctx->fill > 56) {
+    memset(ctx->block + ctx->fill, 0, 64 - ctx->fill);
+    ctx->blocks(ctx->state, ctx->block, 1);
+    ctx->fill = 0;
   }
-  if (strip <= 0) {
-    char *dup = strdup(p);
-    if (dup == NULL) {
-      fail_errno("strdup");
-    }
-    return (dup);
+  memset(ctx->block + ctx->fill, 0, 56 - ctx->fill);
+  store_be32(ctx->block + 56, (uint32_t)(bits >> 32));
+  store_be32(ctx->block + 60, (uint32_t)bits);
+  ctx->blocks(ctx->state, ctx->block, 1);
+  for (int i = 0; i < 8; i++) {
+    store_be32(out + 4 * i, ctx->state[i]);
   }
+}
 
-  while (remaining > 0) {
-    switch (*p++) {
-    case '/':
-#if defined(_WIN32) && !defined(__CYGWIN__)
-    case '\\':
-#endif
-      remaining--;
-      break;
-    case '\0':
-      return (NULL);
-    }
+static void sha256_hex(struct sha256_ctx *ctx, char out[65]) {
+  unsigned char digest[32];
+
+  sha256_final(ctx, digest);
+  for (int i = 0; i < 32; i++) {
+    snprintf(out + 2 * i, 3, "%02x", digest[i]);
   }
+}
 
-  for (;;) {
-    switch (*p) {
-    case '/':
-#if defined(_WIN32) && !defined(__CYGWIN__)
-    case '\\':
-#endif
-      ++p;
-      break;
-    case '\0':
-      return (NULL);
-    default: {
-      char *out = strdup(p);
-      if (out == NULL) {
-        fail_errno("strdup");
-      }
-      return (out);
+/*
+ * POSIX cksum, the CRC the Bom records for every file: polynomial
+ * 0x04C11DB7 fed most significant bit first, then the data length, then
+ * inverted. The running value is the CRC of the bytes so far.
+ */
+#define CKSUM_POLY 0x04c11db7u
+
+typedef uint32_t (*cksum_update_fn)(uint32_t crc, const unsigned char *p,
+                                    size_t len);
+
+static uint32_t cksum_table[8][256];
+
+static void cksum_table_init(void) {
+  for (uint32_t b = 0; b < 256; b++) {
+    uint32_t c = b << 24;
+    for (int k = 0; k < 8; k++) {
+      c = (c << 1) ^ (c & 0x80000000u ? CKSUM_POLY : 0);
     }
+    cksum_table[0][b] = c;
+  }
+  for (int t = 1; t < 8; t++) {
+    for (int b = 0; b < 256; b++) {
+      uint32_t c = cksum_table[t - 1][b];
+      cksum_table[t][b] = (c << 8) ^ cksum_table[0][c >> 24];
     }
   }
 }
 
-static int apply_strip_components(struct archive_entry *e, int strip) {
-  if (strip <= 0) {
-    return (0);
-  }
-
-  const char *name = archive_entry_pathname(e);
-  char *stripped = strip_components_path(name, strip);
-  if (stripped == NULL) {
-    return (1);
+/* Table lookups eight bytes at a time. */
+static uint32_t cksum_update_generic(uint32_t crc, const unsigned char *p,
+                                     size_t len) {
+  while (len >= 8) {
+    crc ^= load_be32(p);
+    crc = cksum_table[7][crc >> 24] ^ cksum_table[6][(crc >> 16) & 0xff] ^
+          cksum_table[5][(crc >> 8) & 0xff] ^ cksum_table[4][crc & 0xff] ^
+          cksum_table[3][p[4]] ^ cksum_table[2][p[5]] ^ cksum_table[1][p[6]] ^
+          cksum_table[0][p[7]];
+    p += 8;
+    len -= 8;
   }
-  archive_entry_set_pathname(e, stripped);
-  free(stripped);
-
-  const char *hardlink = archive_entry_hardlink(e);
-  if (hardlink != NULL) {
-    stripped = strip_components_path(hardlink, strip);
-    if (stripped == NULL) {
-      return (1);
-    }
-    archive_entry_set_hardlink(e, stripped);
-    free(stripped);
+  while (len-- > 0) {
+    crc = (crc << 8) ^ cksum_table[0][(crc >> 24) ^ *p++];
   }
-  return (0);
+  return (crc);
 }
 
-static int path_component_count(const char *path) {
-  int count = 0;
-  int in_component = 0;
+/* x^n mod P, the folding distances for the carry-less multiply kernels. */
+static uint64_t cksum_xpow(unsigned int n) {
+  uint32_t r = 1;
 
-  if (path == NULL) {
-    return (0);
+  while (n-- > 0) {
+    r = (r << 1) ^ (r & 0x80000000u ? CKSUM_POLY : 0);
   }
+  return (r);
+}
 
-  for (const char *p = path; *p != '\0'; p++) {
-    switch (*p) {
-    case '/':
-#if defined(_WIN32) && !defined(__CYGWIN__)
-    case '\\':
-#endif
-      in_component = 0;
-      break;
-    default:
-      if (!in_component) {
-        count++;
-        in_component = 1;
-      }
-      break;
-    }
-  }
+/*
+ * Carry-less multiply folding: with the bytes of each 16-byte block
+ * reversed, a block is the polynomial it stands for, and a block D bits
+ * ahead of the rest of the message is congruent to its high and low
+ * halves times x^(D+64) and x^D mod P. Four blocks are folded in parallel
+ * 64 bytes at a time, then into one, and the table finishes the last
+ * block and the tail.
+ */
+static uint64_t cksum_k128, cksum_k192, cksum_k512, cksum_k576;
 
-  return (count);
+#if defined(CKSUM_X86)
+__attribute__((target("pclmul,ssse3"))) static __m128i
+cksum_fold_clmul(__m128i a, __m128i k) {
+  return (_mm_xor_si128(_mm_clmulepi64_si128(a, k, 0x00),
+                        _mm_clmulepi64_si128(a, k, 0x11)));
 }
 
-static void pattern_list_add(struct pattern_list *list, const char *pattern) {
-  if (list->len == list->cap) {
-    size_t new_cap = list->cap == 0 ? 8 : list->cap * 2;
-    char **new_items = realloc(list->items, new_cap * sizeof(*new_items));
-    if (new_items == NULL) {
-      fail_errno("realloc");
-    }
-    list->items = new_items;
-    list->cap = new_cap;
+__attribute__((target("pclmul,ssse3"))) static uint32_t
+cksum_update_clmul(uint32_t crc, const unsigned char *p, size_t len) {
+  const __m128i rev =
+      _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+  const __m128i k1 = _mm_set_epi64x((long long)cksum_k192,
+                                    (long long)cksum_k128);
+  const __m128i k4 = _mm_set_epi64x((long long)cksum_k576,
+                                    (long long)cksum_k512);
+  __m128i a0, a1, a2, a3;
+  unsigned char last[16];
+
+  if (len < 64) {
+    return (cksum_update_generic(crc, p, len));
   }
-  char *dup = strdup(pattern);
-  if (dup == NULL) {
-    fail_errno("strdup");
+  a0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)p), rev);
+  a1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 16)), rev);
+  a2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 32)), rev);
+  a3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 48)), rev);
+  a0 = _mm_xor_si128(a0, _mm_set_epi32((int)crc, 0, 0, 0));
+  p += 64;
+  len -= 64;
+  while (len >= 64) {
+    a0 = _mm_xor_si128(cksum_fold_clmul(a0, k4),
+                       _mm_shuffle_epi8(
+                           _mm_loadu_si128((const __m128i *)p), rev));
+    a1 = _mm_xor_si128(cksum_fold_clmul(a1, k4),
+                       _mm_shuffle_epi8(
+                           _mm_loadu_si128((const __m128i *)(p + 16)), rev));
+    a2 = _mm_xor_si128(cksum_fold_clmul(a2, k4),
+                       _mm_shuffle_epi8(
+                           _mm_loadu_si128((const __m128i *)(p + 32)), rev));
+    a3 = _mm_xor_si128(cksum_fold_clmul(a3, k4),
+                       _mm_shuffle_epi8(
+                           _mm_loadu_si128((const __m128i *)(p + 48)), rev));
+    p += 64;
+    len -= 64;
   }
-  list->items[list->len++] = dup;
+  a0 = _mm_xor_si128(cksum_fold_clmul(a0, k1), a1);
+  a0 = _mm_xor_si128(cksum_fold_clmul(a0, k1), a2);
+  a0 = _mm_xor_si128(cksum_fold_clmul(a0, k1), a3);
+  while (len >= 16) {
+    a0 = _mm_xor_si128(cksum_fold_clmul(a0, k1),
+                       _mm_shuffle_epi8(
+                           _mm_loadu_si128((const __m128i *)p), rev));
+    p += 16;
+    len -= 16;
+  }
+  _mm_storeu_si128((__m128i *)last, _mm_shuffle_epi8(a0, rev));
+  crc = cksum_update_generic(0, last, sizeof(last));
+  return (cksum_update_generic(crc, p, len));
+}
+#endif
+
+#if defined(CKSUM_ARMV8)
+ARMV8_CRYPTO static uint8x16_t cksum_load_pmull(const unsigned char *p) {
+  uint8x16_t v = vrev64q_u8(vld1q_u8(p));
+  return (vextq_u8(v, v, 8));
 }
 
-static void pattern_list_free(struct pattern_list *list) {
-  for (size_t i = 0; i < list->len; i++) {
-    free(list->items[i]);
-  }
-  free(list->items);
-  list->items = NULL;
-  list->len = 0;
-  list->cap = 0;
+ARMV8_CRYPTO static uint8x16_t cksum_fold_pmull(uint8x16_t a, uint64_t lo,
+                                                uint64_t hi) {
+  uint64x2_t v = vreinterpretq_u64_u8(a);
+  poly128_t l = vmull_p64((poly64_t)vgetq_lane_u64(v, 0), (poly64_t)lo);
+  poly128_t h = vmull_p64((poly64_t)vgetq_lane_u64(v, 1), (poly64_t)hi);
+  return (veorq_u8(vreinterpretq_u8_p128(l), vreinterpretq_u8_p128(h)));
 }
 
-static int should_extract_path(struct archive *matching, const char *path) {
-  struct archive_entry *entry = archive_entry_new();
-  if (entry == NULL) {
-    fail_errno("archive_entry_new");
+ARMV8_CRYPTO static uint32_t cksum_update_pmull(uint32_t crc,
+                                                const unsigned char *p,
+                                                size_t len) {
+  uint8x16_t a0, a1, a2, a3;
+  unsigned char last[16];
+
+  if (len < 64) {
+    return (cksum_update_generic(crc, p, len));
   }
-  archive_entry_set_pathname(entry, path);
-  int excluded = archive_match_excluded(matching, entry);
-  archive_entry_free(entry);
-  if (excluded < 0) {
-    fail_archive(matching, "archive_match_excluded");
+  a0 = cksum_load_pmull(p);
+  a1 = cksum_load_pmull(p + 16);
+  a2 = cksum_load_pmull(p + 32);
+  a3 = cksum_load_pmull(p + 48);
+  a0 = veorq_u8(a0, vreinterpretq_u8_u32(
+                        vsetq_lane_u32(crc, vdupq_n_u32(0), 3)));
+  p += 64;
+  len -= 64;
+  while (len >= 64) {
+    a0 = veorq_u8(cksum_fold_pmull(a0, cksum_k512, cksum_k576),
+                  cksum_load_pmull(p));
+    a1 = veorq_u8(cksum_fold_pmull(a1, cksum_k512, cksum_k576),
+                  cksum_load_pmull(p + 16));
+    a2 = veorq_u8(cksum_fold_pmull(a2, cksum_k512, cksum_k576),
+                  cksum_load_pmull(p + 32));
+    a3 = veorq_u8(cksum_fold_pmull(a3, cksum_k512, cksum_k576),
+                  cksum_load_pmull(p + 48));
+    p += 64;
+    len -= 64;
   }
-  return (excluded == 0);
+  a0 = veorq_u8(cksum_fold_pmull(a0, cksum_k128, cksum_k192), a1);
+  a0 = veorq_u8(cksum_fold_pmull(a0, cksum_k128, cksum_k192), a2);
+  a0 = veorq_u8(cksum_fold_pmull(a0, cksum_k128, cksum_k192), a3);
+  while (len >= 16) {
+    a0 = veorq_u8(cksum_fold_pmull(a0, cksum_k128, cksum_k192),
+                  cksum_load_pmull(p));
+    p += 16;
+    len -= 16;
+  }
+  a0 = vrev64q_u8(a0);
+  vst1q_u8(last, vextq_u8(a0, a0, 8));
+  crc = cksum_update_generic(0, last, sizeof(last));
+  return (cksum_update_generic(crc, p, len));
 }
+#endif
 
-static int has_include_descendant(const struct pattern_list *includes,
-                                  const char *path) {
-  size_t plen = strlen(path);
-  for (size_t i = 0; i < includes->len; i++) {
-    const char *pat = includes->items[i];
-    if (strncmp(pat, path, plen) == 0 && pat[plen] == '/') {
-      return (1);
-    }
+/*
+ * Set by cksum_kernel_init() in main(), together with the tables and
+ * constants, before any worker thread can read them.
+ */
+static cksum_update_fn cksum_update_chosen = cksum_update_generic;
+
+static void cksum_kernel_init(void) {
+  cksum_table_init();
+  cksum_k128 = cksum_xpow(128);
+  cksum_k192 = cksum_xpow(192);
+  cksum_k512 = cksum_xpow(512);
+  cksum_k576 = cksum_xpow(576);
+#if defined(CKSUM_X86)
+  unsigned int a, b, c, d;
+  if (__get_cpuid(1, &a, &b, &c, &d) && (c & bit_PCLMUL) && (c & bit_SSSE3)) {
+    cksum_update_chosen = cksum_update_clmul;
   }
-  return (0);
+#elif defined(CKSUM_ARMV8) && defined(__linux__)
+  if ((getauxval(AT_HWCAP) & HWCAP_PMULL) != 0) {
+    cksum_update_chosen = cksum_update_pmull;
+  }
+#elif defined(CKSUM_ARMV8)
+  cksum_update_chosen = cksum_update_pmull;
+#endif
 }
 
-static char *join_prefix_path(const char *prefix, const char *path) {
-  if (prefix == NULL || prefix[0] == '\0' ||
-      (prefix[0] == '.' && prefix[1] == '\0')) {
-    char *dup = strdup(path);
-    if (dup == NULL) {
-      fail_errno("strdup");
-    }
-    return (dup);
+static uint32_t cksum_update(uint32_t crc, const void *data, size_t len) {
+  return (cksum_update_chosen(crc, data, len));
+}
+
+/* Append the length, least significant byte first, and invert. */
+static uint32_t cksum_final(uint32_t crc, la_int64_t size) {
+  uint64_t n = (uint64_t)size;
+  unsigned char b[8];
+  size_t len = 0;
+
+  for (; n != 0; n >>= 8) {
+    b[len++] = (unsigned char)n;
   }
-  size_t plen = strlen(prefix);
-  size_t path_len = strlen(path);
-  size_t total = plen + 1 + path_len + 1;
-  char *buf = malloc(total);
+  return (~cksum_update(crc, b, len));
+}
+
+enum cache_policy {
+  cache_policy_keep = 0,
+  cache_policy_drop,
+};
+
+enum sync_policy {
+  sync_policy_none = 0,
+  sync_policy_end,
+  sync_policy_per_file,
+};
+
+enum incremental_mode {
+  incremental_off = 0,
+  incremental_mtime,
+  incremental_content,
+};
+
+enum dedup_mode {
+  dedup_off = 0,
+  dedup_hardlink,
+  dedup_reflink,
+};
+
+enum output_format {
+  output_format_dir = 0,
+  output_format_tar,
+  output_format_tar_zstd,
+  output_format_squashfs,
+  output_format_cas,
+};
+
+struct writeback_queue;
+struct aligned_pool;
+struct squashfs_image;
+#if !defined(_WIN32)
+static int image_entry(struct archive *a, struct archive_entry *e,
+                       const char *outdir, struct squashfs_image *img);
+#endif
+/* --verify-bom state; keys are Payload paths as in the pkg. */
+struct bom_verify {
+  /* Bom records, loaded as each Bom member goes by. */
+  struct string_map expected;
+  /* cksum and size of each regular file extracted from a Payload. */
+  struct string_map actual;
+  /* Payloads extracted, and the Payloads a Bom was loaded for. */
+  struct pattern_list payloads;
+  struct pattern_list boms;
+  /* Set by extract_regular_file() for the entry it just wrote. */
+  int written;
+  uint32_t cksum;
+};
+struct cas_output;
+#if !defined(_WIN32)
+static void bom_record_entry(struct bom_verify *bom, const char *prefix,
+                             const char *rel, const char *link_rel,
+                             struct archive_entry *e);
+static int cas_entry(struct archive *a, struct archive_entry *e,
+                     const char *outdir, struct cas_output *cas);
+#endif
+
+/* --cat: the one pkg path to copy to stdout, and how far it has got. */
+struct cat_target {
+  const char *path;
+  /* Pkg path of the first link, when the data comes with a later one. */
+  char *alias;
+  int found;
+  int done;
+};
+
+struct write_options {
+  int sparse;
+  enum cache_policy cache_policy;
+  la_int64_t direct_threshold;
+  enum sync_policy sync;
+  enum incremental_mode incremental;
+  enum dedup_mode dedup;
+  /* Process umask, which the disk writer applies to entry modes. */
+  mode_t umask;
+  /* Absolute path of the top-level outdir. */
+  const char *root;
+  struct writeback_queue *writeback;
+  struct aligned_pool *pool;
+  /* Paths written so far, relative to the top-level outdir. */
+  struct pattern_list *written;
+  /* Every output path the package still provides, with its parents. */
+  struct string_map *seen;
+  /* Content digest and size of written files to their dedup_source. */
+  struct string_map *digests;
+  /* Absolute path of a previous extraction to link unchanged files from. */
+  const char *link_dest;
+  /* Directory of decoded Payloads, keyed by pkg_id and member path. */
+  const char *payload_cache;
+  const char *pkg_id;
+  /* Directory of decoded pbzx chunks, keyed by their compressed bytes. */
+  const char *pbzx_cache;
+  /* --output-format archive writer; entries go here instead of the disk. */
+  struct archive *stream;
+  /* --output-format squashfs image; entries go here instead of the disk. */
+  struct squashfs_image *image;
+  /* --output-format cas store and manifest. */
+  struct cas_output *cas;
+  /* --hash-manifest: output path to hex SHA-256 of each regular file. */
+  struct string_map *hashes;
+  /* --verify-bom: Payload checksums and the Bom records to check them. */
+  struct bom_verify *bom;
+  /* --verify --repair: the only pkg paths to extract, Payloads included. */
+  const struct string_map *only;
+  /* --cat: stream this one entry to stdout instead of extracting. */
+  struct cat_target *cat;
+};
+
+static int write_options_need_fd(const struct write_options *wopts) {
+  return (wopts->sparse || wopts->cache_policy == cache_policy_drop ||
+          wopts->direct_threshold > 0 || wopts->sync == sync_policy_per_file ||
+          wopts->dedup != dedup_off || wopts->link_dest != NULL ||
+          wopts->hashes != NULL || wopts->bom != NULL);
+}
+
+/* Adds path and its parents, stopping at the first one already known. */
+static void record_seen_path(const struct write_options *wopts, char *path) {
+  char *slash;
+
+  if (wopts->seen == NULL) {
+    return;
+  }
+  while (string_map_put(wopts->seen, path, wopts->seen) &&
+         (slash = strrchr(path, '/')) != NULL) {
+    *slash = '\0';
+  }
+}
+
+#if !defined(_WIN32)
+static void record_file_digest(const struct write_options *wopts,
+                               const char *path, const char hex[65]) {
+  char *old = string_map_get(wopts->hashes, path);
+
+  if (old != NULL) {
+    memcpy(old, hex, 65);
+    return;
+  }
+  char *dup = strdup(hex);
+  if (dup == NULL) {
+    fail_errno("strdup");
+  }
+  string_map_put(wopts->hashes, path, dup);
+}
+
+/*
+ * Files written through extract_regular_file() were hashed on the way
+ * out. Hardlinks, files kept by --incremental or shared by --dedup and
+ * --link-dest are read back instead.
+ */
+static void record_file_hash(const struct write_options *wopts,
+                             const char *outdir, const char *path,
+                             struct archive_entry *e) {
+  const char *hardlink = archive_entry_hardlink(e);
+  unsigned char *buf;
+  struct sha256_ctx ctx;
+  char hex[65];
+  int fd;
+
+  if (archive_entry_filetype(e) != AE_IFREG ||
+      (hardlink == NULL && string_map_get(wopts->hashes, path) != NULL)) {
+    return;
+  }
+  fd = open(archive_entry_pathname(e), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    fail_errno(path);
+  }
+  buf = malloc(INPUT_BLOCK);
   if (buf == NULL) {
     fail_errno("malloc");
   }
-  memcpy(buf, prefix, plen);
-  buf[plen] = '/';
-  memcpy(buf + plen + 1, path, path_len + 1);
-  return (buf);
+  sha256_init(&ctx);
+  for (;;) {
+    ssize_t n = read(fd, buf, INPUT_BLOCK);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      fail_errno(path);
+    }
+    if (n == 0) {
+      break;
+    }
+    sha256_update(&ctx, buf, (size_t)n);
+  }
+  free(buf);
+  close(fd);
+  sha256_hex(&ctx, hex);
+  record_file_digest(wopts, path, hex);
+  if (hardlink != NULL) {
+    /* cpio may carry the shared data with the last name only. */
+    char *target = join_prefix_path(outdir, hardlink);
+    record_file_digest(wopts, target, hex);
+    free(target);
+  }
+}
+#endif
+
+static void record_output_path(const struct write_options *wopts,
+                               const char *outdir, struct archive_entry *e) {
+  if (wopts->written == NULL && wopts->seen == NULL &&
+      wopts->hashes == NULL) {
+    return;
+  }
+  char *path = join_prefix_path(outdir, archive_entry_pathname(e));
+  if (wopts->written != NULL) {
+    pattern_list_add(wopts->written, path);
+  }
+#if !defined(_WIN32)
+  if (wopts->hashes != NULL) {
+    record_file_hash(wopts, outdir, path, e);
+  }
+#endif
+  record_seen_path(wopts, path);
+  free(path);
+}
+
+static int is_zero_block(const unsigned char *p, size_t len) {
+  uint64_t acc = 0;
+  size_t i = 0;
+
+  /* Plain 64-byte strides of OR-ed words; compilers turn this into SIMD. */
+  for (; i + 64 <= len; i += 64) {
+    uint64_t w[8];
+    memcpy(w, p + i, sizeof(w));
+    acc |= w[0] | w[1] | w[2] | w[3] | w[4] | w[5] | w[6] | w[7];
+    if (acc != 0) {
+      return (0);
+    }
+  }
+  for (; i < len; i++) {
+    acc |= p[i];
+  }
+  return (acc == 0);
+}
+
+/*
+ * Digests of an entry's data as it streams by. Holes left by sparse entries
+ * are hashed as the zeros they read back as.
+ */
+enum {
+  content_hash_sha256 = 1,
+  content_hash_cksum = 2,
+};
+
+struct content_hash {
+  int kinds;
+  struct sha256_ctx sha256;
+  uint32_t cksum;
+  la_int64_t next;
+};
+
+static void content_hash_init(struct content_hash *h, int kinds) {
+  h->kinds = kinds;
+  if (kinds & content_hash_sha256) {
+    sha256_init(&h->sha256);
+  }
+  h->cksum = 0;
+  h->next = 0;
+}
+
+static void content_hash_data(struct content_hash *h, const void *buf,
+                              size_t len) {
+  if (h->kinds & content_hash_sha256) {
+    sha256_update(&h->sha256, buf, len);
+  }
+  if (h->kinds & content_hash_cksum) {
+    h->cksum = cksum_update(h->cksum, buf, len);
+  }
+}
+
+static void content_hash_zeros(struct content_hash *h, la_int64_t end) {
+  static const unsigned char zeros[SPARSE_BLOCK];
+
+  while (h->next < end) {
+    size_t n = end - h->next > SPARSE_BLOCK ? SPARSE_BLOCK
+                                            : (size_t)(end - h->next);
+    content_hash_data(h, zeros, n);
+    h->next += (la_int64_t)n;
+  }
+}
+
+static void content_hash_update(struct content_hash *h, const void *buf,
+                                size_t len, la_int64_t off) {
+  content_hash_zeros(h, off);
+  content_hash_data(h, buf, len);
+  h->next = off + (la_int64_t)len;
+}
+
+/* Finish the digest as "<size>:<hex sha256>", the dedup table key. */
+static void content_hash_key(struct content_hash *h, la_int64_t size,
+                             char key[96]) {
+  unsigned char digest[32];
+  int n;
+
+  content_hash_zeros(h, size);
+  sha256_final(&h->sha256, digest);
+  n = snprintf(key, 96, "%" PRId64 ":", (int64_t)size);
+  for (int i = 0; i < 32; i++) {
+    n += snprintf(key + n, (size_t)(96 - n), "%02x", digest[i]);
+  }
+}
+
+#if !defined(_WIN32)
+static void cache_drop_range(int fd, la_int64_t off, la_int64_t len) {
+#if defined(POSIX_FADV_DONTNEED)
+  (void)posix_fadvise(fd, (off_t)off, (off_t)len, POSIX_FADV_DONTNEED);
+#else
+  (void)fd;
+  (void)off;
+  (void)len;
+#endif
+}
+
+static void writeback_start(int fd, la_int64_t off, la_int64_t len) {
+#if defined(SYNC_FILE_RANGE_WRITE)
+  (void)sync_file_range(fd, (off_t)off, (off_t)len, SYNC_FILE_RANGE_WRITE);
+#else
+  (void)fd;
+  (void)off;
+  (void)len;
+#endif
+}
+
+static void writeback_wait(int fd, la_int64_t off, la_int64_t len) {
+#if defined(SYNC_FILE_RANGE_WRITE)
+  (void)sync_file_range(fd, (off_t)off, (off_t)len,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                            SYNC_FILE_RANGE_WAIT_AFTER);
+#else
+  (void)fd;
+  (void)off;
+  (void)len;
+#endif
+}
+
+static void cache_policy_setup_fd(int fd) {
+#if defined(F_NOCACHE) && !defined(POSIX_FADV_DONTNEED)
+  /* macOS has no fadvise; ask for uncached I/O on the descriptor instead. */
+  (void)fcntl(fd, F_NOCACHE, 1);
+#else
+  (void)fd;
+#endif
+}
+
+/*
+ * Files whose writeback was started but not yet waited on. Once the queue is
+ * full the oldest file has usually hit the disk already, so waiting on it and
+ * dropping its pages is cheap and keeps the written set out of the page
+ * cache without stalling on every close.
+ */
+struct writeback_queue {
+  int fds[WRITEBACK_QUEUE];
+  size_t head;
+  size_t len;
+};
+
+static void writeback_queue_retire(struct writeback_queue *q) {
+  int fd = q->fds[q->head];
+
+  q->head = (q->head + 1) % WRITEBACK_QUEUE;
+  q->len--;
+  writeback_wait(fd, 0, 0);
+  cache_drop_range(fd, 0, 0);
+  if (close(fd) != 0) {
+    fail_errno("close");
+  }
+}
+
+static void writeback_queue_push(struct writeback_queue *q, int fd) {
+  if (q->len == WRITEBACK_QUEUE) {
+    writeback_queue_retire(q);
+  }
+  q->fds[(q->head + q->len) % WRITEBACK_QUEUE] = fd;
+  q->len++;
+}
+
+static void writeback_queue_drain(struct writeback_queue *q) {
+  while (q->len > 0) {
+    writeback_queue_retire(q);
+  }
+}
+
+/*
+ * DIRECT_ALIGN-aligned staging buffers for direct I/O. Allocated once and
+ * recycled across files instead of per file.
+ */
+struct aligned_pool {
+  void *free[ALIGNED_POOL_SIZE];
+  size_t len;
+};
+
+static unsigned char *aligned_pool_get(struct aligned_pool *pool) {
+  void *buf;
+  int err;
+
+  if (pool->len > 0) {
+    return (pool->free[--pool->len]);
+  }
+  err = posix_memalign(&buf, DIRECT_ALIGN, DIRECT_BUFFER);
+  if (err != 0) {
+    errno = err;
+    fail_errno("posix_memalign");
+  }
+  return (buf);
+}
+
+static void aligned_pool_put(struct aligned_pool *pool, unsigned char *buf) {
+  if (pool->len == ALIGNED_POOL_SIZE) {
+    free(buf);
+    return;
+  }
+  pool->free[pool->len++] = buf;
+}
+
+static void aligned_pool_free(struct aligned_pool *pool) {
+  while (pool->len > 0) {
+    free(pool->free[--pool->len]);
+  }
+}
+
+static int direct_io_enable(int fd) {
+#if defined(O_DIRECT)
+  int fl = fcntl(fd, F_GETFL);
+  return (fl >= 0 && fcntl(fd, F_SETFL, fl | O_DIRECT) == 0);
+#elif defined(F_NOCACHE)
+  return (fcntl(fd, F_NOCACHE, 1) == 0);
+#else
+  (void)fd;
+  return (0);
+#endif
+}
+
+static void direct_io_disable(int fd) {
+#if defined(O_DIRECT)
+  int fl = fcntl(fd, F_GETFL);
+  if (fl >= 0) {
+    (void)fcntl(fd, F_SETFL, fl & ~O_DIRECT);
+  }
+#else
+  (void)fd;
+#endif
+}
+
+struct file_writer {
+  int fd;
+  int sparse;
+  int drop_cache;
+  int sync;
+  /* Overwriting an existing file rather than filling a fresh one. */
+  int in_place;
+  la_int64_t end;
+  la_int64_t flushed;
+  la_int64_t dropped;
+  /* Direct I/O staging: dlen bytes of dbuf belong at file offset dbase. */
+  unsigned char *dbuf;
+  size_t dlen;
+  la_int64_t dbase;
+};
+
+/*
+ * Start writeback of everything written since the last window, then wait on
+ * and drop the window before it, so at most two windows of a large file are
+ * dirty in the page cache at any time.
+ */
+static void file_writer_writeback(struct file_writer *fw) {
+  if (!fw->drop_cache || fw->end - fw->flushed < WRITEBACK_WINDOW) {
+    return;
+  }
+  writeback_start(fw->fd, fw->flushed, fw->end - fw->flushed);
+  if (fw->flushed > fw->dropped) {
+    writeback_wait(fw->fd, fw->dropped, fw->flushed - fw->dropped);
+    cache_drop_range(fw->fd, fw->dropped, fw->flushed - fw->dropped);
+    fw->dropped = fw->flushed;
+  }
+  fw->flushed = fw->end;
+}
+
+static int write_full_at(int fd, const unsigned char *buf, size_t len,
+                         la_int64_t off) {
+  while (len > 0) {
+    ssize_t n = pwrite(fd, buf, len, (off_t)off);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return (-1);
+    }
+    buf += n;
+    len -= (size_t)n;
+    off += n;
+  }
+  return (0);
+}
+
+/*
+ * Turn [off, off + len) of an existing file into zeros, as a hole where the
+ * filesystem can punch one and with plain writes otherwise.
+ */
+static int zero_range(int fd, la_int64_t off, la_int64_t len) {
+  static const unsigned char zeros[SPARSE_BLOCK];
+
+#if defined(FALLOC_FL_PUNCH_HOLE)
+  if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)off,
+                (off_t)len) == 0) {
+    return (0);
+  }
+  if (errno != EOPNOTSUPP && errno != ENOSYS) {
+    return (-1);
+  }
+#elif defined(F_PUNCHHOLE)
+  struct fpunchhole hole = {0, 0, (off_t)off, (off_t)len};
+  if (fcntl(fd, F_PUNCHHOLE, &hole) == 0) {
+    return (0);
+  }
+#endif
+  while (len > 0) {
+    size_t n = len > SPARSE_BLOCK ? SPARSE_BLOCK : (size_t)len;
+    if (write_full_at(fd, zeros, n, off) != 0) {
+      return (-1);
+    }
+    off += (la_int64_t)n;
+    len -= (la_int64_t)n;
+  }
+  return (0);
+}
+
+static int file_writer_put_run(struct file_writer *fw, const unsigned char *buf,
+                               size_t len, la_int64_t off, int zero) {
+  if (zero) {
+    /* Fresh files read back zeros over a skipped range; reused ones not. */
+    if (fw->in_place) {
+      if (zero_range(fw->fd, off, (la_int64_t)len) != 0) {
+        return (-1);
+      }
+      if (off + (la_int64_t)len > fw->end) {
+        fw->end = off + (la_int64_t)len;
+      }
+    }
+    return (0);
+  }
+  if (write_full_at(fw->fd, buf, len, off) != 0) {
+    return (-1);
+  }
+  if (off + (la_int64_t)len > fw->end) {
+    fw->end = off + (la_int64_t)len;
+  }
+  return (0);
+}
+
+static int file_writer_put(struct file_writer *fw, const unsigned char *buf,
+                           size_t len, la_int64_t off) {
+  size_t pos = 0;
+  size_t run = 0;
+  int run_zero = 0;
+
+  if (!fw->sparse) {
+    return (file_writer_put_run(fw, buf, len, off, 0));
+  }
+
+  /*
+   * Walk the block in SPARSE_BLOCK-aligned chunks of the output file,
+   * coalescing data chunks into one write and zero chunks into one hole.
+   */
+  while (pos < len) {
+    size_t chunk = SPARSE_BLOCK - (size_t)((off + pos) % SPARSE_BLOCK);
+    if (chunk > len - pos) {
+      chunk = len - pos;
+    }
+    int zero = is_zero_block(buf + pos, chunk);
+    if (run > 0 && zero != run_zero) {
+      if (file_writer_put_run(fw, buf + pos - run, run,
+                              off + (la_int64_t)(pos - run), run_zero) != 0) {
+        return (-1);
+      }
+      run = 0;
+    }
+    run_zero = zero;
+    run += chunk;
+    pos += chunk;
+  }
+  if (run > 0) {
+    return (file_writer_put_run(fw, buf + len - run, run,
+                                off + (la_int64_t)(len - run), run_zero));
+  }
+  return (0);
+}
+
+/*
+ * Write out the staged direct I/O buffer. Only whole DIRECT_ALIGN blocks can
+ * go through O_DIRECT; an unaligned tail is written buffered. Filesystems
+ * that accept the flag but reject the write with EINVAL also fall back to
+ * buffered writes for the rest of the file.
+ */
+static int file_writer_flush_direct(struct file_writer *fw, int final) {
+  size_t aligned = fw->dlen - fw->dlen % DIRECT_ALIGN;
+  size_t tail = fw->dlen - aligned;
+
+  if (aligned > 0 && file_writer_put(fw, fw->dbuf, aligned, fw->dbase) != 0) {
+    if (errno != EINVAL) {
+      return (-1);
+    }
+    direct_io_disable(fw->fd);
+    if (file_writer_put(fw, fw->dbuf, aligned, fw->dbase) != 0) {
+      return (-1);
+    }
+  }
+  if (tail > 0) {
+    if (!final) {
+      memmove(fw->dbuf, fw->dbuf + aligned, tail);
+      fw->dbase += (la_int64_t)aligned;
+      fw->dlen = tail;
+      return (0);
+    }
+    direct_io_disable(fw->fd);
+    if (file_writer_put(fw, fw->dbuf + aligned, tail,
+                        fw->dbase + (la_int64_t)aligned) != 0) {
+      return (-1);
+    }
+  }
+  fw->dbase += (la_int64_t)fw->dlen;
+  fw->dlen = 0;
+  return (0);
+}
+
+static int file_writer_write(struct file_writer *fw, const unsigned char *buf,
+                             size_t len, la_int64_t off) {
+  if (fw->dbuf != NULL && off != fw->dbase + (la_int64_t)fw->dlen) {
+    /* Out-of-order data: drain the staging buffer and stay buffered. */
+    if (file_writer_flush_direct(fw, 1) != 0) {
+      return (-1);
+    }
+    direct_io_disable(fw->fd);
+    fw->dbuf = NULL;
+  }
+  if (fw->in_place && off > fw->end) {
+    /* A gap in the data is a hole in the entry; clear the old bytes. */
+    if (zero_range(fw->fd, fw->end, off - fw->end) != 0) {
+      return (-1);
+    }
+    fw->end = off;
+  }
+  if (fw->dbuf == NULL) {
+    if (file_writer_put(fw, buf, len, off) != 0) {
+      return (-1);
+    }
+    file_writer_writeback(fw);
+    return (0);
+  }
+  while (len > 0) {
+    size_t n = DIRECT_BUFFER - fw->dlen;
+    if (n > len) {
+      n = len;
+    }
+    memcpy(fw->dbuf + fw->dlen, buf, n);
+    fw->dlen += n;
+    buf += n;
+    len -= n;
+    if (fw->dlen == DIRECT_BUFFER) {
+      if (file_writer_flush_direct(fw, 0) != 0) {
+        return (-1);
+      }
+      file_writer_writeback(fw);
+    }
+  }
+  return (0);
+}
+
+static int file_writer_finish(struct file_writer *fw, struct archive_entry *e) {
+  la_int64_t size = archive_entry_size(e);
+
+  if (fw->dbuf != NULL && file_writer_flush_direct(fw, 1) != 0) {
+    return (-1);
+  }
+
+  /* A trailing hole has to be materialized by extending the file. */
+  if (fw->end < size) {
+    if (fw->in_place) {
+      if (zero_range(fw->fd, fw->end, size - fw->end) != 0) {
+        return (-1);
+      }
+    } else if (ftruncate(fw->fd, (off_t)size) != 0) {
+      return (-1);
+    }
+  }
+  if (archive_entry_mtime_is_set(e)) {
+    struct timespec ts[2];
+    ts[0].tv_sec = 0;
+    ts[0].tv_nsec = UTIME_OMIT;
+    if (archive_entry_atime_is_set(e)) {
+      ts[0].tv_sec = archive_entry_atime(e);
+      ts[0].tv_nsec = archive_entry_atime_nsec(e);
+    }
+    ts[1].tv_sec = archive_entry_mtime(e);
+    ts[1].tv_nsec = archive_entry_mtime_nsec(e);
+    if (futimens(fw->fd, ts) != 0) {
+      return (-1);
+    }
+  }
+  if (fw->sync) {
+    if (fsync(fw->fd) != 0) {
+      return (-1);
+    }
+    fw->flushed = fw->end;
+  }
+  if (fw->drop_cache && fw->end > fw->flushed) {
+    writeback_start(fw->fd, fw->flushed, fw->end - fw->flushed);
+    fw->flushed = fw->end;
+  }
+  return (0);
+}
+
+static int copy_data_to_writer(struct archive *a, struct archive_entry *e,
+                               struct file_writer *fw,
+                               struct content_hash *hash) {
+  const void *buf;
+  size_t len;
+  la_int64_t off;
+  int r;
+
+  while ((r = archive_read_data_block(a, &buf, &len, &off)) == ARCHIVE_OK) {
+    if (hash != NULL) {
+      content_hash_update(hash, buf, len, off);
+    }
+    if (file_writer_write(fw, buf, len, off) != 0) {
+      archive_set_error(a, errno, "write(%s): %s", archive_entry_pathname(e),
+                        strerror(errno));
+      return (ARCHIVE_FATAL);
+    }
+  }
+  if (r != ARCHIVE_EOF) {
+    return (r);
+  }
+  if (file_writer_finish(fw, e) != 0) {
+    archive_set_error(a, errno, "finish(%s): %s", archive_entry_pathname(e),
+                      strerror(errno));
+    return (ARCHIVE_FATAL);
+  }
+  return (ARCHIVE_OK);
+}
+
+static int file_writer_close(struct archive *a, struct archive_entry *e,
+                             struct file_writer *fw,
+                             const struct write_options *wopts) {
+  if (fw->drop_cache && wopts->writeback != NULL) {
+    writeback_queue_push(wopts->writeback, fw->fd);
+    return (ARCHIVE_OK);
+  }
+  if (close(fw->fd) != 0) {
+    archive_set_error(a, errno, "close(%s): %s", archive_entry_pathname(e),
+                      strerror(errno));
+    return (ARCHIVE_FATAL);
+  }
+  return (ARCHIVE_OK);
+}
+
+/* Number of leading bytes of buf that the file already holds at off. */
+static ssize_t matching_prefix(int fd, const unsigned char *buf, size_t len,
+                               la_int64_t off, unsigned char *scratch) {
+  size_t same = 0;
+
+  while (same < len) {
+    size_t want = len - same > INPUT_BLOCK ? INPUT_BLOCK : len - same;
+    ssize_t n = pread(fd, scratch, want, (off_t)(off + (la_int64_t)same));
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return (-1);
+    }
+    for (ssize_t i = 0; i < n; i++) {
+      if (scratch[i] != buf[same + (size_t)i]) {
+        return ((ssize_t)same + i);
+      }
+    }
+    if (n == 0) {
+      break;
+    }
+    same += (size_t)n;
+  }
+  return ((ssize_t)same);
+}
+
+struct dedup_source {
+  char *path;
+  int perm;
+  time_t mtime;
+};
+
+static void dedup_source_free(void *value) {
+  struct dedup_source *src = value;
+
+  free(src->path);
+  free(src);
+}
+
+static char *tree_path(const char *base, const char *outdir,
+                       const char *path) {
+  char *rel = join_prefix_path(outdir, path);
+  char *abs = join_prefix_path(base, rel);
+
+  free(rel);
+  return (abs);
+}
+
+static char *sibling_temp_path(const char *path) {
+  size_t len = strlen(path) + 32;
+  char *tmp = malloc(len);
+
+  if (tmp == NULL) {
+    fail_errno("malloc");
+  }
+  snprintf(tmp, len, "%s.pkgutil-%ld", path, (long)getpid());
+  return (tmp);
+}
+
+/* Put a link or copy-on-write clone of src at path, replacing it. */
+static int replace_with_link(const char *src, const char *path) {
+  char *tmp = sibling_temp_path(path);
+  int r = link(src, tmp);
+
+  if (r == 0 && (r = rename(tmp, path)) != 0) {
+    unlink(tmp);
+  }
+  free(tmp);
+  return (r);
+}
+
+/*
+ * Clone src's data into the just-created file at fw. Returns 0 when fw
+ * now holds the data and still needs finishing, 1 when the path was
+ * replaced by a complete clone, -1 when the filesystem cannot share the
+ * data, leaving fw untouched.
+ */
+static int clone_file_data(const char *src, struct archive_entry *e,
+                           struct file_writer *fw) {
+#if defined(__linux__)
+  int sfd = open(src, O_RDONLY | O_CLOEXEC);
+  if (sfd < 0) {
+    return (-1);
+  }
+  int r = ioctl(fw->fd, FICLONE, sfd);
+  close(sfd);
+  if (r != 0) {
+    return (-1);
+  }
+  fw->end = archive_entry_size(e);
+  return (0);
+#elif defined(__APPLE__)
+  const char *path = archive_entry_pathname(e);
+  char *tmp = sibling_temp_path(path);
+  int r = clonefile(src, tmp, 0);
+  if (r == 0 && (r = rename(tmp, path)) != 0) {
+    unlink(tmp);
+  }
+  free(tmp);
+  if (r != 0) {
+    return (-1);
+  }
+  /* The clone carries src's mode and times. */
+  struct timespec ts[2] = {{0, UTIME_OMIT},
+                           {archive_entry_mtime(e), archive_entry_mtime_nsec(e)}};
+  (void)chmod(path, archive_entry_perm(e));
+  (void)utimensat(AT_FDCWD, path, ts, AT_SYMLINK_NOFOLLOW);
+  return (1);
+#else
+  (void)src;
+  (void)e;
+  (void)fw;
+  return (-1);
+#endif
+}
+
+/*
+ * Share the data of an existing file src with the entry just created at
+ * fw: a hardlink when the metadata allows it, a clone otherwise. Returns
+ * as clone_file_data().
+ */
+static int share_file_data(const char *src, int src_perm, time_t src_mtime,
+                           struct archive_entry *e, struct file_writer *fw,
+                           enum dedup_mode mode) {
+  if (mode == dedup_hardlink) {
+    /* Links share mode and times, so only equal metadata may be merged. */
+    if (src_perm != (int)archive_entry_perm(e) ||
+        src_mtime != archive_entry_mtime(e)) {
+      return (-1);
+    }
+    return (replace_with_link(src, archive_entry_pathname(e)) == 0 ? 1 : -1);
+  }
+  return (clone_file_data(src, e, fw));
+}
+
+static int dedup_materialize(const struct dedup_source *src,
+                             struct archive_entry *e, struct file_writer *fw,
+                             enum dedup_mode mode) {
+  return (share_file_data(src->path, src->perm, src->mtime, e, fw, mode));
+}
+
+/*
+ * Stream a regular file while hashing it and share its data with an
+ * identical file written earlier in the run, in any nested archive. Files
+ * up to DEDUP_BUFFER_MAX are hashed before anything is written, so a
+ * duplicate costs no data writes at all; larger ones are written first
+ * and then replaced by the link or clone.
+ */
+static int copy_data_deduplicated(struct archive *a, struct archive_entry *e,
+                                  struct file_writer *fw, const char *outdir,
+                                  const struct write_options *wopts,
+                                  int *done) {
+  la_int64_t size = archive_entry_size(e);
+  struct content_hash hash;
+  struct dedup_source *src;
+  char key[96];
+  int r;
+
+  *done = 0;
+  content_hash_init(&hash, content_hash_sha256);
+  if (size <= DEDUP_BUFFER_MAX) {
+    unsigned char *data = calloc(1, (size_t)size);
+    const void *buf;
+    size_t len;
+    la_int64_t off;
+
+    if (data == NULL) {
+      fail_errno("calloc");
+    }
+    while ((r = archive_read_data_block(a, &buf, &len, &off)) == ARCHIVE_OK) {
+      if (off < 0 || off + (la_int64_t)len > size) {
+        free(data);
+        archive_set_error(a, EINVAL,
+                          "%s: data exceeds entry size",
+                          archive_entry_pathname(e));
+        return (ARCHIVE_FATAL);
+      }
+      memcpy(data + off, buf, len);
+    }
+    if (r != ARCHIVE_EOF) {
+      free(data);
+      return (r);
+    }
+    content_hash_update(&hash, data, (size_t)size, 0);
+    content_hash_key(&hash, size, key);
+    src = string_map_get(wopts->digests, key);
+    if (src != NULL && (r = dedup_materialize(src, e, fw, wopts->dedup)) >= 0) {
+      free(data);
+      *done = r;
+      return (r == 0 && file_writer_finish(fw, e) != 0 ? ARCHIVE_FATAL
+                                                       : ARCHIVE_OK);
+    }
+    if (file_writer_write(fw, data, (size_t)size, 0) != 0 ||
+        file_writer_finish(fw, e) != 0) {
+      free(data);
+      archive_set_error(a, errno, "write(%s): %s", archive_entry_pathname(e),
+                        strerror(errno));
+      return (ARCHIVE_FATAL);
+    }
+    free(data);
+  } else {
+    r = copy_data_to_writer(a, e, fw, &hash);
+    if (r != ARCHIVE_OK) {
+      return (r);
+    }
+    content_hash_key(&hash, size, key);
+    src = string_map_get(wopts->digests, key);
+    if (src != NULL && (r = dedup_materialize(src, e, fw, wopts->dedup)) >= 0) {
+      *done = r;
+      return (r == 0 && file_writer_finish(fw, e) != 0 ? ARCHIVE_FATAL
+                                                       : ARCHIVE_OK);
+    }
+  }
+
+  if (string_map_get(wopts->digests, key) == NULL) {
+    src = malloc(sizeof(*src));
+    if (src == NULL) {
+      fail_errno("malloc");
+    }
+    src->path = tree_path(wopts->root, outdir, archive_entry_pathname(e));
+    src->perm = (int)archive_entry_perm(e);
+    src->mtime = archive_entry_mtime(e);
+    string_map_put(wopts->digests, key, src);
+  }
+  return (ARCHIVE_OK);
+}
+
+/* Copy the first len bytes of the reference file at rfd through fw. */
+static int copy_reference_prefix(struct file_writer *fw, int rfd,
+                                 la_int64_t len, unsigned char *scratch) {
+  la_int64_t off = 0;
+
+  while (off < len) {
+    size_t want = len - off > INPUT_BLOCK ? INPUT_BLOCK : (size_t)(len - off);
+    ssize_t n = pread(rfd, scratch, want, (off_t)off);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      if (n == 0) {
+        errno = EIO;
+      }
+      return (-1);
+    }
+    if (file_writer_write(fw, scratch, (size_t)n, off) != 0) {
+      return (-1);
+    }
+    off += n;
+  }
+  return (0);
+}
+
+/*
+ * Compare the entry data with the same path under --link-dest while it
+ * streams by. An identical file is hardlinked when its mode and mtime
+ * match, cloned otherwise; nothing of it is written. At the first
+ * differing byte the prefix is copied from the reference and the rest
+ * comes from the entry. *linked is -1 when there is no same-sized
+ * reference (no data consumed), 1 when the path was replaced by a link or
+ * clone, 0 when fw holds the finished data.
+ */
+static int copy_data_linked(struct archive *a, struct archive_entry *e,
+                            struct file_writer *fw, const char *outdir,
+                            const struct write_options *wopts, int *linked) {
+  const char *path = archive_entry_pathname(e);
+  la_int64_t size = archive_entry_size(e);
+  char *ref = tree_path(wopts->link_dest, outdir, path);
+  const void *blk;
+  size_t len;
+  la_int64_t off;
+  la_int64_t pos = 0;
+  int matching = 1;
+  struct stat st;
+  int rfd;
+  int r;
+
+  *linked = -1;
+  rfd = open(ref, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  if (rfd < 0) {
+    free(ref);
+    return (ARCHIVE_OK);
+  }
+  if (fstat(rfd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size != size) {
+    close(rfd);
+    free(ref);
+    return (ARCHIVE_OK);
+  }
+  *linked = 0;
+  unsigned char *scratch = malloc(INPUT_BLOCK);
+  if (scratch == NULL) {
+    fail_errno("malloc");
+  }
+
+  while ((r = archive_read_data_block(a, &blk, &len, &off)) == ARCHIVE_OK) {
+    const unsigned char *buf = blk;
+    if (matching) {
+      ssize_t same = 0;
+      if (off == pos) {
+        same = matching_prefix(rfd, buf, len, off, scratch);
+        if (same < 0) {
+          archive_set_error(a, errno, "read(%s): %s", ref, strerror(errno));
+          r = ARCHIVE_FATAL;
+          break;
+        }
+        if ((size_t)same == len) {
+          pos = off + (la_int64_t)len;
+          continue;
+        }
+      }
+      /* First difference: the bytes before it are the reference's. */
+      if (copy_reference_prefix(fw, rfd, pos + same, scratch) != 0) {
+        archive_set_error(a, errno, "copy(%s): %s", ref, strerror(errno));
+        r = ARCHIVE_FATAL;
+        break;
+      }
+      buf += same;
+      len -= (size_t)same;
+      off += same;
+      matching = 0;
+    }
+    if (file_writer_write(fw, buf, len, off) != 0) {
+      archive_set_error(a, errno, "write(%s): %s", path, strerror(errno));
+      r = ARCHIVE_FATAL;
+      break;
+    }
+  }
+
+  if (r == ARCHIVE_EOF && matching) {
+    int mode = wopts->dedup == dedup_reflink ? dedup_reflink : dedup_hardlink;
+    int shared = -1;
+    if (pos == size) {
+      shared = share_file_data(ref, (int)(st.st_mode & 07777), st.st_mtime, e,
+                               fw, mode);
+      if (shared < 0 && mode == dedup_hardlink) {
+        shared = clone_file_data(ref, e, fw);
+      }
+    }
+    if (shared > 0) {
+      *linked = 1;
+    } else if (shared < 0 &&
+               copy_reference_prefix(fw, rfd, pos, scratch) != 0) {
+      /* Nothing to share: copy what matched; finish adds a trailing hole. */
+      archive_set_error(a, errno, "copy(%s): %s", ref, strerror(errno));
+      r = ARCHIVE_FATAL;
+    }
+  }
+  free(scratch);
+  close(rfd);
+  free(ref);
+
+  if (r != ARCHIVE_EOF) {
+    return (r);
+  }
+  if (*linked == 0 && file_writer_finish(fw, e) != 0) {
+    archive_set_error(a, errno, "finish(%s): %s", path, strerror(errno));
+    return (ARCHIVE_FATAL);
+  }
+  return (ARCHIVE_OK);
+}
+
+/*
+ * Let archive_write_disk create the file (secure path checks, parent
+ * directories, unlinking whatever is in the way) as an empty entry, then
+ * stream the data through our own descriptor so the write path can be
+ * tuned.
+ */
+static int extract_regular_file(struct archive *a, struct archive_entry *e,
+                                struct archive *disk, const char *outdir,
+                                const struct write_options *wopts) {
+  la_int64_t size = archive_entry_size(e);
+  struct file_writer fw = {
+      .fd = -1,
+      .sparse = wopts->sparse,
+      .drop_cache = wopts->cache_policy == cache_policy_drop,
+      .sync = wopts->sync == sync_policy_per_file,
+  };
+  unsigned char *dbuf = NULL;
+  mode_t perm = archive_entry_perm(e);
+  int read_only = (perm & S_IWUSR) == 0;
+  mode_t final_mode = 0;
+  struct stat st;
+  int linked = -1;
+  int replaced = 0;
+  int r;
+
+  /* Created writable by the owner; a read-only mode is applied last. */
+  archive_entry_set_size(e, 0);
+  archive_entry_set_perm(e, perm | S_IWUSR);
+  r = archive_write_header(disk, e);
+  if (r == ARCHIVE_OK) {
+    r = archive_write_finish_entry(disk);
+  }
+  archive_entry_set_perm(e, perm);
+  archive_entry_set_size(e, size);
+  if (r != ARCHIVE_OK) {
+    archive_set_error(a, archive_errno(disk), "%s",
+                      archive_error_string(disk));
+    return (r);
+  }
+
+  fw.fd = open(archive_entry_pathname(e), O_WRONLY | O_NOFOLLOW | O_CLOEXEC);
+  if (fw.fd < 0) {
+    archive_set_error(a, errno, "open(%s): %s", archive_entry_pathname(e),
+                      strerror(errno));
+    return (ARCHIVE_FATAL);
+  }
+  if (read_only) {
+    /* The disk writer applied the umask; keep that, minus owner write. */
+    if (fstat(fw.fd, &st) != 0) {
+      archive_set_error(a, errno, "fstat(%s): %s", archive_entry_pathname(e),
+                        strerror(errno));
+      close(fw.fd);
+      return (ARCHIVE_FATAL);
+    }
+    final_mode = (st.st_mode & 07777) & ~(mode_t)S_IWUSR;
+  }
+  if (fw.drop_cache) {
+    cache_policy_setup_fd(fw.fd);
+  }
+  if (wopts->direct_threshold > 0 && size >= wopts->direct_threshold &&
+      direct_io_enable(fw.fd)) {
+    dbuf = aligned_pool_get(wopts->pool);
+    fw.dbuf = dbuf;
+  }
+
+  if (wopts->link_dest != NULL) {
+    r = copy_data_linked(a, e, &fw, outdir, wopts, &linked);
+    replaced = linked > 0;
+  }
+  if (linked >= 0) {
+    /* Handled against the --link-dest reference. */
+  } else if (wopts->dedup != dedup_off) {
+    r = copy_data_deduplicated(a, e, &fw, outdir, wopts, &replaced);
+  } else if (wopts->hashes != NULL || wopts->bom != NULL) {
+    struct content_hash hash;
+    char hex[65];
+
+    content_hash_init(&hash,
+                      (wopts->hashes != NULL ? content_hash_sha256 : 0) |
+                          (wopts->bom != NULL ? content_hash_cksum : 0));
+    r = copy_data_to_writer(a, e, &fw, &hash);
+    if (r == ARCHIVE_OK) {
+      content_hash_zeros(&hash, size);
+    }
+    if (r == ARCHIVE_OK && wopts->hashes != NULL) {
+      char *path = join_prefix_path(outdir, archive_entry_pathname(e));
+      sha256_hex(&hash.sha256, hex);
+      record_file_digest(wopts, path, hex);
+      free(path);
+    }
+    if (r == ARCHIVE_OK && wopts->bom != NULL) {
+      wopts->bom->written = 1;
+      wopts->bom->cksum = cksum_final(hash.cksum, size);
+    }
+  } else {
+    r = copy_data_to_writer(a, e, &fw, NULL);
+  }
+  if (dbuf != NULL) {
+    aligned_pool_put(wopts->pool, dbuf);
+  }
+  /* A replaced fw.fd is the unlinked placeholder; nothing left to flush. */
+  if (r != ARCHIVE_OK || replaced) {
+    close(fw.fd);
+    return (r);
+  }
+  if (read_only && fchmod(fw.fd, final_mode) != 0) {
+    archive_set_error(a, errno, "fchmod(%s): %s", archive_entry_pathname(e),
+                      strerror(errno));
+    close(fw.fd);
+    return (ARCHIVE_FATAL);
+  }
+  return (file_writer_close(a, e, &fw, wopts));
+}
+
+/*
+ * Compare the entry data with the existing file of the same size while it
+ * streams by. Matching files are only touched if their mtime is stale; at
+ * the first differing byte the rest of the entry is written over the old
+ * contents in place, so an edit near the end of a large file costs no more
+ * than the changed tail. The file ends up with mode, whatever old_mode was.
+ */
+static int update_in_place(struct archive *a, struct archive_entry *e,
+                           const struct write_options *wopts, mode_t old_mode,
+                           mode_t mode) {
+  const char *path = archive_entry_pathname(e);
+  la_int64_t size = archive_entry_size(e);
+  struct file_writer fw = {
+      .fd = -1,
+      .sparse = wopts->sparse,
+      .drop_cache = wopts->cache_policy == cache_policy_drop,
+      .sync = wopts->sync == sync_policy_per_file,
+      .in_place = 1,
+  };
+  const void *blk;
+  size_t len;
+  la_int64_t off;
+  la_int64_t pos = 0;
+  int rfd;
+  int r;
+
+  rfd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  if (rfd < 0) {
+    archive_set_error(a, errno, "open(%s): %s", path, strerror(errno));
+    return (ARCHIVE_FATAL);
+  }
+  unsigned char *scratch = malloc(INPUT_BLOCK);
+  if (scratch == NULL) {
+    fail_errno("malloc");
+  }
+
+  for (;;) {
+    r = archive_read_data_block(a, &blk, &len, &off);
+    if (r == ARCHIVE_EOF && fw.fd < 0 && pos < size) {
+      /* The entry ends in a hole the old file may not have. */
+      blk = NULL;
+      len = 0;
+      off = size;
+    } else if (r != ARCHIVE_OK) {
+      break;
+    }
+    const unsigned char *buf = blk;
+    if (fw.fd < 0) {
+      ssize_t same = 0;
+      if (off == pos && len > 0) {
+        same = matching_prefix(rfd, buf, len, off, scratch);
+        if (same < 0) {
+          archive_set_error(a, errno, "read(%s): %s", path, strerror(errno));
+          r = ARCHIVE_FATAL;
+          break;
+        }
+        if ((size_t)same == len) {
+          pos = off + (la_int64_t)len;
+          continue;
+        }
+      }
+      /* A read-only file gets owner write until its final mode is set. */
+      if ((old_mode & S_IWUSR) == 0) {
+        if (fchmod(rfd, old_mode | S_IWUSR) != 0) {
+          archive_set_error(a, errno, "fchmod(%s): %s", path,
+                            strerror(errno));
+          r = ARCHIVE_FATAL;
+          break;
+        }
+        old_mode |= S_IWUSR;
+      }
+      fw.fd = open(path, O_WRONLY | O_NOFOLLOW | O_CLOEXEC);
+      if (fw.fd < 0) {
+        archive_set_error(a, errno, "open(%s): %s", path, strerror(errno));
+        r = ARCHIVE_FATAL;
+        break;
+      }
+      /* Data resuming past pos leaves a hole the old file may not have. */
+      if (off > pos && zero_range(fw.fd, pos, off - pos) != 0) {
+        archive_set_error(a, errno, "write(%s): %s", path, strerror(errno));
+        r = ARCHIVE_FATAL;
+        break;
+      }
+      buf += same;
+      len -= (size_t)same;
+      off += same;
+      fw.end = off;
+      fw.flushed = off;
+      fw.dropped = off;
+    }
+    if (file_writer_write(&fw, buf, len, off) != 0) {
+      archive_set_error(a, errno, "write(%s): %s", path, strerror(errno));
+      r = ARCHIVE_FATAL;
+      break;
+    }
+    if (r == ARCHIVE_EOF) {
+      break;
+    }
+  }
+  free(scratch);
+
+  if (r != ARCHIVE_EOF) {
+    if (fw.fd >= 0) {
+      close(fw.fd);
+    }
+    close(rfd);
+    return (r);
+  }
+  if (fw.fd < 0) {
+    /* Same bytes; only refresh a stale mtime. */
+    struct file_writer unchanged = {.fd = rfd, .end = size};
+    r = file_writer_finish(&unchanged, e) == 0 ? ARCHIVE_OK : ARCHIVE_FATAL;
+    if (r != ARCHIVE_OK) {
+      archive_set_error(a, errno, "utimes(%s): %s", path, strerror(errno));
+    } else if (old_mode != mode && fchmod(rfd, mode) != 0) {
+      archive_set_error(a, errno, "fchmod(%s): %s", path, strerror(errno));
+      r = ARCHIVE_FATAL;
+    }
+    close(rfd);
+    return (r);
+  }
+  close(rfd);
+  if (file_writer_finish(&fw, e) != 0) {
+    archive_set_error(a, errno, "finish(%s): %s", path, strerror(errno));
+    close(fw.fd);
+    return (ARCHIVE_FATAL);
+  }
+  if (old_mode != mode && fchmod(fw.fd, mode) != 0) {
+    archive_set_error(a, errno, "fchmod(%s): %s", path, strerror(errno));
+    close(fw.fd);
+    return (ARCHIVE_FATAL);
+  }
+  return (file_writer_close(a, e, &fw, wopts));
+}
+
+/*
+ * Decide whether the entry can keep what is already on disk. Sets *kept
+ * when the entry was fully handled here, including the entry data.
+ */
+static int keep_unchanged_entry(struct archive *a, struct archive_entry *e,
+                                const struct write_options *wopts,
+                                int *kept) {
+  const char *path = archive_entry_pathname(e);
+  struct stat st;
+  mode_t mode;
+
+  *kept = 0;
+  if (archive_entry_hardlink(e) != NULL || lstat(path, &st) != 0) {
+    return (ARCHIVE_OK);
+  }
+
+  switch (archive_entry_filetype(e)) {
+  case AE_IFLNK: {
+    const char *target = archive_entry_symlink(e);
+    if (!S_ISLNK(st.st_mode) || target == NULL) {
+      return (ARCHIVE_OK);
+    }
+    size_t tlen = strlen(target);
+    char *buf = malloc(tlen + 1);
+    if (buf == NULL) {
+      fail_errno("malloc");
+    }
+    ssize_t n = readlink(path, buf, tlen + 1);
+    *kept = n >= 0 && (size_t)n == tlen && memcmp(buf, target, tlen) == 0;
+    free(buf);
+    return (ARCHIVE_OK);
+  }
+  case AE_IFREG:
+    if (!S_ISREG(st.st_mode) || st.st_size != archive_entry_size(e)) {
+      return (ARCHIVE_OK);
+    }
+    /* The mode the disk writer would create the file with. */
+    mode = archive_entry_perm(e) & 0777 & ~wopts->umask;
+    if (wopts->incremental == incremental_mtime) {
+      if (!archive_entry_mtime_is_set(e) ||
+          st.st_mtime != archive_entry_mtime(e)) {
+        return (ARCHIVE_OK);
+      }
+      *kept = 1;
+      if ((st.st_mode & 07777) != mode && chmod(path, mode) != 0) {
+        archive_set_error(a, errno, "chmod(%s): %s", path, strerror(errno));
+        return (ARCHIVE_FATAL);
+      }
+      return (archive_read_data_skip(a));
+    }
+    /* Rewriting in place would also change the other links. */
+    if (st.st_nlink > 1) {
+      return (ARCHIVE_OK);
+    }
+    *kept = 1;
+    return (update_in_place(a, e, wopts, st.st_mode & 07777, mode));
+  default:
+    return (ARCHIVE_OK);
+  }
+}
+
+
+/*
+ * --output-format tar|tar.zst: entries are written to an archive on OUTDIR
+ * or stdout instead of to the disk. zstd compresses in its own worker
+ * threads, so compression overlaps the decode of the next entries.
+ */
+struct output_stream {
+  int fd;
+  ZSTD_CCtx *cctx;
+  unsigned char *buf;
+  size_t cap;
+};
+
+static int write_full(int fd, const unsigned char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, buf, len);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return (-1);
+    }
+    buf += n;
+    len -= (size_t)n;
+  }
+  return (0);
+}
+
+static int output_stream_compress(struct archive *a, struct output_stream *s,
+                                  const void *buff, size_t len,
+                                  ZSTD_EndDirective mode) {
+  ZSTD_inBuffer in = {buff, len, 0};
+  size_t left;
+
+  do {
+    ZSTD_outBuffer out = {s->buf, s->cap, 0};
+    left = ZSTD_compressStream2(s->cctx, &out, &in, mode);
+    if (ZSTD_isError(left)) {
+      archive_set_error(a, EINVAL, "zstd: %s", ZSTD_getErrorName(left));
+      return (-1);
+    }
+    if (write_full(s->fd, s->buf, out.pos) != 0) {
+      archive_set_error(a, errno, "write output");
+      return (-1);
+    }
+  } while (mode == ZSTD_e_end ? left != 0 : in.pos < in.size);
+  return (0);
+}
+
+static la_ssize_t output_stream_write_cb(struct archive *a, void *client_data,
+                                         const void *buff, size_t len) {
+  struct output_stream *s = client_data;
+
+  if (s->cctx == NULL) {
+    if (write_full(s->fd, buff, len) != 0) {
+      archive_set_error(a, errno, "write output");
+      return (-1);
+    }
+  } else if (output_stream_compress(a, s, buff, len, ZSTD_e_continue) != 0) {
+    return (-1);
+  }
+  return ((la_ssize_t)len);
+}
+
+static int output_stream_close_cb(struct archive *a, void *client_data) {
+  struct output_stream *s = client_data;
+  int r = ARCHIVE_OK;
+
+  if (s->cctx != NULL &&
+      output_stream_compress(a, s, NULL, 0, ZSTD_e_end) != 0) {
+    r = ARCHIVE_FATAL;
+  }
+  if (s->fd != STDOUT_FILENO && close(s->fd) != 0 && r == ARCHIVE_OK) {
+    archive_set_error(a, errno, "close output");
+    r = ARCHIVE_FATAL;
+  }
+  return (r);
+}
+
+static int output_stream_free_cb(struct archive *a, void *client_data) {
+  struct output_stream *s = client_data;
+  (void)a;
+
+  ZSTD_freeCCtx(s->cctx);
+  free(s->buf);
+  free(s);
+  return (ARCHIVE_OK);
+}
+
+static struct archive *output_stream_open(const char *path,
+                                          enum output_format format) {
+  struct archive *out = archive_write_new();
+  struct output_stream *s = calloc(1, sizeof(*s));
+
+  if (out == NULL || s == NULL) {
+    fail_errno("malloc");
+  }
+  if (strcmp(path, "-") == 0) {
+    s->fd = STDOUT_FILENO;
+  } else {
+    s->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (s->fd < 0) {
+      fail_errno(path);
+    }
+  }
+  if (format == output_format_tar_zstd) {
+    s->cctx = ZSTD_createCCtx();
+    s->cap = ZSTD_CStreamOutSize();
+    s->buf = malloc(s->cap);
+    if (s->cctx == NULL || s->buf == NULL) {
+      fail_errno("malloc");
+    }
+    ZSTD_CCtx_setParameter(s->cctx, ZSTD_c_compressionLevel, 3);
+    ZSTD_CCtx_setParameter(s->cctx, ZSTD_c_checksumFlag, 1);
+    /* Fails harmlessly on a single-threaded libzstd. */
+    ZSTD_CCtx_setParameter(s->cctx, ZSTD_c_nbWorkers, worker_count());
+  }
+  if (archive_write_set_format_pax_restricted(out) != ARCHIVE_OK) {
+    fail_archive(out, "archive_write_set_format_pax_restricted");
+  }
+  /* Blocking is left to the compressor and the pipe. */
+  archive_write_set_bytes_per_block(out, 0);
+  if (archive_write_open2(out, s, NULL, output_stream_write_cb,
+                          output_stream_close_cb,
+                          output_stream_free_cb) != ARCHIVE_OK) {
+    fail_archive(out, "open output");
+  }
+  return (out);
+}
+
+/*
+ * Copy e and its data into the output archive. outdir is the member the
+ * entry came from, as a path prefix; holes in sparse data become zeros.
+ */
+static int stream_entry(struct archive *a, struct archive_entry *e,
+                        const char *outdir, struct archive *out) {
+  static const unsigned char zeros[SPARSE_BLOCK];
+  const char *path = archive_entry_pathname(e);
+  const char *hardlink = archive_entry_hardlink(e);
+  const void *buf;
+  size_t len;
+  la_int64_t off;
+  la_int64_t pos = 0;
+  int r;
+
+  if (strcmp(path, ".") == 0) {
+    if (outdir == NULL || strcmp(outdir, ".") == 0) {
+      return (archive_read_data_skip(a));
+    }
+    archive_entry_set_pathname(e, outdir);
+  } else {
+    char *full = join_prefix_path(outdir, path);
+    archive_entry_set_pathname(e, full);
+    free(full);
+  }
+  if (hardlink != NULL) {
+    char *full = join_prefix_path(outdir, hardlink);
+    archive_entry_set_hardlink(e, full);
+    free(full);
+  }
+
+  if (archive_write_header(out, e) != ARCHIVE_OK) {
+    fail_archive(out, "write output header");
+  }
+  while ((r = archive_read_data_block(a, &buf, &len, &off)) == ARCHIVE_OK) {
+    while (pos < off) {
+      size_t gap =
+          off - pos > SPARSE_BLOCK ? SPARSE_BLOCK : (size_t)(off - pos);
+      if (archive_write_data(out, zeros, gap) < 0) {
+        fail_archive(out, "write output data");
+      }
+      pos += (la_int64_t)gap;
+    }
+    if (len > 0 && archive_write_data(out, buf, len) < 0) {
+      fail_archive(out, "write output data");
+    }
+    pos += (la_int64_t)len;
+  }
+  if (r != ARCHIVE_EOF) {
+    return (r);
+  }
+  if (archive_write_finish_entry(out) != ARCHIVE_OK) {
+    fail_archive(out, "write output entry");
+  }
+  return (ARCHIVE_OK);
+}
+
+#endif
+
+static int extract_entry(struct archive *a, struct archive_entry *e,
+                         struct archive *disk, const char *outdir,
+                         const struct write_options *wopts) {
+#if !defined(_WIN32)
+  if (wopts->stream != NULL) {
+    return (stream_entry(a, e, outdir, wopts->stream));
+  }
+  if (wopts->image != NULL) {
+    return (image_entry(a, e, outdir, wopts->image));
+  }
+  if (wopts->cas != NULL) {
+    return (cas_entry(a, e, outdir, wopts->cas));
+  }
+  if (wopts->incremental != incremental_off) {
+    int kept;
+    int r = keep_unchanged_entry(a, e, wopts, &kept);
+    if (r != ARCHIVE_OK || kept) {
+      return (r);
+    }
+  }
+  if (write_options_need_fd(wopts) &&
+      archive_entry_filetype(e) == AE_IFREG &&
+      archive_entry_hardlink(e) == NULL && archive_entry_size(e) > 0) {
+    return (extract_regular_file(a, e, disk, outdir, wopts));
+  }
+#endif
+  return (archive_read_extract2(a, e, disk));
+}
+
+#if !defined(_WIN32)
+/*
+ * Identity of a pkg: SHA-256 of its xar header and compressed TOC, which
+ * carries the checksum of every member. Only seekable files qualify.
+ */
+static int pkg_identity(const char *pkg, char id[65]) {
+  unsigned char hdr[28];
+  unsigned char *buf;
+  struct sha256_ctx ctx;
+  uint64_t toc_len;
+  uint16_t hdr_len;
+  int fd;
+
+  if (strcmp(pkg, "-") == 0) {
+    return (-1);
+  }
+  fd = open(pkg, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return (-1);
+  }
+  if (pread(fd, hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr) ||
+      memcmp(hdr, "xar!", 4) != 0) {
+    close(fd);
+    return (-1);
+  }
+  hdr_len = (uint16_t)(hdr[4] << 8 | hdr[5]);
+  toc_len = 0;
+  for (int i = 8; i < 16; i++) {
+    toc_len = toc_len << 8 | hdr[i];
+  }
+  if (hdr_len < sizeof(hdr) || toc_len > ((uint64_t)1 << 30)) {
+    close(fd);
+    return (-1);
+  }
+
+  sha256_init(&ctx);
+  buf = malloc(INPUT_BLOCK);
+  if (buf == NULL) {
+    fail_errno("malloc");
+  }
+  for (uint64_t off = 0, end = hdr_len + toc_len; off < end;) {
+    size_t want = end - off > INPUT_BLOCK ? INPUT_BLOCK : (size_t)(end - off);
+    ssize_t n = pread(fd, buf, want, (off_t)off);
+    if (n <= 0) {
+      free(buf);
+      close(fd);
+      return (-1);
+    }
+    sha256_update(&ctx, buf, (size_t)n);
+    off += (uint64_t)n;
+  }
+  free(buf);
+  close(fd);
+  sha256_hex(&ctx, id);
+  return (0);
+}
+
+/*
+ * Payload cache files use the zstd seekable format: independent frames of
+ * PAYLOAD_FRAME decoded bytes, followed by a skippable frame holding the
+ * compressed and decoded size of each frame and a footer. Any zstd tool
+ * can decode them; the reader here uses the table to skip whole frames.
+ */
+#define PAYLOAD_FRAME (1024 * 1024)
+#define SEEKABLE_SKIPPABLE_MAGIC 0x184D2A5Eu
+#define SEEKABLE_FOOTER_MAGIC 0x8F92EAB1u
+
+struct payload_frame {
+  uint32_t csize;
+  uint32_t dsize;
+  la_int64_t coff;
+  la_int64_t doff;
+};
+
+static void store_le32(unsigned char *p, uint32_t v) {
+  p[0] = (unsigned char)v;
+  p[1] = (unsigned char)(v >> 8);
+  p[2] = (unsigned char)(v >> 16);
+  p[3] = (unsigned char)(v >> 24);
+}
+
+static uint32_t load_le32(const unsigned char *p) {
+  return ((uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+          (uint32_t)p[3] << 24);
+}
+
+static char *payload_cache_path(const struct write_options *wopts,
+                                const char *member) {
+  struct sha256_ctx ctx;
+  char key[65];
+  char name[72];
+
+  sha256_init(&ctx);
+  sha256_update(&ctx, wopts->pkg_id, strlen(wopts->pkg_id));
+  sha256_update(&ctx, "\n", 1);
+  sha256_update(&ctx, member, strlen(member));
+  sha256_hex(&ctx, key);
+  snprintf(name, sizeof(name), "%s.zst", key);
+  return (join_prefix_path(wopts->payload_cache, name));
+}
+
+/*
+ * pbzx Payloads are a sequence of independently compressed chunks, each
+ * preceded by its decoded and compressed size. With --pbzx-cache the
+ * chunks are decoded here instead of by libarchive's pbzx filter, and
+ * each decoded chunk is kept in DIR under the SHA-256 of its compressed
+ * bytes. Consecutive SDK releases share most chunks, so an upgrade only
+ * decodes the ones that changed.
+ */
+#define PBZX_CHUNK_MAX ((uint64_t)64 * 1024 * 1024)
+
+struct pbzx_source {
+  struct astream *in;
+  const char *cache;
+  uint64_t block_size;
+  int started;
+  int eof;
+  unsigned char *cbuf;
+  size_t ccap;
+  unsigned char *dbuf;
+  size_t dcap;
+};
+
+/* Copy len bytes from the stream; returns how many were available. */
+static la_ssize_t astream_read_exact(struct astream *s, unsigned char *out,
+                                     size_t len) {
+  size_t done = 0;
+
+  while (done < len) {
+    if (s->blk == NULL || s->pos == s->blksz) {
+      int r = astream_fill(s);
+      if (r == ARCHIVE_EOF) {
+        break;
+      }
+      if (r != ARCHIVE_OK) {
+        return (-1);
+      }
+      continue;
+    }
+    size_t n = s->blksz - s->pos;
+    if (n > len - done) {
+      n = len - done;
+    }
+    memcpy(out + done, s->blk + s->pos, n);
+    s->pos += n;
+    done += n;
+  }
+  return ((la_ssize_t)done);
+}
+
+static int astream_has_prefix(struct astream *s, const char *prefix) {
+  size_t len = strlen(prefix);
+
+  if ((s->blk == NULL || s->pos == s->blksz) && astream_fill(s) != ARCHIVE_OK) {
+    return (0);
+  }
+  return (s->blksz - s->pos >= len && memcmp(s->blk + s->pos, prefix, len) == 0);
+}
+
+static uint64_t load_be64(const unsigned char *p) {
+  uint64_t v = 0;
+
+  for (int i = 0; i < 8; i++) {
+    v = v << 8 | p[i];
+  }
+  return (v);
+}
+
+static void grow_buffer(unsigned char **buf, size_t *cap, size_t need) {
+  if (*cap < need) {
+    free(*buf);
+    *buf = malloc(need);
+    if (*buf == NULL) {
+      fail_errno("malloc");
+    }
+    *cap = need;
+  }
+}
+
+static int pbzx_cache_lookup(const char *path, unsigned char *out,
+                             size_t len) {
+  struct stat st;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  int r = -1;
+
+  if (fd < 0) {
+    return (-1);
+  }
+  if (fstat(fd, &st) == 0 && st.st_size == (off_t)len &&
+      pread(fd, out, len, 0) == (ssize_t)len) {
+    /* The mtime records the last use for eviction. */
+    (void)futimens(fd, NULL);
+    r = 0;
+  }
+  close(fd);
+  return (r);
+}
+
+static void pbzx_cache_store(const char *path, const unsigned char *buf,
+                             size_t len) {
+  size_t tlen = strlen(path) + sizeof(".tmp-XXXXXX");
+  char *tmp = malloc(tlen);
+  int fd;
+
+  if (tmp == NULL) {
+    fail_errno("malloc");
+  }
+  snprintf(tmp, tlen, "%s.tmp-XXXXXX", path);
+  fd = mkstemp(tmp);
+  if (fd >= 0) {
+    int ok = fchmod(fd, 0644) == 0 && write_full_at(fd, buf, len, 0) == 0;
+    if (close(fd) != 0 || !ok || rename(tmp, path) != 0) {
+      unlink(tmp);
+    }
+  }
+  free(tmp);
+}
+
+static int pbzx_decode_chunk(struct archive *a, const unsigned char *in,
+                             size_t inlen, unsigned char *out, size_t outlen) {
+  struct archive *x = archive_read_new();
+  struct archive_entry *e;
+  size_t done = 0;
+  la_ssize_t n;
+
+  if (x == NULL) {
+    fail_errno("archive_read_new");
+  }
+  archive_read_support_filter_all(x);
+  archive_read_support_format_raw(x);
+  if (archive_read_open_memory(x, in, inlen) != ARCHIVE_OK ||
+      archive_read_next_header(x, &e) != ARCHIVE_OK) {
+    archive_set_error(a, archive_errno(x), "pbzx chunk: %s",
+                      archive_error_string(x));
+    archive_read_free(x);
+    return (-1);
+  }
+  while (done < outlen &&
+         (n = archive_read_data(x, out + done, outlen - done)) > 0) {
+    done += (size_t)n;
+  }
+  if (done != outlen || archive_read_data(x, out, 1) != 0) {
+    archive_set_error(a, EINVAL, "pbzx chunk: decoded size mismatch");
+    archive_read_free(x);
+    return (-1);
+  }
+  archive_read_free(x);
+  return (0);
+}
+
+static la_ssize_t pbzx_source_read_cb(struct archive *a, void *client_data,
+                                      const void **buff) {
+  struct pbzx_source *p = client_data;
+  unsigned char hdr[16];
+  la_ssize_t n;
+
+  if (p->eof) {
+    return (0);
+  }
+  if (!p->started) {
+    if (astream_read_exact(p->in, hdr, 12) != 12) {
+      archive_set_error(a, EINVAL, "truncated pbzx header");
+      return (-1);
+    }
+    p->block_size = load_be64(hdr + 4);
+    p->started = 1;
+  }
+
+  n = astream_read_exact(p->in, hdr, 16);
+  if (n == 0) {
+    p->eof = 1;
+    return (0);
+  }
+  if (n != 16) {
+    archive_set_error(a, EINVAL, "truncated pbzx chunk header");
+    return (-1);
+  }
+  uint64_t dlen = load_be64(hdr);
+  uint64_t clen = load_be64(hdr + 8);
+  if (dlen > PBZX_CHUNK_MAX || clen > PBZX_CHUNK_MAX ||
+      (p->block_size != 0 && dlen > p->block_size)) {
+    archive_set_error(a, EINVAL, "pbzx chunk too large");
+    return (-1);
+  }
+  grow_buffer(&p->cbuf, &p->ccap, (size_t)clen);
+  if (astream_read_exact(p->in, p->cbuf, (size_t)clen) != (la_ssize_t)clen) {
+    archive_set_error(a, EINVAL, "truncated pbzx chunk");
+    return (-1);
+  }
+  if (clen == dlen) {
+    /* Stored uncompressed. */
+    *buff = p->cbuf;
+    return ((la_ssize_t)clen);
+  }
+
+  struct sha256_ctx ctx;
+  char key[65];
+  sha256_init(&ctx);
+  sha256_update(&ctx, p->cbuf, (size_t)clen);
+  sha256_hex(&ctx, key);
+  char *path = join_prefix_path(p->cache, key);
+  grow_buffer(&p->dbuf, &p->dcap, (size_t)dlen);
+  if (pbzx_cache_lookup(path, p->dbuf, (size_t)dlen) != 0) {
+    if (pbzx_decode_chunk(a, p->cbuf, (size_t)clen, p->dbuf, (size_t)dlen) !=
+        0) {
+      free(path);
+      return (-1);
+    }
+    pbzx_cache_store(path, p->dbuf, (size_t)dlen);
+  }
+  free(path);
+  *buff = p->dbuf;
+  return ((la_ssize_t)dlen);
+}
+
+static void pbzx_source_free(struct pbzx_source *p) {
+  if (p != NULL) {
+    free(p->cbuf);
+    free(p->dbuf);
+    free(p);
+  }
+}
+
+/*
+ * Open a reader over a nested member's data, decoding pbzx chunks through
+ * the chunk cache when one is configured. *pbzx must be released with
+ * pbzx_source_free() after the reader.
+ */
+static int open_member_reader(struct archive *a, struct astream *in,
+                              const struct write_options *wopts,
+                              struct pbzx_source **pbzx) {
+  *pbzx = NULL;
+  if (wopts->pbzx_cache != NULL && astream_has_prefix(in, "pbz")) {
+    struct pbzx_source *p = calloc(1, sizeof(*p));
+    if (p == NULL) {
+      fail_errno("calloc");
+    }
+    p->in = in;
+    p->cache = wopts->pbzx_cache;
+    *pbzx = p;
+    archive_read_set_callback_data(a, p);
+    archive_read_set_read_callback(a, pbzx_source_read_cb);
+    return (archive_read_open1(a));
+  }
+  return (archive_read_open(a, in, astream_open_cb, astream_read_cb,
+                            astream_close_cb));
+}
+
+/*
+ * First use: the Payload is decoded by a raw-format reader and handed to
+ * the nested reader through payload_tee_read_cb, which also compresses
+ * every block into the cache file.
+ */
+struct payload_tee {
+  struct archive *raw;
+  struct pbzx_source *pbzx;
+  char *path;
+  char *tmp;
+  int fd;
+  ZSTD_CCtx *cctx;
+  unsigned char *in;
+  size_t fill;
+  unsigned char *out;
+  size_t out_cap;
+  la_int64_t coff;
+  struct payload_frame *frames;
+  size_t nframes;
+  size_t cap;
+  int failed;
+  int eof;
+};
+
+static int payload_tee_flush(struct payload_tee *t) {
+  if (t->fill == 0 || t->failed) {
+    return (0);
+  }
+  size_t n = ZSTD_compress2(t->cctx, t->out, t->out_cap, t->in, t->fill);
+  if (ZSTD_isError(n) || write_full_at(t->fd, t->out, n, t->coff) != 0) {
+    return (-1);
+  }
+  if (t->nframes == t->cap) {
+    t->cap = t->cap == 0 ? 64 : t->cap * 2;
+    t->frames = realloc(t->frames, t->cap * sizeof(*t->frames));
+    if (t->frames == NULL) {
+      fail_errno("realloc");
+    }
+  }
+  t->frames[t->nframes].csize = (uint32_t)n;
+  t->frames[t->nframes].dsize = (uint32_t)t->fill;
+  t->nframes++;
+  t->coff += (la_int64_t)n;
+  t->fill = 0;
+  return (0);
+}
+
+/* Write the seek table and publish the file under its final name. */
+static void payload_tee_publish(struct payload_tee *t) {
+  size_t table;
+  unsigned char *p;
+
+  if (payload_tee_flush(t) != 0) {
+    t->failed = 1;
+  }
+  if (t->failed) {
+    return;
+  }
+  table = t->nframes * 8 + 9;
+  p = malloc(table + 8);
+  if (p == NULL) {
+    fail_errno("malloc");
+  }
+  store_le32(p, SEEKABLE_SKIPPABLE_MAGIC);
+  store_le32(p + 4, (uint32_t)table);
+  for (size_t i = 0; i < t->nframes; i++) {
+    store_le32(p + 8 + i * 8, t->frames[i].csize);
+    store_le32(p + 12 + i * 8, t->frames[i].dsize);
+  }
+  store_le32(p + 8 + t->nframes * 8, (uint32_t)t->nframes);
+  p[12 + t->nframes * 8] = 0;
+  store_le32(p + 13 + t->nframes * 8, SEEKABLE_FOOTER_MAGIC);
+  if (write_full_at(t->fd, p, table + 8, t->coff) == 0 &&
+      rename(t->tmp, t->path) == 0) {
+    free(t->tmp);
+    t->tmp = NULL;
+  }
+  free(p);
+}
+
+static la_ssize_t payload_tee_read_cb(struct archive *a, void *client_data,
+                                      const void **buff) {
+  struct payload_tee *t = client_data;
+  la_ssize_t n;
+
+  if (t->eof) {
+    return (0);
+  }
+  n = archive_read_data(t->raw, t->in + t->fill,
+                        PAYLOAD_FRAME - t->fill);
+  if (n < 0) {
+    archive_set_error(a, archive_errno(t->raw), "%s",
+                      archive_error_string(t->raw));
+    return (-1);
+  }
+  if (n == 0) {
+    t->eof = 1;
+    payload_tee_publish(t);
+    return (0);
+  }
+  *buff = t->in + t->fill;
+  t->fill += (size_t)n;
+  if (t->fill == PAYLOAD_FRAME && payload_tee_flush(t) != 0) {
+    t->failed = 1;
+  }
+  return (n);
+}
+
+static struct payload_tee *payload_tee_open(struct astream *in,
+                                            const char *path,
+                                            const struct write_options *wopts) {
+  struct payload_tee *t = calloc(1, sizeof(*t));
+  struct archive_entry *e;
+
+  if (t == NULL) {
+    fail_errno("calloc");
+  }
+  t->raw = archive_read_new();
+  if (t->raw == NULL) {
+    fail_errno("archive_read_new");
+  }
+  archive_read_support_filter_all(t->raw);
+  archive_read_support_format_raw(t->raw);
+  if (open_member_reader(t->raw, in, wopts, &t->pbzx) != ARCHIVE_OK ||
+      archive_read_next_header(t->raw, &e) != ARCHIVE_OK) {
+    fail_archive(t->raw, "open payload");
+  }
+  t->path = strdup(path);
+  size_t len = strlen(path) + sizeof(".tmp-XXXXXX");
+  t->tmp = malloc(len);
+  if (t->path == NULL || t->tmp == NULL) {
+    fail_errno("malloc");
+  }
+  snprintf(t->tmp, len, "%s.tmp-XXXXXX", path);
+  t->fd = mkstemp(t->tmp);
+  if (t->fd >= 0) {
+    (void)fchmod(t->fd, 0644);
+  }
+  t->cctx = ZSTD_createCCtx();
+  t->out_cap = ZSTD_compressBound(PAYLOAD_FRAME);
+  t->in = malloc(PAYLOAD_FRAME);
+  t->out = malloc(t->out_cap);
+  if (t->in == NULL || t->out == NULL || t->cctx == NULL) {
+    fail_errno("malloc");
+  }
+  /* Frame checksums let a damaged cache file fail loudly. */
+  ZSTD_CCtx_setParameter(t->cctx, ZSTD_c_compressionLevel, 3);
+  ZSTD_CCtx_setParameter(t->cctx, ZSTD_c_checksumFlag, 1);
+  /* Without a cache file the tee still decodes; it just stores nothing. */
+  t->failed = t->fd < 0;
+  return (t);
+}
+
+static void payload_tee_close(struct payload_tee *t) {
+  const void *buf;
+
+  /*
+   * The nested reader stops at the cpio trailer; decode the remainder so
+   * the cached stream is complete.
+   */
+  while (!t->eof && !t->failed) {
+    la_ssize_t n = payload_tee_read_cb(t->raw, t, &buf);
+    if (n <= 0) {
+      t->failed = n < 0;
+      break;
+    }
+  }
+  if (t->fd >= 0) {
+    close(t->fd);
+  }
+  if (t->tmp != NULL && t->fd >= 0) {
+    unlink(t->tmp);
+  }
+  archive_read_free(t->raw);
+  pbzx_source_free(t->pbzx);
+  ZSTD_freeCCtx(t->cctx);
+  free(t->frames);
+  free(t->in);
+  free(t->out);
+  free(t->path);
+  free(t->tmp);
+  free(t);
+}
+
+/*
+ * Later uses: the nested reader pulls decoded bytes straight from the
+ * cache file. Skips over excluded entries move the logical position only;
+ * frames that are skipped entirely are never read or decompressed.
+ */
+struct payload_cached {
+  int fd;
+  ZSTD_DCtx *dctx;
+  struct payload_frame *frames;
+  size_t nframes;
+  la_int64_t size;
+  la_int64_t pos;
+  size_t loaded;
+  unsigned char *cbuf;
+  unsigned char *dbuf;
+};
+
+static void payload_cached_close(struct payload_cached *c) {
+  close(c->fd);
+  ZSTD_freeDCtx(c->dctx);
+  free(c->frames);
+  free(c->cbuf);
+  free(c->dbuf);
+  free(c);
+}
+
+static struct payload_cached *payload_cached_open(const char *path) {
+  unsigned char footer[9];
+  unsigned char *table;
+  struct stat st;
+  struct payload_cached *c;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+  if (fd < 0) {
+    return (NULL);
+  }
+  if (fstat(fd, &st) != 0 || st.st_size < 17 ||
+      pread(fd, footer, sizeof(footer), st.st_size - 9) != 9 ||
+      load_le32(footer + 5) != SEEKABLE_FOOTER_MAGIC || footer[4] != 0) {
+    close(fd);
+    return (NULL);
+  }
+  uint32_t nframes = load_le32(footer);
+  la_int64_t table_len = (la_int64_t)nframes * 8 + 17;
+  if (table_len > st.st_size) {
+    close(fd);
+    return (NULL);
+  }
+  table = malloc((size_t)table_len);
+  c = calloc(1, sizeof(*c));
+  if (table == NULL || c == NULL) {
+    fail_errno("malloc");
+  }
+  c->fd = fd;
+  c->nframes = nframes;
+  c->loaded = (size_t)-1;
+  c->frames = calloc(nframes + 1, sizeof(*c->frames));
+  c->dctx = ZSTD_createDCtx();
+  c->cbuf = malloc(ZSTD_compressBound(PAYLOAD_FRAME));
+  c->dbuf = malloc(PAYLOAD_FRAME);
+  if (c->frames == NULL || c->dctx == NULL || c->cbuf == NULL ||
+      c->dbuf == NULL) {
+    fail_errno("malloc");
+  }
+  int ok = pread(fd, table, (size_t)table_len, st.st_size - table_len) ==
+               (ssize_t)table_len &&
+           load_le32(table) == SEEKABLE_SKIPPABLE_MAGIC &&
+           load_le32(table + 4) == (uint32_t)(table_len - 8);
+  la_int64_t coff = 0;
+  la_int64_t doff = 0;
+  for (uint32_t i = 0; ok && i < nframes; i++) {
+    c->frames[i].csize = load_le32(table + 8 + i * 8);
+    c->frames[i].dsize = load_le32(table + 12 + i * 8);
+    c->frames[i].coff = coff;
+    c->frames[i].doff = doff;
+    coff += c->frames[i].csize;
+    doff += c->frames[i].dsize;
+    ok = c->frames[i].dsize <= PAYLOAD_FRAME &&
+         c->frames[i].csize <= ZSTD_compressBound(PAYLOAD_FRAME);
+  }
+  free(table);
+  if (!ok || coff != st.st_size - table_len) {
+    payload_cached_close(c);
+    return (NULL);
+  }
+  c->size = doff;
+  return (c);
+}
+
+static la_ssize_t payload_cached_read_cb(struct archive *a, void *client_data,
+                                         const void **buff) {
+  struct payload_cached *c = client_data;
+  size_t lo = 0;
+  size_t hi = c->nframes;
+
+  if (c->pos >= c->size) {
+    return (0);
+  }
+  while (hi - lo > 1) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (c->frames[mid].doff <= c->pos) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+  const struct payload_frame *f = &c->frames[lo];
+  if (c->loaded != lo) {
+    if (pread(c->fd, c->cbuf, f->csize, (off_t)f->coff) !=
+        (ssize_t)f->csize) {
+      archive_set_error(a, errno, "read payload cache: %s", strerror(errno));
+      return (-1);
+    }
+    size_t n = ZSTD_decompressDCtx(c->dctx, c->dbuf, PAYLOAD_FRAME, c->cbuf,
+                                   f->csize);
+    if (ZSTD_isError(n) || n != f->dsize) {
+      archive_set_error(a, EINVAL, "corrupt payload cache frame");
+      return (-1);
+    }
+    c->loaded = lo;
+  }
+  size_t skip = (size_t)(c->pos - f->doff);
+  *buff = c->dbuf + skip;
+  c->pos += (la_int64_t)(f->dsize - skip);
+  return ((la_ssize_t)(f->dsize - skip));
+}
+
+static la_int64_t payload_cached_skip_cb(struct archive *a, void *client_data,
+                                         la_int64_t request) {
+  struct payload_cached *c = client_data;
+  (void)a;
+
+  if (request > c->size - c->pos) {
+    request = c->size - c->pos;
+  }
+  c->pos += request;
+  return (request);
+}
+#endif
+
+/*
+ * --repair selection. cpio may carry the data of linked files with the last
+ * name only, so a link to a selected path is extracted too.
+ */
+static int only_selects(const struct string_map *only, const char *logical,
+                        const char *prefix, const char *link_rel) {
+  char *target;
+  int selected;
+
+  if (string_map_get(only, logical) != NULL) {
+    return (1);
+  }
+  if (link_rel == NULL) {
+    return (0);
+  }
+  target = join_prefix_path(prefix, link_rel);
+  selected = string_map_get(only, target) != NULL;
+  free(target);
+  return (selected);
+}
+
+#if !defined(_WIN32)
+/* Copy the data of the current entry to stdout. */
+static void cat_copy_data(struct archive *a, const char *path) {
+  unsigned char *buf = malloc(64 * 1024);
+  la_ssize_t n;
+
+  if (buf == NULL) {
+    fail_errno("malloc");
+  }
+  while ((n = archive_read_data(a, buf, 64 * 1024)) > 0) {
+    if (write_full(STDOUT_FILENO, buf, (size_t)n) != 0) {
+      fail_errno("stdout");
+    }
+  }
+  if (n < 0) {
+    fail_archive(a, path);
+  }
+  free(buf);
+}
+
+/*
+ * --cat within a nested archive: skip entries until the target, then copy
+ * its data out. cpio may carry the data of linked files with the last name
+ * only, so a dataless first link waits for a later entry linking to it.
+ * Returns 1 once the data is out and the archive need not be read further.
+ */
+static int cat_entry(struct archive *a, struct archive_entry *e,
+                     const char *logical, const char *prefix,
+                     const char *link_rel, struct cat_target *cat) {
+  int match = strcmp(logical, cat->path) == 0;
+  char *target = link_rel != NULL ? join_prefix_path(prefix, link_rel) : NULL;
+
+  if (!match && cat->alias != NULL && target != NULL &&
+      archive_entry_size(e) > 0) {
+    match = strcmp(target, cat->alias) == 0;
+  }
+  if (!match) {
+    free(target);
+    archive_read_data_skip(a);
+    return (0);
+  }
+  if (archive_entry_filetype(e) != AE_IFREG) {
+    fprintf(stderr, "%s: not a regular file\n", cat->path);
+    exit(1);
+  }
+  cat->found = 1;
+  if (cat->alias == NULL && archive_entry_size(e) == 0 &&
+      archive_entry_nlink(e) > 1) {
+    cat->alias = target != NULL ? target : strdup(logical);
+    if (cat->alias == NULL) {
+      fail_errno("strdup");
+    }
+    return (0);
+  }
+  free(target);
+  cat_copy_data(a, cat->path);
+  cat->done = 1;
+  return (1);
+}
+#endif
+
+/* Whether the last component of the member path is name. */
+static int member_is(const char *path, const char *name) {
+  const char *base = strrchr(path, '/');
+  return (strcmp(base != NULL ? base + 1 : path, name) == 0);
+}
+
+static int is_payload_member(const char *path) {
+  return (path != NULL && member_is(path, "Payload"));
+}
+
+static void extract_nested_archive_from_stream(struct astream *in,
+                                               const char *outdir, int flags,
+                                               struct archive *matching,
+                                               int strip_components,
+                                               const char *prefix,
+                                               const struct write_options *wopts,
+                                               const struct view_list *views) {
+  struct archive *a = archive_read_new();
+  struct archive *disk = archive_write_disk_new();
+  struct archive_entry *e;
+  int r;
+  char *cwd = NULL;
+#if !defined(_WIN32)
+  struct payload_cached *cached = NULL;
+  struct payload_tee *tee = NULL;
+  struct pbzx_source *pbzx = NULL;
+#endif
+
+  if (a == NULL || disk == NULL) {
+    fail_errno("archive allocation");
+  }
+
+  archive_read_support_filter_all(a);
+  archive_read_support_format_all(a);
+
+#if !defined(_WIN32)
+  if (wopts->payload_cache != NULL) {
+    char *path = payload_cache_path(wopts, prefix);
+    cached = payload_cached_open(path);
+    if (cached != NULL) {
+      archive_read_set_callback_data(a, cached);
+      archive_read_set_read_callback(a, payload_cached_read_cb);
+      archive_read_set_skip_callback(a, payload_cached_skip_cb);
+      r = archive_read_open1(a);
+    } else if (wopts->cat == NULL) {
+      tee = payload_tee_open(in, path, wopts);
+      archive_read_set_callback_data(a, tee);
+      archive_read_set_read_callback(a, payload_tee_read_cb);
+      r = archive_read_open1(a);
+    }
+    free(path);
+  }
+  /* --cat stops early, so it only reads a cache, never fills one. */
+  if (cached == NULL && tee == NULL) {
+    r = open_member_reader(a, in, wopts, &pbzx);
+  }
+#else
+  r = archive_read_open(a, in, astream_open_cb, astream_read_cb,
+                        astream_close_cb);
+#endif
+  if (r != ARCHIVE_OK) {
+    fail_archive(a, "open nested archive");
+  }
+
+  archive_write_disk_set_options(disk, flags);
+  archive_write_disk_set_standard_lookup(disk);
+
+  /* An archive or image output names entries by outdir instead. */
+  if (wopts->stream == NULL && wopts->image == NULL && wopts->cas == NULL) {
+    cwd = getcwd(NULL, 0);
+    if (cwd == NULL) {
+      fail_errno("getcwd");
+    }
+    if (chdir(outdir) != 0) {
+      fail_errno("chdir(outdir)");
+    }
+  }
+
+  for (;;) {
+    r = archive_read_next_header(a, &e);
+    if (r == ARCHIVE_EOF) {
+      break;
+    }
+    if (r != ARCHIVE_OK) {
+      fail_archive(a, "read nested header");
+    }
+
+    const char *p = archive_entry_pathname(e);
+    char *rel = normalize_rel_path(p);
+    char *link_rel = NULL;
+    archive_entry_set_pathname(e, rel);
+    if (archive_entry_hardlink(e) != NULL) {
+      /* Stripping and archive outputs need "./" gone from targets too. */
+      link_rel = normalize_rel_path(archive_entry_hardlink(e));
+      archive_entry_set_hardlink(e, link_rel);
+    }
+
+    char *logical_path = join_prefix_path(prefix, rel);
+#if !defined(_WIN32)
+    if (wopts->cat != NULL) {
+      int done = cat_entry(a, e, logical_path, prefix, link_rel, wopts->cat);
+      free(logical_path);
+      free(link_rel);
+      free(rel);
+      if (done) {
+        break;
+      }
+      continue;
+    }
+#endif
+    if (matching == NULL || !should_extract_path(matching, logical_path) ||
+        (wopts->only != NULL &&
+         !only_selects(wopts->only, logical_path, prefix, link_rel))) {
+      route_to_views(a, e, prefix, NULL, views);
+      archive_read_data_skip(a);
+      free(logical_path);
+      free(link_rel);
+      free(rel);
+      continue;
+    }
+    free(logical_path);
+
+    struct archive_entry *orig = view_entry_clone(views, e);
+    if (apply_strip_components(e, strip_components)) {
+      route_to_views(a, orig, prefix, NULL, views);
+      archive_entry_free(orig);
+      archive_read_data_skip(a);
+      free(link_rel);
+      free(rel);
+      continue;
+    }
+
+    if (wopts->bom != NULL) {
+      wopts->bom->written = 0;
+    }
+    r = extract_entry(a, e, disk, outdir, wopts);
+    if (r != ARCHIVE_OK) {
+      free(rel);
+      fail_archive(a, "extract nested entry");
+    }
+#if !defined(_WIN32)
+    if (wopts->bom != NULL && is_payload_member(prefix)) {
+      bom_record_entry(wopts->bom, prefix, rel, link_rel, e);
+    }
+#endif
+    record_output_path(wopts, outdir, e);
+    route_to_views(a, orig, prefix, e, views);
+    archive_entry_free(orig);
+    free(link_rel);
+    free(rel);
+  }
+
+  archive_write_free(disk);
+  archive_read_free(a);
+#if !defined(_WIN32)
+  if (cached != NULL) {
+    payload_cached_close(cached);
+  }
+  if (tee != NULL) {
+    payload_tee_close(tee);
+  }
+  pbzx_source_free(pbzx);
+#endif
+
+  if (cwd != NULL && chdir(cwd) != 0) {
+    fail_errno("chdir(cwd)");
+  }
+  free(cwd);
+}
+
+static int should_be_treated_as_nested_archive(const char *path) {
+  if (path == NULL) {
+    return (0);
+  }
+  const char *base = strrchr(path, '/');
+  const char *name = base != NULL ? base + 1 : path;
+  for (size_t i = 0; nested_archive_names[i] != NULL; i++) {
+    if (strcmp(name, nested_archive_names[i]) == 0) {
+      return (1);
+    }
+  }
+  return (0);
+}
+
+static char *strip_components_path(const char *path, int strip) {
+  const char *p = path;
+  int remaining = strip;
+
+  if (p == NULL) {
+    return (NULL);
+  }
+  if (strip <= 0) {
+    char *dup = strdup(p);
+    if (dup == NULL) {
+      fail_errno("strdup");
+    }
+    return (dup);
+  }
+
+  while (remaining > 0) {
+    switch (*p++) {
+    case '/':
+#if defined(_WIN32) && !defined(__CYGWIN__)
+    case '\\':
+#endif
+      remaining--;
+      break;
+    case '\0':
+      return (NULL);
+    }
+  }
+
+  for (;;) {
+    switch (*p) {
+    case '/':
+#if defined(_WIN32) && !defined(__CYGWIN__)
+    case '\\':
+#endif
+      ++p;
+      break;
+    case '\0':
+      return (NULL);
+    default: {
+      char *out = strdup(p);
+      if (out == NULL) {
+        fail_errno("strdup");
+      }
+      return (out);
+    }
+    }
+  }
+}
+
+static int apply_strip_components(struct archive_entry *e, int strip) {
+  if (strip <= 0) {
+    return (0);
+  }
+
+  const char *name = archive_entry_pathname(e);
+  char *stripped = strip_components_path(name, strip);
+  if (stripped == NULL) {
+    return (1);
+  }
+  archive_entry_set_pathname(e, stripped);
+  free(stripped);
+
+  const char *hardlink = archive_entry_hardlink(e);
+  if (hardlink != NULL) {
+    stripped = strip_components_path(hardlink, strip);
+    if (stripped == NULL) {
+      return (1);
+    }
+    archive_entry_set_hardlink(e, stripped);
+    free(stripped);
+  }
+  return (0);
+}
+
+static int path_component_count(const char *path) {
+  int count = 0;
+  int in_component = 0;
+
+  if (path == NULL) {
+    return (0);
+  }
+
+  for (const char *p = path; *p != '\0'; p++) {
+    switch (*p) {
+    case '/':
+#if defined(_WIN32) && !defined(__CYGWIN__)
+    case '\\':
+#endif
+      in_component = 0;
+      break;
+    default:
+      if (!in_component) {
+        count++;
+        in_component = 1;
+      }
+      break;
+    }
+  }
+
+  return (count);
+}
+
+static int parse_size(const char *arg, la_int64_t *out) {
+  char *end;
+  unsigned long long v;
+  int shift = 0;
+
+  errno = 0;
+  v = strtoull(arg, &end, 10);
+  if (errno != 0 || end == arg) {
+    return (-1);
+  }
+  switch (*end) {
+  case 'K':
+  case 'k':
+    shift = 10;
+    end++;
+    break;
+  case 'M':
+  case 'm':
+    shift = 20;
+    end++;
+    break;
+  case 'G':
+  case 'g':
+    shift = 30;
+    end++;
+    break;
+  }
+  if (v > ((unsigned long long)INT64_MAX >> shift)) {
+    return (-1);
+  }
+  v <<= shift;
+  if (*end != '\0') {
+    return (-1);
+  }
+  *out = (la_int64_t)v;
+  return (0);
+}
+
+static void pattern_list_add(struct pattern_list *list, const char *pattern) {
+  if (list->len == list->cap) {
+    size_t new_cap = list->cap == 0 ? 8 : list->cap * 2;
+    char **new_items = realloc(list->items, new_cap * sizeof(*new_items));
+    if (new_items == NULL) {
+      fail_errno("realloc");
+    }
+    list->items = new_items;
+    list->cap = new_cap;
+  }
+  char *dup = strdup(pattern);
+  if (dup == NULL) {
+    fail_errno("strdup");
+  }
+  list->items[list->len++] = dup;
+}
+
+static void pattern_list_free(struct pattern_list *list) {
+  for (size_t i = 0; i < list->len; i++) {
+    free(list->items[i]);
+  }
+  free(list->items);
+  list->items = NULL;
+  list->len = 0;
+  list->cap = 0;
+}
+
+static uint64_t hash_string(const char *str) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+
+  for (const unsigned char *p = (const unsigned char *)str; *p != '\0'; p++) {
+    h ^= *p;
+    h *= 0x100000001b3ULL;
+  }
+  return (h);
+}
+
+static struct string_map_slot *string_map_slot(const struct string_map *map,
+                                               const char *key) {
+  size_t mask = map->cap - 1;
+  size_t i = (size_t)hash_string(key) & mask;
+
+  while (map->slots[i].key != NULL && strcmp(map->slots[i].key, key) != 0) {
+    i = (i + 1) & mask;
+  }
+  return (&map->slots[i]);
+}
+
+static void *string_map_get(const struct string_map *map, const char *key) {
+  if (map->len == 0) {
+    return (NULL);
+  }
+  return (string_map_slot(map, key)->value);
+}
+
+/* Insert or update key; returns 1 when the key was not present before. */
+static int string_map_put(struct string_map *map, const char *key,
+                          void *value) {
+  if ((map->len + 1) * 2 > map->cap) {
+    struct string_map grown = {0};
+    grown.cap = map->cap == 0 ? 64 : map->cap * 2;
+    grown.slots = calloc(grown.cap, sizeof(*grown.slots));
+    if (grown.slots == NULL) {
+      fail_errno("calloc");
+    }
+    for (size_t i = 0; i < map->cap; i++) {
+      if (map->slots[i].key != NULL) {
+        *string_map_slot(&grown, map->slots[i].key) = map->slots[i];
+      }
+    }
+    grown.len = map->len;
+    free(map->slots);
+    *map = grown;
+  }
+
+  struct string_map_slot *slot = string_map_slot(map, key);
+  if (slot->key != NULL) {
+    slot->value = value;
+    return (0);
+  }
+  slot->key = strdup(key);
+  if (slot->key == NULL) {
+    fail_errno("strdup");
+  }
+  slot->value = value;
+  map->len++;
+  return (1);
+}
+
+static void string_map_free(struct string_map *map,
+                            void (*free_value)(void *)) {
+  for (size_t i = 0; i < map->cap; i++) {
+    if (map->slots[i].key != NULL) {
+      free(map->slots[i].key);
+      if (free_value != NULL) {
+        free_value(map->slots[i].value);
+      }
+    }
+  }
+  free(map->slots);
+  map->slots = NULL;
+  map->cap = 0;
+  map->len = 0;
+}
+
+static int should_extract_path(struct archive *matching, const char *path) {
+  struct archive_entry *entry = archive_entry_new();
+  if (entry == NULL) {
+    fail_errno("archive_entry_new");
+  }
+  archive_entry_set_pathname(entry, path);
+  int excluded = archive_match_excluded(matching, entry);
+  archive_entry_free(entry);
+  if (excluded < 0) {
+    fail_archive(matching, "archive_match_excluded");
+  }
+  return (excluded == 0);
+}
+
+/*
+ * Whether an include pattern may match something below path. A wildcard
+ * can match '/', so a pattern qualifies when its literal prefix agrees with
+ * "path/" as far as both go.
+ */
+static int has_include_descendant(const struct pattern_list *includes,
+                                  const char *path) {
+  size_t plen = strlen(path);
+  for (size_t i = 0; i < includes->len; i++) {
+    const char *pat = includes->items[i];
+    size_t lit = strcspn(pat, "*?[\\");
+    if (strncmp(pat, path, plen) == 0 && pat[plen] == '/') {
+      return (1);
+    }
+    if (pat[lit] != '\0' && strncmp(pat, path, lit < plen ? lit : plen) == 0 &&
+        (lit <= plen || pat[plen] == '/')) {
+      return (1);
+    }
+  }
+  return (0);
+}
+
+static char *join_prefix_path(const char *prefix, const char *path) {
+  if (prefix == NULL || prefix[0] == '\0' ||
+      (prefix[0] == '.' && prefix[1] == '\0')) {
+    char *dup = strdup(path);
+    if (dup == NULL) {
+      fail_errno("strdup");
+    }
+    return (dup);
+  }
+  size_t plen = strlen(prefix);
+  size_t path_len = strlen(path);
+  size_t total = plen + 1 + path_len + 1;
+  char *buf = malloc(total);
+  if (buf == NULL) {
+    fail_errno("malloc");
+  }
+  memcpy(buf, prefix, plen);
+  buf[plen] = '/';
+  memcpy(buf + plen + 1, path, path_len + 1);
+  return (buf);
+}
+
+static int contains_dotdot_segment(const char *path) {
+  const char *p = path;
+  while (*p != '\0') {
+    while (*p == '/') {
+      p++;
+    }
+    const char *seg = p;
+    while (*p != '\0' && *p != '/') {
+      p++;
+    }
+    size_t len = (size_t)(p - seg);
+    if (len == 2 && seg[0] == '.' && seg[1] == '.') {
+      return (1);
+    }
+  }
+  return (0);
+}
+
+static char *normalize_rel_path(const char *path) {
+  const char *rel = path;
+  if (rel == NULL) {
+    fprintf(stderr, "entry has empty pathname\n");
+    exit(1);
+  }
+  if (rel[0] == '.' && rel[1] == '/') {
+    rel += 2;
+  }
+  if (rel[0] == '\0') {
+    fprintf(stderr, "entry has empty pathname\n");
+    exit(1);
+  }
+  if (rel[0] == '/') {
+    fprintf(stderr, "entry pathname is absolute: %s\n", rel);
+    exit(1);
+  }
+  if (contains_dotdot_segment(rel)) {
+    fprintf(stderr, "entry pathname contains '..': %s\n", rel);
+    exit(1);
+  }
+  char *dup = strdup(rel);
+  if (dup == NULL) {
+    fail_errno("strdup");
+  }
+  return (dup);
+}
+
+static void mkdirs_for_path(const char *path) {
+  char *tmp = strdup(path);
+  if (tmp == NULL) {
+    fail_errno("strdup");
+  }
+  size_t len = strlen(tmp);
+  while (len > 1 && tmp[len - 1] == '/') {
+    tmp[len - 1] = '\0';
+    len--;
+  }
+  for (char *p = tmp + 1; *p != '\0'; p++) {
+    if (*p == '/') {
+      *p = '\0';
+      if (mkdir(tmp, 0755) != 0 && errno != EEXIST) {
+        free(tmp);
+        fail_errno("mkdir(parent)");
+      }
+      *p = '/';
+    }
+  }
+  if (mkdir(tmp, 0755) != 0 && errno != EEXIST) {
+    free(tmp);
+    fail_errno("mkdir(path)");
+  }
+  free(tmp);
+}
+
+static void ensure_outdir(const char *outdir, int force) {
+  if (outdir == NULL || outdir[0] == '\0') {
+    fail_errno("invalid output directory");
+  }
+  if (access(outdir, F_OK) == 0) {
+    return;
+  }
+  if (mkdir(outdir, 0755) != 0) {
+    fail_errno("mkdir(outdir)");
+  }
+}
+
+static int worker_count(void) {
+#if defined(_WIN32)
+  return (1);
+#else
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  if (n < 1) {
+    return (1);
+  }
+  return (n > MAX_WORKERS ? MAX_WORKERS : (int)n);
+#endif
+}
+
+#if !defined(_WIN32)
+struct parallel_job {
+  void (*fn)(void *ctx, size_t i);
+  void *ctx;
+  size_t n;
+  size_t next;
+  pthread_mutex_t mu;
+};
+
+static void *parallel_worker(void *arg) {
+  struct parallel_job *job = arg;
+
+  for (;;) {
+    pthread_mutex_lock(&job->mu);
+    size_t i = job->next < job->n ? job->next++ : job->n;
+    pthread_mutex_unlock(&job->mu);
+    if (i == job->n) {
+      return (NULL);
+    }
+    job->fn(job->ctx, i);
+  }
+}
+#endif
+
+/* Run fn(ctx, 0..n-1) on up to worker_count() threads and wait for all. */
+static void parallel_for(size_t n, void (*fn)(void *ctx, size_t i),
+                         void *ctx) {
+  size_t nthreads = (size_t)worker_count();
+
+  if (nthreads > n) {
+    nthreads = n;
+  }
+#if !defined(_WIN32)
+  if (nthreads > 1) {
+    pthread_t threads[MAX_WORKERS];
+    struct parallel_job job = {.fn = fn, .ctx = ctx, .n = n, .next = 0};
+    size_t started = 0;
+
+    pthread_mutex_init(&job.mu, NULL);
+    for (; started < nthreads; started++) {
+      if (pthread_create(&threads[started], NULL, parallel_worker, &job) !=
+          0) {
+        break;
+      }
+    }
+    /* The calling thread works too, so a failed spawn only costs speed. */
+    parallel_worker(&job);
+    for (size_t i = 0; i < started; i++) {
+      pthread_join(threads[i], NULL);
+    }
+    pthread_mutex_destroy(&job.mu);
+    return;
+  }
+#endif
+  for (size_t i = 0; i < n; i++) {
+    fn(ctx, i);
+  }
+}
+
+#if !defined(_WIN32)
+static int compare_strings(const void *a, const void *b) {
+  return (strcmp(*(char *const *)a, *(char *const *)b));
+}
+
+/*
+ * Workers only record failures; the caller reports them once parallel_for()
+ * has joined every thread, since fail_errno() exits the process.
+ */
+struct fsync_job {
+  const struct pattern_list *paths;
+  int *err;
+};
+
+static void fsync_path_cb(void *ctx, size_t i) {
+  const struct fsync_job *job = ctx;
+  int fd;
+
+  job->err[i] = 0;
+  /* Symlinks cannot be opened for fsync; their directory covers them. */
+  fd = open(job->paths->items[i], O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  if (fd < 0) {
+    if (errno != ELOOP && errno != ENOENT) {
+      job->err[i] = errno;
+    }
+    return;
+  }
+  if (fsync(fd) != 0 && errno != EINVAL) {
+    job->err[i] = errno;
+  }
+  close(fd);
+}
+
+/*
+ * Make the extracted tree durable with a single barrier. On Linux one
+ * syncfs() covers the whole output filesystem; elsewhere the written files
+ * and every directory holding them are fsync'ed in parallel. With per-file
+ * sync the files are already on disk and only the directories are left.
+ */
+static void sync_output(enum sync_policy sync, struct pattern_list *written) {
+  struct pattern_list targets = {0};
+  struct fsync_job job;
+  size_t n = 0;
+
+  if (sync == sync_policy_none) {
+    return;
+  }
+#if defined(__linux__)
+  if (sync == sync_policy_end) {
+    int fd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0 || syncfs(fd) != 0) {
+      fail_errno("syncfs");
+    }
+    close(fd);
+    return;
+  }
+#endif
+
+  pattern_list_add(&targets, ".");
+  for (size_t i = 0; i < written->len; i++) {
+    char *path = written->items[i];
+    char *slash = strrchr(path, '/');
+    if (sync == sync_policy_end) {
+      pattern_list_add(&targets, path);
+    }
+    if (slash != NULL) {
+      *slash = '\0';
+      pattern_list_add(&targets, path);
+      *slash = '/';
+    }
+  }
+  qsort(targets.items, targets.len, sizeof(*targets.items), compare_strings);
+  for (size_t i = 0; i < targets.len; i++) {
+    if (n > 0 && strcmp(targets.items[n - 1], targets.items[i]) == 0) {
+      free(targets.items[i]);
+      continue;
+    }
+    targets.items[n++] = targets.items[i];
+  }
+  targets.len = n;
+
+  job.paths = &targets;
+  job.err = calloc(targets.len, sizeof(*job.err));
+  if (job.err == NULL) {
+    fail_errno("calloc");
+  }
+  parallel_for(targets.len, fsync_path_cb, &job);
+  for (size_t i = 0; i < targets.len; i++) {
+    if (job.err[i] != 0) {
+      errno = job.err[i];
+      fail_errno(targets.items[i]);
+    }
+  }
+  free(job.err);
+  pattern_list_free(&targets);
+}
+#endif
+
+#if !defined(_WIN32)
+/*
+ * Input reader that drops the page cache behind itself: every range handed
+ * to libarchive is advised away on the next read, so a multi-GB pkg does not
+ * stay resident once it has been consumed.
+ */
+struct input_file {
+  int fd;
+  unsigned char *buf;
+  la_int64_t pos;
+  la_int64_t dropped;
+};
+
+static la_ssize_t input_file_read_cb(struct archive *a, void *client_data,
+                                     const void **buff) {
+  struct input_file *in = client_data;
+  ssize_t n;
+
+  if (in->pos > in->dropped) {
+    cache_drop_range(in->fd, in->dropped, in->pos - in->dropped);
+    in->dropped = in->pos;
+  }
+  do {
+    n = read(in->fd, in->buf, INPUT_BLOCK);
+  } while (n < 0 && errno == EINTR);
+  if (n < 0) {
+    archive_set_error(a, errno, "read: %s", strerror(errno));
+    return (-1);
+  }
+  in->pos += n;
+  *buff = in->buf;
+  return ((la_ssize_t)n);
+}
+
+static la_int64_t input_file_skip_cb(struct archive *a, void *client_data,
+                                     la_int64_t request) {
+  struct input_file *in = client_data;
+  (void)a;
+
+  if (lseek(in->fd, (off_t)request, SEEK_CUR) < 0) {
+    /* Not seekable; libarchive falls back to reading. */
+    return (0);
+  }
+  in->pos += request;
+  in->dropped = in->pos;
+  return (request);
+}
+
+static la_int64_t input_file_seek_cb(struct archive *a, void *client_data,
+                                     la_int64_t offset, int whence) {
+  struct input_file *in = client_data;
+  off_t pos = lseek(in->fd, (off_t)offset, whence);
+
+  if (pos < 0) {
+    archive_set_error(a, errno, "seek: %s", strerror(errno));
+    return (ARCHIVE_FATAL);
+  }
+  in->pos = pos;
+  in->dropped = pos;
+  return (pos);
+}
+
+static int input_file_close_cb(struct archive *a, void *client_data) {
+  struct input_file *in = client_data;
+  (void)a;
+
+  if (in->pos > in->dropped) {
+    cache_drop_range(in->fd, in->dropped, in->pos - in->dropped);
+  }
+  if (in->fd != 0) {
+    close(in->fd);
+  }
+  free(in->buf);
+  free(in);
+  return (ARCHIVE_OK);
+}
+
+static int open_input_uncached(struct archive *a, const char *path) {
+  struct input_file *in = calloc(1, sizeof(*in));
+
+  if (in == NULL) {
+    fail_errno("calloc");
+  }
+  in->buf = malloc(INPUT_BLOCK);
+  if (in->buf == NULL) {
+    fail_errno("malloc");
+  }
+  if (strcmp(path, "-") == 0) {
+    in->fd = 0;
+  } else {
+    in->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (in->fd < 0) {
+      fail_errno(path);
+    }
+  }
+  cache_policy_setup_fd(in->fd);
+
+  archive_read_set_callback_data(a, in);
+  archive_read_set_read_callback(a, input_file_read_cb);
+  archive_read_set_skip_callback(a, input_file_skip_cb);
+  archive_read_set_seek_callback(a, input_file_seek_cb);
+  archive_read_set_close_callback(a, input_file_close_cb);
+  return (archive_read_open1(a));
+}
+#endif
+
+#if !defined(_WIN32)
+static void collect_tree(const char *path, struct pattern_list *files,
+                         struct pattern_list *dirs) {
+  struct stat st;
+  DIR *d;
+  struct dirent *de;
+
+  /* Read-only directories would make the unlinks below fail. */
+  if (lstat(path, &st) == 0 && (st.st_mode & S_IRWXU) != S_IRWXU) {
+    (void)chmod(path, st.st_mode | S_IRWXU);
+  }
+  d = opendir(path);
+  if (d == NULL) {
+    fail_errno(path);
+  }
+  pattern_list_add(dirs, path);
+  while ((de = readdir(d)) != NULL) {
+    if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+      continue;
+    }
+    char *child = join_prefix_path(path, de->d_name);
+    int is_dir;
+#if defined(DT_DIR)
+    if (de->d_type != DT_UNKNOWN) {
+      is_dir = de->d_type == DT_DIR;
+    } else
+#endif
+    {
+      is_dir = lstat(child, &st) == 0 && S_ISDIR(st.st_mode);
+    }
+    if (is_dir) {
+      collect_tree(child, files, dirs);
+    } else {
+      pattern_list_add(files, child);
+    }
+    free(child);
+  }
+  closedir(d);
+}
+
+struct unlink_job {
+  const struct pattern_list *files;
+  int *err;
+};
+
+static void unlink_path_cb(void *ctx, size_t i) {
+  const struct unlink_job *job = ctx;
+
+  job->err[i] = 0;
+  if (unlink(job->files->items[i]) != 0 && errno != ENOENT) {
+    job->err[i] = errno;
+  }
+}
+
+/*
+ * Delete a tree with the unlinks spread over worker threads; directories go
+ * last, deepest first (collect_tree lists parents before their children).
+ */
+static void remove_tree(const char *path) {
+  struct pattern_list files = {0};
+  struct pattern_list dirs = {0};
+  struct unlink_job job;
+
+  collect_tree(path, &files, &dirs);
+  job.files = &files;
+  job.err = calloc(files.len + 1, sizeof(*job.err));
+  if (job.err == NULL) {
+    fail_errno("calloc");
+  }
+  parallel_for(files.len, unlink_path_cb, &job);
+  for (size_t i = 0; i < files.len; i++) {
+    if (job.err[i] != 0) {
+      errno = job.err[i];
+      fail_errno(files.items[i]);
+    }
+  }
+  free(job.err);
+  for (size_t i = dirs.len; i > 0; i--) {
+    if (rmdir(dirs.items[i - 1]) != 0 && errno != ENOENT) {
+      fail_errno(dirs.items[i - 1]);
+    }
+  }
+  pattern_list_free(&files);
+  pattern_list_free(&dirs);
+}
+
+/*
+ * --incremental keeps the paths it produced next to DIR, in
+ * DIR.pkgutil-incremental, NUL-separated; inside DIR it would show up as
+ * an extra file to --verify and in every copy of the tree. A later run
+ * only deletes the listed paths that the package no longer provides, so
+ * files pkgutil never wrote are left alone and a directory is only removed
+ * once it is empty.
+ */
+static char *incremental_manifest_path(const char *outdir) {
+  static const char suffix[] = ".pkgutil-incremental";
+  char *dir = realpath(outdir, NULL);
+  size_t len;
+
+  if (dir == NULL) {
+    fail_errno(outdir);
+  }
+  len = strlen(dir);
+  char *path = malloc(len + sizeof(suffix));
+  if (path == NULL) {
+    fail_errno("malloc");
+  }
+  memcpy(path, dir, len);
+  memcpy(path + len, suffix, sizeof(suffix));
+  free(dir);
+  return (path);
+}
+
+static void incremental_finish(const struct string_map *seen,
+                               const char *manifest) {
+  struct pattern_list gone = {0};
+  size_t tmp_len = strlen(manifest) + sizeof(".tmp");
+  char *tmp = malloc(tmp_len);
+  char *line = NULL;
+  size_t cap = 0;
+  ssize_t len;
+  struct stat st;
+  FILE *f;
+
+  if (tmp == NULL) {
+    fail_errno("malloc");
+  }
+  snprintf(tmp, tmp_len, "%s.tmp", manifest);
+  f = fopen(manifest, "r");
+  if (f == NULL && errno != ENOENT) {
+    fail_errno(manifest);
+  }
+  while (f != NULL && (len = getdelim(&line, &cap, '\0', f)) > 0) {
+    const char *base = strrchr(line, '/');
+    base = base != NULL ? base + 1 : line;
+    /* "./" entries of a Payload are recorded as DIR/. */
+    if (line[len - 1] == '\0' && strcmp(base, ".") != 0 &&
+        string_map_get(seen, line) == NULL) {
+      pattern_list_add(&gone, line);
+    }
+  }
+  if (f != NULL) {
+    if (ferror(f)) {
+      fail_errno(manifest);
+    }
+    fclose(f);
+  }
+  free(line);
+
+  /* Sorted, a directory comes before everything inside it. */
+  qsort(gone.items, gone.len, sizeof(*gone.items), compare_strings);
+  for (size_t i = gone.len; i > 0; i--) {
+    const char *path = gone.items[i - 1];
+    if (lstat(path, &st) != 0) {
+      continue;
+    }
+    if (S_ISDIR(st.st_mode)) {
+      if (rmdir(path) != 0 && errno != ENOENT && errno != ENOTEMPTY &&
+          errno != EEXIST) {
+        fail_errno(path);
+      }
+    } else if (unlink(path) != 0 && errno != ENOENT) {
+      fail_errno(path);
+    }
+  }
+  pattern_list_free(&gone);
+
+  f = fopen(tmp, "w");
+  if (f == NULL) {
+    fail_errno(tmp);
+  }
+  for (size_t i = 0; i < seen->cap; i++) {
+    if (seen->slots[i].key != NULL) {
+      fwrite(seen->slots[i].key, 1, strlen(seen->slots[i].key) + 1, f);
+    }
+  }
+  if (fflush(f) != 0 || ferror(f) || fclose(f) != 0) {
+    fail_errno(tmp);
+  }
+  if (rename(tmp, manifest) != 0) {
+    fail_errno(manifest);
+  }
+  free(tmp);
+}
+
+/*
+ * Create the directory that --replace extracts into, next to outdir so the
+ * final swap stays on one filesystem. mkdtemp() makes it 0700; it takes
+ * outdir's mode instead, or the mode mkdir(outdir, 0755) would give.
+ */
+static char *make_staging_dir(const char *outdir) {
+  static const char suffix[] = ".pkgutil-XXXXXX";
+  size_t len = strlen(outdir);
+  struct stat st;
+  mode_t mode;
+
+  while (len > 1 && outdir[len - 1] == '/') {
+    len--;
+  }
+  char *staging = malloc(len + sizeof(suffix));
+  if (staging == NULL) {
+    fail_errno("malloc");
+  }
+  memcpy(staging, outdir, len);
+  memcpy(staging + len, suffix, sizeof(suffix));
+  if (mkdtemp(staging) == NULL) {
+    fail_errno("mkdtemp");
+  }
+  if (stat(outdir, &st) == 0 && S_ISDIR(st.st_mode)) {
+    mode = st.st_mode & 07777;
+  } else {
+    mode = umask(0);
+    umask(mode);
+    mode = 0755 & ~mode;
+  }
+  if (chmod(staging, mode) != 0) {
+    fail_errno(staging);
+  }
+  return (staging);
+}
+
+static int exchange_paths(const char *a, const char *b) {
+#if defined(__linux__) && defined(SYS_renameat2)
+  return ((int)syscall(SYS_renameat2, AT_FDCWD, a, AT_FDCWD, b,
+                       1 << 1 /* RENAME_EXCHANGE */));
+#elif defined(__APPLE__) && defined(RENAME_SWAP)
+  return (renamex_np(a, b, RENAME_SWAP));
+#else
+  (void)a;
+  (void)b;
+  errno = ENOSYS;
+  return (-1);
+#endif
+}
+
+/*
+ * Put the staged tree in place of outdir. When outdir already exists both
+ * names are exchanged in one step so readers see either the old or the new
+ * tree, never a mix; the old tree then sits at the staging path and is
+ * removed. Filesystems without an exchange primitive get a rename aside
+ * followed by a rename into place.
+ */
+static void replace_outdir(char *staging, const char *outdir) {
+  struct stat st;
+
+  if (lstat(outdir, &st) != 0) {
+    if (errno != ENOENT) {
+      fail_errno(outdir);
+    }
+    if (rename(staging, outdir) != 0) {
+      fail_errno("rename(staging)");
+    }
+    return;
+  }
+  if (exchange_paths(staging, outdir) != 0) {
+    if (errno != ENOSYS && errno != EINVAL && errno != ENOTSUP) {
+      fail_errno("exchange(staging)");
+    }
+    size_t len = strlen(staging);
+    char *old = malloc(len + sizeof("-old"));
+    if (old == NULL) {
+      fail_errno("malloc");
+    }
+    memcpy(old, staging, len);
+    memcpy(old + len, "-old", sizeof("-old"));
+    if (rename(outdir, old) != 0) {
+      fail_errno("rename(outdir)");
+    }
+    if (rename(staging, outdir) != 0) {
+      fail_errno("rename(staging)");
+    }
+    remove_tree(old);
+    free(old);
+    return;
+  }
+  remove_tree(staging);
+}
+
+static void sync_parent_dir(const char *path) {
+  char *dir = strdup(path);
+  if (dir == NULL) {
+    fail_errno("strdup");
+  }
+  char *slash = strrchr(dir, '/');
+  if (slash == NULL) {
+    strcpy(dir, ".");
+  } else if (slash == dir) {
+    slash[1] = '\0';
+  } else {
+    *slash = '\0';
+  }
+  int fd = open(dir, O_RDONLY | O_CLOEXEC);
+  if (fd < 0 || fsync(fd) != 0) {
+    fail_errno(dir);
+  }
+  close(fd);
+  free(dir);
+}
+
+/*
+ * Result cache: DIR/<key>/tree holds a finished extraction and
+ * DIR/<key>/size its disk usage. The key combines the pkg identity with
+ * the options that decide which paths end up where, so a hit can be
+ * linked into place without reading the Payload. Entries are published
+ * with a rename and their mtime records the last use for eviction.
+ */
+static void result_cache_key(const char *pkg_id, int expand_full, int strip,
+                             struct pattern_list *includes,
+                             struct pattern_list *excludes, char key[65]) {
+  struct sha256_ctx ctx;
+  char line[64];
+
+  sha256_init(&ctx);
+  sha256_update(&ctx, pkg_id, strlen(pkg_id));
+  /* Filter order does not change the result, so hash them sorted. */
+  qsort(includes->items, includes->len, sizeof(*includes->items),
+        compare_strings);
+  qsort(excludes->items, excludes->len, sizeof(*excludes->items),
+        compare_strings);
+  snprintf(line, sizeof(line), "\n%s\nstrip %d\n",
+           expand_full ? "expand-full" : "expand", strip);
+  sha256_update(&ctx, line, strlen(line));
+  for (size_t i = 0; i < includes->len; i++) {
+    sha256_update(&ctx, "include ", 8);
+    sha256_update(&ctx, includes->items[i], strlen(includes->items[i]) + 1);
+  }
+  for (size_t i = 0; i < excludes->len; i++) {
+    sha256_update(&ctx, "exclude ", 8);
+    sha256_update(&ctx, excludes->items[i], strlen(excludes->items[i]) + 1);
+  }
+  sha256_hex(&ctx, key);
+}
+
+static void stat_times(const struct stat *st, struct timespec ts[2]) {
+#if defined(__APPLE__)
+  ts[0] = st->st_atimespec;
+  ts[1] = st->st_mtimespec;
+#else
+  ts[0] = st->st_atim;
+  ts[1] = st->st_mtim;
+#endif
+}
+
+/* Byte copy of src to the new file dst; clones where the filesystem can. */
+static int copy_file_contents(const char *src, const char *dst,
+                              const struct stat *st) {
+#if defined(__APPLE__)
+  /* The clone carries src's mode and times. */
+  if (clonefile(src, dst, CLONE_NOFOLLOW) == 0) {
+    return (0);
+  }
+#endif
+  int sfd = open(src, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  if (sfd < 0) {
+    return (-1);
+  }
+  int dfd = open(dst, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC,
+                 st->st_mode & 07777);
+  if (dfd < 0) {
+    close(sfd);
+    return (-1);
+  }
+  int r = 0;
+#if defined(FICLONE)
+  if (ioctl(dfd, FICLONE, sfd) != 0)
+#endif
+  {
+    unsigned char *buf = malloc(INPUT_BLOCK);
+    la_int64_t off = 0;
+    if (buf == NULL) {
+      fail_errno("malloc");
+    }
+    for (;;) {
+      ssize_t n = pread(sfd, buf, INPUT_BLOCK, (off_t)off);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        r = (int)n;
+        break;
+      }
+      if (write_full_at(dfd, buf, (size_t)n, off) != 0) {
+        r = -1;
+        break;
+      }
+      off += n;
+    }
+    free(buf);
+  }
+  struct timespec ts[2];
+  stat_times(st, ts);
+  if (r == 0 && futimens(dfd, ts) != 0) {
+    r = -1;
+  }
+  close(sfd);
+  if (close(dfd) != 0) {
+    r = -1;
+  }
+  return (r);
+}
+
+/*
+ * Recreate the tree at src under dst. Files are cloned where the
+ * filesystem can and copied otherwise, so editing one side never reaches
+ * the other; with share set they are hardlinked instead. Existing
+ * non-directories at dst are replaced. Returns the disk usage of src.
+ */
+static la_int64_t mirror_tree(const char *src, const char *dst, int share) {
+  la_int64_t usage = 0;
+  struct dirent *de;
+  struct stat st;
+  DIR *d;
+
+  d = opendir(src);
+  if (d == NULL) {
+    fail_errno(src);
+  }
+  while ((de = readdir(d)) != NULL) {
+    if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+      continue;
+    }
+    char *from = join_prefix_path(src, de->d_name);
+    char *to = join_prefix_path(dst, de->d_name);
+    if (lstat(from, &st) != 0) {
+      fail_errno(from);
+    }
+    usage += (la_int64_t)st.st_blocks * 512;
+    if (S_ISDIR(st.st_mode)) {
+      if (mkdir(to, 0700) != 0 && errno != EEXIST) {
+        fail_errno(to);
+      }
+      usage += mirror_tree(from, to, share);
+      struct timespec ts[2];
+      stat_times(&st, ts);
+      if (chmod(to, st.st_mode & 07777) != 0 ||
+          utimensat(AT_FDCWD, to, ts, 0) != 0) {
+        fail_errno(to);
+      }
+    } else {
+      if (unlink(to) != 0 && errno != ENOENT) {
+        fail_errno(to);
+      }
+      if (S_ISLNK(st.st_mode)) {
+        char target[4096];
+        ssize_t n = readlink(from, target, sizeof(target) - 1);
+        if (n < 0) {
+          fail_errno(from);
+        }
+        target[n] = '\0';
+        struct timespec ts[2];
+        stat_times(&st, ts);
+        if (symlink(target, to) != 0 ||
+            utimensat(AT_FDCWD, to, ts, AT_SYMLINK_NOFOLLOW) != 0) {
+          fail_errno(to);
+        }
+      } else if ((!share || link(from, to) != 0) &&
+                 copy_file_contents(from, to, &st) != 0) {
+        fail_errno(to);
+      }
+    }
+    free(from);
+    free(to);
+  }
+  closedir(d);
+  return (usage);
+}
+
+/* Copy a cached result into dst. Returns 0 on a hit. */
+static int result_cache_fetch(const char *cache, const char *key,
+                              const char *dst, int share) {
+  char *entry = join_prefix_path(cache, key);
+  char *tree = join_prefix_path(entry, "tree");
+  struct stat st;
+  int r = -1;
+
+  if (stat(tree, &st) == 0 && S_ISDIR(st.st_mode)) {
+    (void)utimensat(AT_FDCWD, entry, NULL, 0);
+    mirror_tree(tree, dst, share);
+    r = 0;
+  }
+  free(tree);
+  free(entry);
+  return (r);
+}
+
+struct cache_entry {
+  char *name;
+  time_t used;
+  la_int64_t size;
+};
+
+static int compare_cache_entries(const void *a, const void *b) {
+  const struct cache_entry *x = a;
+  const struct cache_entry *y = b;
+
+  return ((x->used > y->used) - (x->used < y->used));
+}
+
+/* Drop least recently used entries until the cache fits in limit. */
+static void result_cache_evict(const char *cache, const char *keep,
+                               la_int64_t limit) {
+  struct cache_entry *entries = NULL;
+  size_t len = 0;
+  size_t cap = 0;
+  la_int64_t total = 0;
+  struct dirent *de;
+  struct stat st;
+  DIR *d;
+
+  d = opendir(cache);
+  if (d == NULL) {
+    fail_errno(cache);
+  }
+  while ((de = readdir(d)) != NULL) {
+    if (de->d_name[0] == '.' || strlen(de->d_name) != 64) {
+      continue;
+    }
+    char *entry = join_prefix_path(cache, de->d_name);
+    char *size_path = join_prefix_path(entry, "size");
+    FILE *f = fopen(size_path, "r");
+    long long size;
+    if (f != NULL && stat(entry, &st) == 0 && fscanf(f, "%lld", &size) == 1) {
+      if (len == cap) {
+        cap = cap == 0 ? 16 : cap * 2;
+        entries = realloc(entries, cap * sizeof(*entries));
+        if (entries == NULL) {
+          fail_errno("realloc");
+        }
+      }
+      entries[len].name = entry;
+      entries[len].used = st.st_mtime;
+      entries[len].size = size;
+      total += size;
+      len++;
+      entry = NULL;
+    }
+    if (f != NULL) {
+      fclose(f);
+    }
+    free(size_path);
+    free(entry);
+  }
+  closedir(d);
+
+  qsort(entries, len, sizeof(*entries), compare_cache_entries);
+  for (size_t i = 0; i < len && total > limit; i++) {
+    const char *slash = strrchr(entries[i].name, '/');
+    if (strcmp(slash != NULL ? slash + 1 : entries[i].name, keep) == 0) {
+      continue;
+    }
+    /* Unpublish first so concurrent runs never see a partial tree. */
+    char *doomed = join_prefix_path(cache, ".evict-XXXXXX");
+    if (mkdtemp(doomed) != NULL) {
+      char *moved = join_prefix_path(doomed, "entry");
+      if (rename(entries[i].name, moved) == 0) {
+        total -= entries[i].size;
+      }
+      remove_tree(doomed);
+      free(moved);
+    }
+    free(doomed);
+  }
+  for (size_t i = 0; i < len; i++) {
+    free(entries[i].name);
+  }
+  free(entries);
+}
+
+/* Drop least recently used pbzx chunks until the cache fits in limit. */
+static void pbzx_cache_evict(const char *cache, la_int64_t limit) {
+  struct cache_entry *entries = NULL;
+  size_t len = 0;
+  size_t cap = 0;
+  la_int64_t total = 0;
+  struct dirent *de;
+  struct stat st;
+  DIR *d;
+
+  d = opendir(cache);
+  if (d == NULL) {
+    fail_errno(cache);
+  }
+  while ((de = readdir(d)) != NULL) {
+    if (de->d_name[0] == '.' || strlen(de->d_name) != 64) {
+      continue;
+    }
+    char *path = join_prefix_path(cache, de->d_name);
+    if (lstat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+      free(path);
+      continue;
+    }
+    if (len == cap) {
+      cap = cap == 0 ? 64 : cap * 2;
+      entries = realloc(entries, cap * sizeof(*entries));
+      if (entries == NULL) {
+        fail_errno("realloc");
+      }
+    }
+    entries[len].name = path;
+    entries[len].used = st.st_mtime;
+    entries[len].size = (la_int64_t)st.st_blocks * 512;
+    total += entries[len].size;
+    len++;
+  }
+  closedir(d);
+
+  qsort(entries, len, sizeof(*entries), compare_cache_entries);
+  for (size_t i = 0; i < len; i++) {
+    if (total > limit && unlink(entries[i].name) == 0) {
+      total -= entries[i].size;
+    }
+    free(entries[i].name);
+  }
+  free(entries);
+}
+
+/* Publish the extraction at src under key, then enforce the size limit. */
+static void result_cache_store(const char *cache, const char *key,
+                               const char *src, int share, la_int64_t limit) {
+  char *tmp = join_prefix_path(cache, ".store-XXXXXX");
+  char *entry = join_prefix_path(cache, key);
+
+  if (mkdtemp(tmp) == NULL) {
+    fail_errno(tmp);
+  }
+  char *tree = join_prefix_path(tmp, "tree");
+  char *size_path = join_prefix_path(tmp, "size");
+  if (mkdir(tree, 0755) != 0) {
+    fail_errno(tree);
+  }
+  la_int64_t usage = mirror_tree(src, tree, share);
+  FILE *f = fopen(size_path, "w");
+  if (f == NULL || fprintf(f, "%" PRId64 "\n", (int64_t)usage) < 0 ||
+      fclose(f) != 0) {
+    fail_errno(size_path);
+  }
+  if (chmod(tmp, 0755) != 0) {
+    fail_errno(tmp);
+  }
+  /* Another run may have published the same key first; keep theirs. */
+  if (rename(tmp, entry) != 0) {
+    if (errno != EEXIST && errno != ENOTEMPTY) {
+      fail_errno(entry);
+    }
+    remove_tree(tmp);
+  }
+  if (limit > 0) {
+    result_cache_evict(cache, key, limit);
+  }
+  free(size_path);
+  free(tree);
+  free(entry);
+  free(tmp);
+}
+#endif
+
+#if !defined(_WIN32)
+/* Where an entry of the member at outdir lands; "" is the output root. */
+static char *output_path(const char *outdir, const char *path) {
+  if (strcmp(path, ".") == 0) {
+    char *root =
+        strdup(outdir != NULL && strcmp(outdir, ".") != 0 ? outdir : "");
+    if (root == NULL) {
+      fail_errno("strdup");
+    }
+    return (root);
+  }
+  return (join_prefix_path(outdir, path));
+}
+
+/*
+ * --output-format squashfs: a SquashFS 4.0 image written while entries are
+ * read. File data is cut into blocks that are zstd-compressed in batches on
+ * worker_count() threads and appended in order; the inode, directory and
+ * id tables are kept in memory and written after the last entry. Files get
+ * no fragments, so a file's tail is stored as its own short block.
+ */
+#define SQFS_MAGIC 0x73717368u
+#define SQFS_SUPERBLOCK 96
+#define SQFS_BLOCK_LOG 17
+#define SQFS_BLOCK_SIZE (1u << SQFS_BLOCK_LOG)
+#define SQFS_BLOCK_RAW (1u << 24)
+#define SQFS_META_SIZE 8192
+#define SQFS_META_RAW 0x8000u
+#define SQFS_BATCH 64
+#define SQFS_DIR_COUNT 256
+#define SQFS_INVALID 0xffffffffu
+#define SQFS_INVALID_BLK UINT64_C(0xffffffffffffffff)
+#define SQFS_ZSTD 6
+#define SQFS_NO_FRAGMENTS 0x0010
+#define SQFS_NO_XATTRS 0x0200
+
+enum sqfs_type {
+  sqfs_dir = 1,
+  sqfs_file,
+  sqfs_symlink,
+  sqfs_blkdev,
+  sqfs_chrdev,
+  sqfs_fifo,
+  sqfs_socket,
+  sqfs_ldir = 8,
+  sqfs_lfile,
+};
+
+struct image_node;
+
+struct image_dirent {
+  char *name;
+  struct image_node *node;
+};
+
+struct image_node {
+  unsigned int mode;
+  uint16_t uid;
+  uint16_t gid;
+  uint32_t mtime;
+  uint32_t ino;
+  uint32_t nlink;
+  int implicit; /* created for a path's parent, not by an entry */
+  int written;
+  uint64_t ref;
+  /* Directories. */
+  struct image_node *parent;
+  struct image_dirent *children;
+  size_t nchildren;
+  size_t children_cap;
+  /* Regular files. */
+  uint64_t size;
+  uint64_t start;
+  uint64_t sparse;
+  uint32_t *blocks;
+  size_t nblocks;
+  /* Symlinks and devices. */
+  char *target;
+  uint32_t rdev;
+};
+
+struct image_slot {
+  struct image_node *node;
+  size_t index;
+  size_t len;
+  unsigned char *in;
+  unsigned char *out;
+  size_t out_len; /* 0: all zeros, stored as a hole */
+  int raw;
+  ZSTD_CCtx *cctx;
+};
+
+struct image_meta {
+  unsigned char *data;
+  size_t len;
+  size_t cap;
+  unsigned char block[SQFS_META_SIZE];
+  size_t fill;
+};
+
+struct squashfs_image {
+  const char *path;
+  int fd;
+  uint64_t pos;
+  uint32_t mtime;
+  struct image_node *root;
+  struct image_node **nodes;
+  size_t nnodes;
+  size_t nodes_cap;
+  struct string_map paths;
+  uint32_t *ids;
+  size_t nids;
+  struct image_slot slots[SQFS_BATCH];
+  size_t nslots;
+  ZSTD_CCtx *meta_cctx;
+};
+
+static void store_le16(unsigned char *p, uint16_t v) {
+  p[0] = (unsigned char)v;
+  p[1] = (unsigned char)(v >> 8);
+}
+
+static void store_le64(unsigned char *p, uint64_t v) {
+  store_le32(p, (uint32_t)v);
+  store_le32(p + 4, (uint32_t)(v >> 32));
+}
+
+static uint16_t image_id(struct squashfs_image *img, la_int64_t id) {
+  uint32_t v = id < 0 ? 0 : (uint32_t)id;
+
+  for (size_t i = 0; i < img->nids; i++) {
+    if (img->ids[i] == v) {
+      return ((uint16_t)i);
+    }
+  }
+  if (img->nids == 65536) {
+    fprintf(stderr, "%s: too many distinct owners\n", img->path);
+    exit(1);
+  }
+  img->ids = realloc(img->ids, (img->nids + 1) * sizeof(*img->ids));
+  if (img->ids == NULL) {
+    fail_errno("realloc");
+  }
+  img->ids[img->nids] = v;
+  return ((uint16_t)img->nids++);
+}
+
+static struct image_node *image_new_node(struct squashfs_image *img,
+                                         unsigned int mode) {
+  struct image_node *n = calloc(1, sizeof(*n));
+
+  if (n == NULL) {
+    fail_errno("calloc");
+  }
+  if (img->nnodes == img->nodes_cap) {
+    img->nodes_cap = img->nodes_cap == 0 ? 256 : img->nodes_cap * 2;
+    img->nodes = realloc(img->nodes, img->nodes_cap * sizeof(*img->nodes));
+    if (img->nodes == NULL) {
+      fail_errno("realloc");
+    }
+  }
+  img->nodes[img->nnodes++] = n;
+  n->mode = mode;
+  return (n);
+}
+
+static void image_set_attrs(struct squashfs_image *img, struct image_node *n,
+                            struct archive_entry *e) {
+  time_t mtime = archive_entry_mtime(e);
+
+  n->mode = (unsigned int)archive_entry_mode(e);
+  n->uid = image_id(img, archive_entry_uid(e));
+  n->gid = image_id(img, archive_entry_gid(e));
+  n->mtime = mtime < 0 ? 0
+             : (uint64_t)mtime > UINT32_MAX ? UINT32_MAX
+                                             : (uint32_t)mtime;
+  n->implicit = 0;
+  if (n->mtime > img->mtime) {
+    img->mtime = n->mtime;
+  }
+}
+
+/* Point dir/name at node, replacing whatever the name referred to. */
+static void image_link(struct image_node *dir, const char *name,
+                       struct image_node *node) {
+  if (strlen(name) > 256) {
+    fprintf(stderr, "%s: name too long for squashfs\n", name);
+    exit(1);
+  }
+  for (size_t i = 0; i < dir->nchildren; i++) {
+    if (strcmp(dir->children[i].name, name) == 0) {
+      dir->children[i].node->nlink--;
+      dir->children[i].node = node;
+      node->nlink++;
+      node->parent = dir;
+      return;
+    }
+  }
+  if (dir->nchildren == dir->children_cap) {
+    dir->children_cap = dir->children_cap == 0 ? 8 : dir->children_cap * 2;
+    dir->children =
+        realloc(dir->children, dir->children_cap * sizeof(*dir->children));
+    if (dir->children == NULL) {
+      fail_errno("realloc");
+    }
+  }
+  dir->children[dir->nchildren].name = strdup(name);
+  if (dir->children[dir->nchildren].name == NULL) {
+    fail_errno("strdup");
+  }
+  dir->children[dir->nchildren++].node = node;
+  node->nlink++;
+  node->parent = dir;
+}
+
+/* The directory at path, created with its parents when missing. */
+static struct image_node *image_dir(struct squashfs_image *img,
+                                    const char *path) {
+  struct image_node *n;
+  struct image_node *parent;
+  char *copy;
+  char *slash;
+
+  if (path[0] == '\0') {
+    return (img->root);
+  }
+  n = string_map_get(&img->paths, path);
+  if (n != NULL) {
+    if ((n->mode & AE_IFMT) != AE_IFDIR) {
+      fprintf(stderr, "%s: not a directory\n", path);
+      exit(1);
+    }
+    return (n);
+  }
+  copy = strdup(path);
+  if (copy == NULL) {
+    fail_errno("strdup");
+  }
+  slash = strrchr(copy, '/');
+  if (slash != NULL) {
+    *slash = '\0';
+    parent = image_dir(img, copy);
+  } else {
+    parent = img->root;
+  }
+  n = image_new_node(img, AE_IFDIR | 0755);
+  n->implicit = 1;
+  image_link(parent, slash != NULL ? slash + 1 : copy, n);
+  string_map_put(&img->paths, path, n);
+  free(copy);
+  return (n);
+}
+
+static void image_compress_cb(void *ctx, size_t i) {
+  struct squashfs_image *img = ctx;
+  struct image_slot *s = &img->slots[i];
+  size_t r;
+
+  if (s->in[0] == 0 && memcmp(s->in, s->in + 1, s->len - 1) == 0) {
+    s->out_len = 0;
+    return;
+  }
+  if (s->cctx == NULL && (s->cctx = ZSTD_createCCtx()) == NULL) {
+    fail_errno("ZSTD_createCCtx");
+  }
+  r = ZSTD_compressCCtx(s->cctx, s->out, ZSTD_compressBound(SQFS_BLOCK_SIZE),
+                        s->in, s->len, 3);
+  s->raw = ZSTD_isError(r) || r >= s->len;
+  s->out_len = s->raw ? s->len : r;
+}
+
+/* Compress the pending blocks in parallel, then append them in order. */
+static void image_flush(struct squashfs_image *img) {
+  parallel_for(img->nslots, image_compress_cb, img);
+  for (size_t i = 0; i < img->nslots; i++) {
+    struct image_slot *s = &img->slots[i];
+    struct image_node *n = s->node;
+
+    if (s->index == 0) {
+      n->start = img->pos;
+    }
+    if (s->out_len == 0) {
+      n->blocks[s->index] = 0;
+      n->sparse += s->len;
+    } else {
+      if (write_full_at(img->fd, s->raw ? s->in : s->out, s->out_len,
+                        (la_int64_t)img->pos) != 0) {
+        fail_errno(img->path);
+      }
+      n->blocks[s->index] =
+          (uint32_t)s->out_len | (s->raw ? SQFS_BLOCK_RAW : 0);
+      img->pos += s->out_len;
+    }
+    s->len = 0;
+  }
+  img->nslots = 0;
+}
+
+/* Append n bytes of p (zeros when NULL) to the file at *pos. */
+static void image_file_bytes(struct squashfs_image *img, struct image_node *n,
+                             uint64_t *pos, const unsigned char *p,
+                             size_t len) {
+  while (len > 0 && *pos < n->size) {
+    struct image_slot *s = &img->slots[img->nslots];
+    size_t take = SQFS_BLOCK_SIZE - s->len;
+
+    if (s->len == 0) {
+      s->node = n;
+      s->index = (size_t)(*pos / SQFS_BLOCK_SIZE);
+    }
+    if (take > len) {
+      take = len;
+    }
+    if (take > n->size - *pos) {
+      take = (size_t)(n->size - *pos);
+    }
+    if (p != NULL) {
+      memcpy(s->in + s->len, p, take);
+      p += take;
+    } else {
+      memset(s->in + s->len, 0, take);
+    }
+    s->len += take;
+    *pos += take;
+    len -= take;
+    if (s->len == SQFS_BLOCK_SIZE || *pos == n->size) {
+      if (++img->nslots == SQFS_BATCH) {
+        image_flush(img);
+      }
+    }
+  }
+}
+
+static int image_file_data(struct squashfs_image *img, struct archive *a,
+                           struct image_node *n, la_int64_t size) {
+  const void *buf;
+  size_t len;
+  la_int64_t off;
+  uint64_t pos = 0;
+  int r;
+
+  n->size = size < 0 ? 0 : (uint64_t)size;
+  n->nblocks = (size_t)((n->size + SQFS_BLOCK_SIZE - 1) / SQFS_BLOCK_SIZE);
+  free(n->blocks);
+  n->blocks = calloc(n->nblocks + 1, sizeof(*n->blocks));
+  if (n->blocks == NULL) {
+    fail_errno("calloc");
+  }
+  while ((r = archive_read_data_block(a, &buf, &len, &off)) == ARCHIVE_OK) {
+    if ((uint64_t)off > pos) {
+      image_file_bytes(img, n, &pos, NULL, (size_t)((uint64_t)off - pos));
+    }
+    image_file_bytes(img, n, &pos, buf, len);
+  }
+  if (r != ARCHIVE_EOF) {
+    return (r);
+  }
+  while (pos < n->size) {
+    image_file_bytes(img, n, &pos, NULL, SQFS_BLOCK_SIZE);
+  }
+  return (ARCHIVE_OK);
+}
+
+static struct squashfs_image *image_open(const char *path) {
+  struct squashfs_image *img = calloc(1, sizeof(*img));
+
+  if (img == NULL) {
+    fail_errno("calloc");
+  }
+  img->path = path;
+  img->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (img->fd < 0) {
+    fail_errno(path);
+  }
+  img->pos = SQFS_SUPERBLOCK;
+  img->root = image_new_node(img, AE_IFDIR | 0755);
+  img->root->implicit = 1;
+  for (size_t i = 0; i < SQFS_BATCH; i++) {
+    img->slots[i].in = malloc(SQFS_BLOCK_SIZE);
+    img->slots[i].out = malloc(ZSTD_compressBound(SQFS_BLOCK_SIZE));
+    if (img->slots[i].in == NULL || img->slots[i].out == NULL) {
+      fail_errno("malloc");
+    }
+  }
+  img->meta_cctx = ZSTD_createCCtx();
+  if (img->meta_cctx == NULL) {
+    fail_errno("ZSTD_createCCtx");
+  }
+  (void)image_id(img, 0);
+  return (img);
+}
+
+/*
+ * Add e, named relative to the member at outdir, to the image. Regular
+ * file data is queued for compression; everything else lives in memory
+ * until image_close().
+ */
+static int image_entry(struct archive *a, struct archive_entry *e,
+                       const char *outdir, struct squashfs_image *img) {
+  const char *hardlink = archive_entry_hardlink(e);
+  unsigned int type = (unsigned int)archive_entry_filetype(e);
+  struct image_node *n;
+  char *path;
+  char *slash;
+  int r = ARCHIVE_OK;
+
+  path = output_path(outdir, archive_entry_pathname(e));
+
+  if (hardlink != NULL) {
+    char *target_path = join_prefix_path(outdir, hardlink);
+    n = string_map_get(&img->paths, target_path);
+    free(target_path);
+    if (n == NULL || (n->mode & AE_IFMT) == AE_IFDIR) {
+      fprintf(stderr, "%s: hardlink target %s not in image\n", path,
+              hardlink);
+      exit(1);
+    }
+    /* cpio stores the data of a linked file with its last name. */
+    if ((n->mode & AE_IFMT) == AE_IFREG && n->nblocks == 0 &&
+        archive_entry_size_is_set(e) && archive_entry_size(e) > 0) {
+      r = image_file_data(img, a, n, archive_entry_size(e));
+    }
+  } else if (path[0] == '\0' ||
+             (type == AE_IFDIR &&
+              (n = string_map_get(&img->paths, path)) != NULL &&
+              (n->mode & AE_IFMT) == AE_IFDIR)) {
+    image_set_attrs(img, path[0] == '\0' ? img->root : n, e);
+    free(path);
+    return (archive_read_data_skip(a));
+  } else {
+    switch (type) {
+    case AE_IFDIR:
+    case AE_IFIFO:
+    case AE_IFSOCK:
+      n = image_new_node(img, type);
+      break;
+    case AE_IFLNK:
+      n = image_new_node(img, type);
+      n->target = strdup(archive_entry_symlink(e) != NULL
+                             ? archive_entry_symlink(e)
+                             : "");
+      if (n->target == NULL) {
+        fail_errno("strdup");
+      }
+      break;
+    case AE_IFBLK:
+    case AE_IFCHR: {
+      uint32_t major = (uint32_t)archive_entry_rdevmajor(e);
+      uint32_t minor = (uint32_t)archive_entry_rdevminor(e);
+      n = image_new_node(img, type);
+      n->rdev = (minor & 0xff) | (major << 8) | ((minor & ~0xffu) << 12);
+      break;
+    }
+    case AE_IFREG:
+      n = image_new_node(img, type);
+      r = image_file_data(img, a, n, archive_entry_size(e));
+      break;
+    default:
+      free(path);
+      return (archive_read_data_skip(a));
+    }
+    image_set_attrs(img, n, e);
+  }
+
+  slash = strrchr(path, '/');
+  if (slash != NULL) {
+    *slash = '\0';
+    image_link(image_dir(img, path), slash + 1, n);
+    *slash = '/';
+  } else {
+    image_link(img->root, path, n);
+  }
+  string_map_put(&img->paths, path, n);
+  free(path);
+  return (r);
+}
+
+static void image_meta_flush(struct squashfs_image *img,
+                             struct image_meta *m) {
+  size_t bound = ZSTD_compressBound(SQFS_META_SIZE);
+  size_t r;
+
+  if (m->len + 2 + bound > m->cap) {
+    m->cap = (m->len + 2 + bound) * 2;
+    m->data = realloc(m->data, m->cap);
+    if (m->data == NULL) {
+      fail_errno("realloc");
+    }
+  }
+  r = ZSTD_compressCCtx(img->meta_cctx, m->data + m->len + 2, bound,
+                        m->block, m->fill, 3);
+  if (ZSTD_isError(r) || r >= m->fill) {
+    store_le16(m->data + m->len, (uint16_t)(m->fill | SQFS_META_RAW));
+    memcpy(m->data + m->len + 2, m->block, m->fill);
+    m->len += 2 + m->fill;
+  } else {
+    store_le16(m->data + m->len, (uint16_t)r);
+    m->len += 2 + r;
+  }
+  m->fill = 0;
+}
+
+static void image_meta_put(struct squashfs_image *img, struct image_meta *m,
+                           const unsigned char *p, size_t len) {
+  while (len > 0) {
+    size_t take = SQFS_META_SIZE - m->fill;
+    if (take > len) {
+      take = len;
+    }
+    memcpy(m->block + m->fill, p, take);
+    m->fill += take;
+    p += take;
+    len -= take;
+    if (m->fill == SQFS_META_SIZE) {
+      image_meta_flush(img, m);
+    }
+  }
+}
+
+/* Reference to the next byte written to m: block offset and offset in it. */
+static uint64_t image_meta_ref(const struct image_meta *m) {
+  return ((uint64_t)m->len << 16 | m->fill);
+}
+
+static void image_number(struct squashfs_image *img, struct image_node *dir,
+                         uint32_t *next) {
+  dir->ino = (*next)++;
+  if (dir->implicit) {
+    dir->mtime = img->mtime;
+  }
+  for (size_t i = 0; i < dir->nchildren; i++) {
+    struct image_node *n = dir->children[i].node;
+    if ((n->mode & AE_IFMT) == AE_IFDIR) {
+      image_number(img, n, next);
+    } else if (n->ino == 0) {
+      n->ino = (*next)++;
+    }
+  }
+}
+
+static int compare_image_dirents(const void *a, const void *b) {
+  return (strcmp(((const struct image_dirent *)a)->name,
+                 ((const struct image_dirent *)b)->name));
+}
+
+static uint16_t image_basic_type(const struct image_node *n) {
+  switch (n->mode & AE_IFMT) {
+  case AE_IFDIR:
+    return (sqfs_dir);
+  case AE_IFLNK:
+    return (sqfs_symlink);
+  case AE_IFBLK:
+    return (sqfs_blkdev);
+  case AE_IFCHR:
+    return (sqfs_chrdev);
+  case AE_IFIFO:
+    return (sqfs_fifo);
+  case AE_IFSOCK:
+    return (sqfs_socket);
+  default:
+    return (sqfs_file);
+  }
+}
+
+static void image_inode_header(unsigned char *p, const struct image_node *n,
+                               uint16_t type) {
+  store_le16(p, type);
+  store_le16(p + 2, (uint16_t)(n->mode & 07777));
+  store_le16(p + 4, n->uid);
+  store_le16(p + 6, n->gid);
+  store_le32(p + 8, n->mtime);
+  store_le32(p + 12, n->ino);
+}
+
+static void image_write_inode(struct squashfs_image *img,
+                              struct image_meta *inodes,
+                              struct image_node *n) {
+  unsigned char buf[56];
+  uint16_t type = image_basic_type(n);
+
+  n->ref = image_meta_ref(inodes);
+  n->written = 1;
+  switch (type) {
+  case sqfs_file:
+    image_inode_header(buf, n, sqfs_lfile);
+    store_le64(buf + 16, n->nblocks > 0 ? n->start : 0);
+    store_le64(buf + 24, n->size);
+    store_le64(buf + 32, n->sparse);
+    store_le32(buf + 40, n->nlink);
+    store_le32(buf + 44, SQFS_INVALID);
+    store_le32(buf + 48, 0);
+    store_le32(buf + 52, SQFS_INVALID);
+    image_meta_put(img, inodes, buf, 56);
+    for (size_t i = 0; i < n->nblocks; i++) {
+      store_le32(buf, n->blocks[i]);
+      image_meta_put(img, inodes, buf, 4);
+    }
+    break;
+  case sqfs_symlink:
+    image_inode_header(buf, n, type);
+    store_le32(buf + 16, n->nlink);
+    store_le32(buf + 20, (uint32_t)strlen(n->target));
+    image_meta_put(img, inodes, buf, 24);
+    image_meta_put(img, inodes, (const unsigned char *)n->target,
+                   strlen(n->target));
+    break;
+  case sqfs_blkdev:
+  case sqfs_chrdev:
+    image_inode_header(buf, n, type);
+    store_le32(buf + 16, n->nlink);
+    store_le32(buf + 20, n->rdev);
+    image_meta_put(img, inodes, buf, 24);
+    break;
+  default:
+    image_inode_header(buf, n, type);
+    store_le32(buf + 16, n->nlink);
+    image_meta_put(img, inodes, buf, 20);
+    break;
+  }
+}
+
+/*
+ * Children are written before their directory: its listing needs their
+ * inode references, and its own inode needs the listing's position.
+ */
+static void image_write_dir(struct squashfs_image *img, struct image_node *dir,
+                            struct image_meta *inodes,
+                            struct image_meta *dirs, uint32_t parent_ino) {
+  unsigned char buf[40];
+  uint64_t listing;
+  uint32_t size = 0;
+  uint32_t subdirs = 0;
+
+  qsort(dir->children, dir->nchildren, sizeof(*dir->children),
+        compare_image_dirents);
+  for (size_t i = 0; i < dir->nchildren; i++) {
+    struct image_node *n = dir->children[i].node;
+    if ((n->mode & AE_IFMT) == AE_IFDIR) {
+      image_write_dir(img, n, inodes, dirs, dir->ino);
+      subdirs++;
+    } else if (!n->written) {
+      image_write_inode(img, inodes, n);
+    }
+  }
+
+  listing = image_meta_ref(dirs);
+  for (size_t i = 0; i < dir->nchildren;) {
+    const struct image_node *first = dir->children[i].node;
+    size_t count = 1;
+
+    /* A header covers entries whose inodes share one metadata block. */
+    while (i + count < dir->nchildren && count < SQFS_DIR_COUNT) {
+      const struct image_node *n = dir->children[i + count].node;
+      int64_t delta = (int64_t)n->ino - (int64_t)first->ino;
+      if (n->ref >> 16 != first->ref >> 16 || delta < -32768 ||
+          delta > 32767) {
+        break;
+      }
+      count++;
+    }
+    store_le32(buf, (uint32_t)(count - 1));
+    store_le32(buf + 4, (uint32_t)(first->ref >> 16));
+    store_le32(buf + 8, first->ino);
+    image_meta_put(img, dirs, buf, 12);
+    size += 12;
+    for (size_t j = i; j < i + count; j++) {
+      const struct image_node *n = dir->children[j].node;
+      size_t name_len = strlen(dir->children[j].name);
+      store_le16(buf, (uint16_t)(n->ref & 0xffff));
+      store_le16(buf + 2, (uint16_t)(int16_t)((int64_t)n->ino - first->ino));
+      store_le16(buf + 4, image_basic_type(n));
+      store_le16(buf + 6, (uint16_t)(name_len - 1));
+      image_meta_put(img, dirs, buf, 8);
+      image_meta_put(img, dirs, (const unsigned char *)dir->children[j].name,
+                     name_len);
+      size += 8 + (uint32_t)name_len;
+    }
+    i += count;
+  }
+
+  dir->ref = image_meta_ref(inodes);
+  dir->written = 1;
+  image_inode_header(buf, dir, sqfs_ldir);
+  store_le32(buf + 16, 2 + subdirs);
+  store_le32(buf + 20, size + 3);
+  store_le32(buf + 24, (uint32_t)(listing >> 16));
+  store_le32(buf + 28, parent_ino);
+  store_le16(buf + 32, 0);
+  store_le16(buf + 34, (uint16_t)(listing & 0xffff));
+  store_le32(buf + 36, SQFS_INVALID);
+  image_meta_put(img, inodes, buf, 40);
+}
+
+/* Write the tables and superblock, and free img. */
+static void image_close(struct squashfs_image *img) {
+  struct image_meta inodes = {0};
+  struct image_meta dirs = {0};
+  struct image_meta ids = {0};
+  unsigned char sb[SQFS_SUPERBLOCK];
+  unsigned char buf[8];
+  uint32_t next = 1;
+  uint64_t inode_table, dir_table, id_block, id_table, end;
+
+  if (img->nslots > 0) {
+    image_flush(img);
+  }
+  image_number(img, img->root, &next);
+  image_write_dir(img, img->root, &inodes, &dirs, next);
+  if (inodes.fill > 0) {
+    image_meta_flush(img, &inodes);
+  }
+  if (dirs.fill > 0) {
+    image_meta_flush(img, &dirs);
+  }
+  for (size_t i = 0; i < img->nids; i++) {
+    store_le32(buf, img->ids[i]);
+    image_meta_put(img, &ids, buf, 4);
+  }
+  if (ids.fill > 0) {
+    image_meta_flush(img, &ids);
+  }
+
+  inode_table = img->pos;
+  dir_table = inode_table + inodes.len;
+  id_block = dir_table + dirs.len;
+  id_table = id_block + ids.len;
+  if (write_full_at(img->fd, inodes.data, inodes.len,
+                    (la_int64_t)inode_table) != 0 ||
+      write_full_at(img->fd, dirs.data, dirs.len, (la_int64_t)dir_table) !=
+          0 ||
+      write_full_at(img->fd, ids.data, ids.len, (la_int64_t)id_block) != 0) {
+    fail_errno(img->path);
+  }
+  /* One index entry per metadata block of 2048 ids. */
+  end = id_table;
+  for (uint64_t off = 0; off < ids.len;) {
+    size_t hdr = (size_t)(ids.data[off] | ids.data[off + 1] << 8);
+    size_t clen = hdr & SQFS_META_RAW ? hdr & ~SQFS_META_RAW : hdr;
+    store_le64(buf, id_block + off);
+    if (write_full_at(img->fd, buf, 8, (la_int64_t)end) != 0) {
+      fail_errno(img->path);
+    }
+    end += 8;
+    off += 2 + clen;
+  }
+
+  memset(sb, 0, sizeof(sb));
+  store_le32(sb, SQFS_MAGIC);
+  store_le32(sb + 4, next - 1);
+  store_le32(sb + 8, img->mtime);
+  store_le32(sb + 12, SQFS_BLOCK_SIZE);
+  store_le32(sb + 16, 0);
+  store_le16(sb + 20, SQFS_ZSTD);
+  store_le16(sb + 22, SQFS_BLOCK_LOG);
+  store_le16(sb + 24, SQFS_NO_FRAGMENTS | SQFS_NO_XATTRS);
+  store_le16(sb + 26, (uint16_t)img->nids);
+  store_le16(sb + 28, 4);
+  store_le16(sb + 30, 0);
+  store_le64(sb + 32, img->root->ref);
+  store_le64(sb + 40, end);
+  store_le64(sb + 48, id_table);
+  store_le64(sb + 56, SQFS_INVALID_BLK);
+  store_le64(sb + 64, inode_table);
+  store_le64(sb + 72, dir_table);
+  store_le64(sb + 80, id_block);
+  store_le64(sb + 88, SQFS_INVALID_BLK);
+  if (write_full_at(img->fd, sb, sizeof(sb), 0) != 0) {
+    fail_errno(img->path);
+  }
+  /* Loop devices want whole 4 KiB sectors. */
+  if (ftruncate(img->fd, (off_t)((end + 4095) & ~UINT64_C(4095))) != 0 ||
+      close(img->fd) != 0) {
+    fail_errno(img->path);
+  }
+
+  for (size_t i = 0; i < img->nnodes; i++) {
+    struct image_node *n = img->nodes[i];
+    for (size_t j = 0; j < n->nchildren; j++) {
+      free(n->children[j].name);
+    }
+    free(n->children);
+    free(n->blocks);
+    free(n->target);
+    free(n);
+  }
+  for (size_t i = 0; i < SQFS_BATCH; i++) {
+    free(img->slots[i].in);
+    free(img->slots[i].out);
+    ZSTD_freeCCtx(img->slots[i].cctx);
+  }
+  ZSTD_freeCCtx(img->meta_cctx);
+  string_map_free(&img->paths, NULL);
+  free(inodes.data);
+  free(dirs.data);
+  free(ids.data);
+  free(img->nodes);
+  free(img->ids);
+  free(img);
+}
+#endif
+
+#if !defined(_WIN32)
+/*
+ * --output-format cas: every distinct file body is stored once under the
+ * --store directory as STORE/ab/<sha256>-<mode>, and DIR receives a
+ * manifest of the tree, sorted by path. The mode is part of the blob name
+ * because every hardlink to a blob shares it. --materialize builds a tree
+ * from a manifest with hardlinks into the store, so a view costs only
+ * metadata. Blobs are stored without write permission, since editing a
+ * materialized file would change every view sharing it.
+ */
+#define CAS_MANIFEST_HEADER "# pkgutil manifest 1"
+
+struct cas_record {
+  char type; /* 'f', 'd' or 'l' */
+  unsigned int mode;
+  la_int64_t size;
+  char digest[65];
+  char *target;
+  struct cas_record *link; /* a hardlink shares its target's body */
+};
+
+struct cas_output {
+  const char *store;
+  const char *manifest;
+  struct string_map paths;
+  /* Paths currently recorded as symlinks. */
+  struct string_map links;
+  struct cas_record **records;
+  size_t nrecords;
+  size_t records_cap;
+};
+
+static struct cas_output *cas_open(const char *store, const char *manifest) {
+  struct cas_output *cas = calloc(1, sizeof(*cas));
+
+  if (cas == NULL) {
+    fail_errno("calloc");
+  }
+  if (mkdir(store, 0755) != 0 && errno != EEXIST) {
+    fail_errno(store);
+  }
+  cas->store = store;
+  cas->manifest = manifest;
+  return (cas);
+}
+
+static struct cas_record *cas_new_record(struct cas_output *cas, char type,
+                                         unsigned int mode) {
+  struct cas_record *r = calloc(1, sizeof(*r));
+
+  if (r == NULL) {
+    fail_errno("calloc");
+  }
+  if (cas->nrecords == cas->records_cap) {
+    cas->records_cap = cas->records_cap == 0 ? 256 : cas->records_cap * 2;
+    cas->records =
+        realloc(cas->records, cas->records_cap * sizeof(*cas->records));
+    if (cas->records == NULL) {
+      fail_errno("realloc");
+    }
+  }
+  cas->records[cas->nrecords++] = r;
+  r->type = type;
+  r->mode = mode & 07777;
+  return (r);
+}
+
+static char *cas_blob_path(const char *store, const char *digest,
+                           unsigned int mode) {
+  size_t len = strlen(store) + 64 + 16;
+  char *path = malloc(len);
+
+  if (path == NULL) {
+    fail_errno("malloc");
+  }
+  snprintf(path, len, "%s/%.2s/%s-%o", store, digest, digest, mode);
+  return (path);
+}
+
+/*
+ * The first ancestor of path that links records as a symlink, or NULL.
+ * Nothing may be created through a symlink of the same tree, which could
+ * point anywhere.
+ */
+static char *symlink_ancestor(const struct string_map *links,
+                              const char *path) {
+  char *dir = strdup(path);
+  char *slash;
+
+  if (dir == NULL) {
+    fail_errno("strdup");
+  }
+  while ((slash = strrchr(dir, '/')) != NULL) {
+    *slash = '\0';
+    if (string_map_get(links, dir) != NULL) {
+      return (dir);
+    }
+  }
+  free(dir);
+  return (NULL);
+}
+
+struct cas_body {
+  const char *store;
+  struct sha256_ctx ctx;
+  unsigned char *mem;
+  size_t mem_len;
+  char *tmp;
+  int fd;
+  la_int64_t size;
+};
+
+static void cas_body_spill(struct cas_body *b) {
+  size_t len = strlen(b->store) + sizeof("/.tmp-XXXXXX");
+
+  b->tmp = malloc(len);
+  if (b->tmp == NULL) {
+    fail_errno("malloc");
+  }
+  snprintf(b->tmp, len, "%s/.tmp-XXXXXX", b->store);
+  b->fd = mkstemp(b->tmp);
+  if (b->fd < 0 || write_full_at(b->fd, b->mem, b->mem_len, 0) != 0) {
+    fail_errno(b->tmp);
+  }
+}
+
+/* Small bodies stay in memory; larger ones spill to a temp file. */
+static void cas_body_append(struct cas_body *b, const void *p, size_t len) {
+  sha256_update(&b->ctx, p, len);
+  if (b->fd < 0 && b->mem_len + len > DEDUP_BUFFER_MAX) {
+    cas_body_spill(b);
+  }
+  if (b->fd >= 0) {
+    if (write_full_at(b->fd, p, len, b->size) != 0) {
+      fail_errno(b->tmp);
+    }
+  } else {
+    if (b->mem == NULL) {
+      b->mem = malloc(DEDUP_BUFFER_MAX);
+      if (b->mem == NULL) {
+        fail_errno("malloc");
+      }
+    }
+    memcpy(b->mem + b->mem_len, p, len);
+    b->mem_len += len;
+  }
+  b->size += (la_int64_t)len;
+}
+
+/* Hash the entry's data into r and add the blob unless the store has it. */
+static int cas_store_data(struct cas_output *cas, struct archive *a,
+                          struct cas_record *r) {
+  static const unsigned char zeros[SPARSE_BLOCK];
+  struct cas_body b = {.store = cas->store, .fd = -1};
+  const void *buf;
+  size_t len;
+  la_int64_t off;
+  int ret;
+
+  sha256_init(&b.ctx);
+  while ((ret = archive_read_data_block(a, &buf, &len, &off)) == ARCHIVE_OK) {
+    while (b.size < off) {
+      la_int64_t gap = off - b.size;
+      cas_body_append(&b, zeros, gap > SPARSE_BLOCK ? SPARSE_BLOCK
+                                                    : (size_t)gap);
+    }
+    cas_body_append(&b, buf, len);
+  }
+  if (ret == ARCHIVE_EOF) {
+    ret = ARCHIVE_OK;
+    sha256_hex(&b.ctx, r->digest);
+    r->size = b.size;
+
+    char *blob = cas_blob_path(cas->store, r->digest, r->mode);
+    if (access(blob, F_OK) != 0) {
+      char *dir = strdup(blob);
+      if (dir == NULL) {
+        fail_errno("strdup");
+      }
+      *strrchr(dir, '/') = '\0';
+      if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        fail_errno(dir);
+      }
+      free(dir);
+      if (b.fd < 0) {
+        cas_body_spill(&b);
+      }
+      /* rename() keeps concurrent runs from seeing a partial blob. */
+      if (fchmod(b.fd, r->mode & ~0222u) != 0 || close(b.fd) != 0 ||
+          rename(b.tmp, blob) != 0) {
+        fail_errno(blob);
+      }
+      b.fd = -1;
+    }
+    free(blob);
+  }
+  if (b.fd >= 0) {
+    close(b.fd);
+    unlink(b.tmp);
+  }
+  free(b.tmp);
+  free(b.mem);
+  return (ret);
+}
+
+static int cas_entry(struct archive *a, struct archive_entry *e,
+                     const char *outdir, struct cas_output *cas) {
+  const char *hardlink = archive_entry_hardlink(e);
+  unsigned int mode = (unsigned int)archive_entry_mode(e);
+  char *path = output_path(outdir, archive_entry_pathname(e));
+  struct cas_record *r;
+  int ret = ARCHIVE_OK;
+
+  if (path[0] == '\0') {
+    free(path);
+    return (archive_read_data_skip(a));
+  }
+  /*
+   * What the disk writer's SECURE_SYMLINKS check would refuse: a path
+   * below a symlink, or turning a directory, which earlier entries may
+   * have filled, into something else.
+   */
+  char *via = symlink_ancestor(&cas->links, path);
+  if (via != NULL) {
+    archive_set_error(a, EINVAL, "Cannot extract through symlink %s", via);
+    free(via);
+    free(path);
+    return (ARCHIVE_FAILED);
+  }
+  r = string_map_get(&cas->paths, path);
+  if (r != NULL && r->type == 'd' && archive_entry_filetype(e) != AE_IFDIR) {
+    archive_set_error(a, EINVAL, "Cannot replace directory %s", path);
+    free(path);
+    return (ARCHIVE_FAILED);
+  }
+  if (hardlink != NULL) {
+    char *target_path = join_prefix_path(outdir, hardlink);
+    struct cas_record *t = string_map_get(&cas->paths, target_path);
+    free(target_path);
+    if (t == NULL || t->type != 'f') {
+      fprintf(stderr, "%s: hardlink target %s not in manifest\n", path,
+              hardlink);
+      exit(1);
+    }
+    while (t->link != NULL) {
+      t = t->link;
+    }
+    /* cpio stores the data of a linked file with its last name. */
+    if (t->size == 0 && archive_entry_size_is_set(e) &&
+        archive_entry_size(e) > 0) {
+      ret = cas_store_data(cas, a, t);
+    }
+    r = cas_new_record(cas, 'f', t->mode);
+    r->link = t;
+  } else {
+    switch (archive_entry_filetype(e)) {
+    case AE_IFREG:
+      r = cas_new_record(cas, 'f', mode);
+      ret = cas_store_data(cas, a, r);
+      break;
+    case AE_IFDIR:
+      r = cas_new_record(cas, 'd', mode);
+      break;
+    case AE_IFLNK:
+      r = cas_new_record(cas, 'l', mode);
+      r->target = strdup(archive_entry_symlink(e) != NULL
+                             ? archive_entry_symlink(e)
+                             : "");
+      if (r->target == NULL) {
+        fail_errno("strdup");
+      }
+      break;
+    default:
+      /* Devices and fifos have no body to share. */
+      free(path);
+      return (archive_read_data_skip(a));
+    }
+  }
+  string_map_put(&cas->paths, path, r);
+  if (r->type == 'l' || string_map_get(&cas->links, path) != NULL) {
+    string_map_put(&cas->links, path, r->type == 'l' ? r : NULL);
+  }
+  free(path);
+  return (ret);
+}
+
+static void cas_put_escaped(FILE *out, const char *s) {
+  for (; *s != '\0'; s++) {
+    switch (*s) {
+    case '\\':
+      fputs("\\\\", out);
+      break;
+    case '\t':
+      fputs("\\t", out);
+      break;
+    case '\n':
+      fputs("\\n", out);
+      break;
+    default:
+      fputc(*s, out);
+    }
+  }
+}
+
+static void cas_unescape(char *s) {
+  char *w = s;
+
+  for (; *s != '\0'; s++) {
+    if (*s == '\\' && s[1] != '\0') {
+      s++;
+      *w++ = *s == 't' ? '\t' : *s == 'n' ? '\n' : *s;
+    } else {
+      *w++ = *s;
+    }
+  }
+  *w = '\0';
+}
+
+static int compare_map_keys(const void *a, const void *b) {
+  return (strcmp((*(const struct string_map_slot *const *)a)->key,
+                 (*(const struct string_map_slot *const *)b)->key));
+}
+
+/* Write the manifest, sorted by path, and free cas. */
+static void cas_close(struct cas_output *cas) {
+  struct string_map_slot **slots = malloc((cas->paths.len + 1) *
+                                          sizeof(*slots));
+  FILE *out = strcmp(cas->manifest, "-") == 0 ? stdout
+                                               : fopen(cas->manifest, "w");
+  size_t n = 0;
+
+  if (slots == NULL) {
+    fail_errno("malloc");
+  }
+  if (out == NULL) {
+    fail_errno(cas->manifest);
+  }
+  for (size_t i = 0; i < cas->paths.cap; i++) {
+    if (cas->paths.slots[i].key != NULL) {
+      slots[n++] = &cas->paths.slots[i];
+    }
+  }
+  qsort(slots, n, sizeof(*slots), compare_map_keys);
+
+  fprintf(out, "%s\n", CAS_MANIFEST_HEADER);
+  for (size_t i = 0; i < n; i++) {
+    const struct cas_record *r = slots[i]->value;
+    while (r->link != NULL) {
+      r = r->link;
+    }
+    if (r->type == 'f') {
+      fprintf(out, "f\t%o\t%" PRId64 "\t%s\t", r->mode, (int64_t)r->size,
+              r->digest);
+    } else {
+      fprintf(out, "%c\t%o\t-\t-\t", r->type, r->mode);
+    }
+    cas_put_escaped(out, slots[i]->key);
+    if (r->type == 'l') {
+      fputc('\t', out);
+      cas_put_escaped(out, r->target);
+    }
+    fputc('\n', out);
+  }
+  if (fflush(out) != 0 || ferror(out) ||
+      (out != stdout && fclose(out) != 0)) {
+    fail_errno(cas->manifest);
+  }
+
+  free(slots);
+  for (size_t i = 0; i < cas->nrecords; i++) {
+    free(cas->records[i]->target);
+    free(cas->records[i]);
+  }
+  free(cas->records);
+  string_map_free(&cas->paths, NULL);
+  string_map_free(&cas->links, NULL);
+  free(cas);
+}
+
+/*
+ * --hash-manifest: one "<hex>  <path>" line per regular file, sorted by
+ * path, in the format sha256sum -c reads from inside the output directory.
+ */
+static void hash_manifest_write(FILE *out, const char *name,
+                                struct string_map *hashes) {
+  struct string_map_slot **slots = malloc((hashes->len + 1) *
+                                          sizeof(*slots));
+  size_t n = 0;
+
+  if (slots == NULL) {
+    fail_errno("malloc");
+  }
+  for (size_t i = 0; i < hashes->cap; i++) {
+    if (hashes->slots[i].key != NULL) {
+      slots[n++] = &hashes->slots[i];
+    }
+  }
+  qsort(slots, n, sizeof(*slots), compare_map_keys);
+
+  for (size_t i = 0; i < n; i++) {
+    const char *path = slots[i]->key;
+    if (strpbrk(path, "\\\n") == NULL) {
+      fprintf(out, "%s  %s\n", (const char *)slots[i]->value, path);
+      continue;
+    }
+    /* Same escaping as sha256sum: a leading backslash flags the line. */
+    fprintf(out, "\\%s  ", (const char *)slots[i]->value);
+    for (; *path != '\0'; path++) {
+      if (*path == '\\') {
+        fputs("\\\\", out);
+      } else if (*path == '\n') {
+        fputs("\\n", out);
+      } else {
+        fputc(*path, out);
+      }
+    }
+    fputc('\n', out);
+  }
+  if (fflush(out) != 0 || ferror(out) ||
+      (out != stdout && fclose(out) != 0)) {
+    fail_errno(name);
+  }
+  free(slots);
+}
+
+/* Create the missing parents of path. */
+static void materialize_parents(const char *path) {
+  char *dir = strdup(path);
+  char *slash;
+
+  if (dir == NULL) {
+    fail_errno("strdup");
+  }
+  slash = strrchr(dir, '/');
+  if (slash != NULL) {
+    *slash = '\0';
+    mkdirs_for_path(dir);
+  }
+  free(dir);
+}
+
+/*
+ * --materialize MANIFEST DIR: directories are created, files hardlinked
+ * from the store (copied when the store is on another filesystem or a
+ * blob is out of links) and symlinks recreated. Directory modes are
+ * applied last so read-only directories can still be filled.
+ */
+static int materialize(const char *manifest, const char *store,
+                       const char *outdir, int force) {
+  FILE *in = strcmp(manifest, "-") == 0 ? stdin : fopen(manifest, "r");
+  struct pattern_list dirs = {0};
+  struct string_map links = {0};
+  unsigned int *dir_modes = NULL;
+  char *line = NULL;
+  size_t cap = 0;
+  ssize_t len;
+
+  if (in == NULL) {
+    fail_errno(manifest);
+  }
+  ensure_outdir(outdir, force);
+  while ((len = getline(&line, &cap, in)) >= 0) {
+    char *field[6];
+    size_t nfields = 0;
+    char *p = line;
+
+    if (len > 0 && line[len - 1] == '\n') {
+      line[--len] = '\0';
+    }
+    if (line[0] == '\0' || line[0] == '#') {
+      continue;
+    }
+    while (nfields < 6) {
+      field[nfields++] = p;
+      p = strchr(p, '\t');
+      if (p == NULL) {
+        break;
+      }
+      *p++ = '\0';
+    }
+    if (nfields < 5 || strlen(field[0]) != 1 ||
+        (field[0][0] == 'l') != (nfields == 6)) {
+      fprintf(stderr, "%s: malformed manifest line\n", manifest);
+      return (1);
+    }
+    unsigned int mode = (unsigned int)strtoul(field[1], NULL, 8) & 07777;
+    cas_unescape(field[4]);
+    char *rel = normalize_rel_path(field[4]);
+    char *path = join_prefix_path(outdir, rel);
+    free(rel);
+    char *via = symlink_ancestor(&links, path);
+    if (via != NULL) {
+      fprintf(stderr, "%s: %s is below the symlink %s\n", manifest, path,
+              via);
+      return (1);
+    }
+
+    switch (field[0][0]) {
+    case 'd': {
+      int r = mkdir(path, 0755);
+      if (r != 0 && errno == ENOENT) {
+        materialize_parents(path);
+        r = mkdir(path, 0755);
+      }
+      if (r != 0 && errno != EEXIST) {
+        fail_errno(path);
+      }
+      pattern_list_add(&dirs, path);
+      dir_modes = realloc(dir_modes, dirs.len * sizeof(*dir_modes));
+      if (dir_modes == NULL) {
+        fail_errno("realloc");
+      }
+      dir_modes[dirs.len - 1] = mode;
+      break;
+    }
+    case 'f': {
+      if (strlen(field[3]) != 64 || strspn(field[3], "0123456789abcdef") != 64) {
+        fprintf(stderr, "%s: malformed digest for %s\n", manifest, field[4]);
+        return (1);
+      }
+      char *blob = cas_blob_path(store, field[3], mode);
+      int r = link(blob, path);
+      if (r != 0 && errno == ENOENT) {
+        if (access(blob, F_OK) != 0) {
+          fail_errno(blob);
+        }
+        materialize_parents(path);
+        r = link(blob, path);
+      }
+      if (r != 0 && errno == EEXIST && force && unlink(path) == 0) {
+        r = link(blob, path);
+      }
+      if (r != 0 && (errno == EXDEV || errno == EMLINK)) {
+        /* A private copy may keep the write bits the blob lacks. */
+        struct stat st;
+        if ((r = stat(blob, &st)) == 0) {
+          st.st_mode = (st.st_mode & ~(mode_t)07777) | mode;
+          r = copy_file_contents(blob, path, &st);
+        }
+      }
+      if (r != 0) {
+        fail_errno(path);
+      }
+      free(blob);
+      break;
+    }
+    case 'l': {
+      cas_unescape(field[5]);
+      int r = symlink(field[5], path);
+      if (r != 0 && errno == ENOENT) {
+        materialize_parents(path);
+        r = symlink(field[5], path);
+      }
+      if (r != 0 && errno == EEXIST && force && unlink(path) == 0) {
+        r = symlink(field[5], path);
+      }
+      if (r != 0) {
+        fail_errno(path);
+      }
+      string_map_put(&links, path, &links);
+      break;
+    }
+    default:
+      fprintf(stderr, "%s: unknown manifest entry type %s\n", manifest,
+              field[0]);
+      return (1);
+    }
+    free(path);
+  }
+  if (ferror(in)) {
+    fail_errno(manifest);
+  }
+  if (in != stdin) {
+    fclose(in);
+  }
+  for (size_t i = dirs.len; i > 0; i--) {
+    if (chmod(dirs.items[i - 1], dir_modes[i - 1]) != 0) {
+      fail_errno(dirs.items[i - 1]);
+    }
+  }
+  pattern_list_free(&dirs);
+  string_map_free(&links, NULL);
+  free(dir_modes);
+  free(line);
+  return (0);
+}
+
+/*
+ * A Bom is a "BOMStore": big-endian header, a table of blocks, and named
+ * variables pointing into it. "Paths" is a B+ tree whose leaves pair a
+ * BOMPathInfo1 (id, info block) with a BOMFile (parent id, name); the
+ * info block carries type, mode, size, cksum and a symlink's target.
+ */
+enum {
+  bom_file = 1,
+  bom_dir = 2,
+  bom_symlink = 3,
+  bom_device = 4,
+};
+
+/* One Paths record; path is relative to the Payload root, "." for it. */
+struct bom_entry {
+  char *path;
+  int type;
+  unsigned int mode;
+  time_t mtime;
+  uint32_t size;
+  uint32_t cksum;
+  char *link;
+};
+
+struct bom_entries {
+  struct bom_entry *items;
+  size_t len;
+  size_t cap;
+};
+
+struct bom_sum {
+  uint32_t cksum;
+  la_int64_t size;
+};
+
+struct bom_node {
+  uint32_t parent;
+  const char *name;
+  const unsigned char *info;
+  size_t info_len;
+};
+
+static uint16_t load_be16(const unsigned char *p) {
+  return ((uint16_t)(p[0] << 8 | p[1]));
+}
+
+/* Block index to its bytes, or NULL when it is out of range. */
+static const unsigned char *bom_block(const unsigned char *buf, size_t len,
+                                      uint32_t index, size_t *block_len) {
+  uint32_t table = load_be32(buf + 16);
+  uint32_t count;
+  uint32_t addr;
+  uint32_t size;
+
+  if (index == 0 || table > len || len - table < 4) {
+    return (NULL);
+  }
+  count = load_be32(buf + table);
+  if (index >= count || (len - table - 4) / 8 <= index) {
+    return (NULL);
+  }
+  addr = load_be32(buf + table + 4 + 8 * (size_t)index);
+  size = load_be32(buf + table + 8 + 8 * (size_t)index);
+  if (addr > len || size > len - addr) {
+    return (NULL);
+  }
+  *block_len = size;
+  return (buf + addr);
+}
+
+static uint32_t bom_var(const unsigned char *buf, size_t len,
+                        const char *name) {
+  uint32_t vars = load_be32(buf + 24);
+  size_t name_len = strlen(name);
+  size_t off;
+  uint32_t count;
+
+  if (vars > len || len - vars < 4) {
+    return (0);
+  }
+  count = load_be32(buf + vars);
+  off = (size_t)vars + 4;
+  for (uint32_t i = 0; i < count && len - off >= 5; i++) {
+    uint32_t index = load_be32(buf + off);
+    size_t n = buf[off + 4];
+    if (len - off - 5 < n) {
+      break;
+    }
+    if (n == name_len && memcmp(buf + off + 5, name, n) == 0) {
+      return (index);
+    }
+    off += 5 + n;
+  }
+  return (0);
+}
+
+static char *bom_node_path(struct bom_node *nodes, size_t n, uint32_t id,
+                           int depth) {
+  char *parent;
+  char *path;
+
+  if (id == 0 || id > n || nodes[id - 1].name == NULL || depth > 4096) {
+    return (NULL);
+  }
+  if (nodes[id - 1].parent == 0) {
+    path = strdup(nodes[id - 1].name);
+    if (path == NULL) {
+      fail_errno("strdup");
+    }
+    return (path);
+  }
+  parent = bom_node_path(nodes, n, nodes[id - 1].parent, depth + 1);
+  if (parent == NULL) {
+    return (NULL);
+  }
+  path = join_prefix_path(parent, nodes[id - 1].name);
+  free(parent);
+  return (path);
+}
+
+static void bom_entries_free(struct bom_entries *list) {
+  for (size_t i = 0; i < list->len; i++) {
+    free(list->items[i].path);
+    free(list->items[i].link);
+  }
+  free(list->items);
+  list->items = NULL;
+  list->len = 0;
+  list->cap = 0;
+}
+
+/* Append the Paths records of the Bom in buf; -1 if it cannot be walked. */
+static int bom_parse(const unsigned char *buf, size_t len,
+                     struct bom_entries *out) {
+  const unsigned char *tree;
+  const unsigned char *node;
+  struct bom_node *nodes = NULL;
+  size_t nnodes = 0;
+  size_t blen;
+  uint32_t index;
+  uint32_t guard;
+
+  if (len < 32 || memcmp(buf, "BOMStore", 8) != 0 ||
+      (tree = bom_block(buf, len, bom_var(buf, len, "Paths"), &blen)) ==
+          NULL ||
+      blen < 12 || memcmp(tree, "tree", 4) != 0) {
+    return (-1);
+  }
+  /* Down the first children to the leftmost leaf, then along the leaves. */
+  index = load_be32(tree + 8);
+  guard = load_be32(buf + 12);
+  for (;;) {
+    node = bom_block(buf, len, index, &blen);
+    if (node == NULL || blen < 12 || guard-- == 0) {
+      free(nodes);
+      return (-1);
+    }
+    if (load_be16(node) != 0) {
+      break;
+    }
+    if (load_be16(node + 2) == 0 || blen < 20) {
+      free(nodes);
+      return (-1);
+    }
+    index = load_be32(node + 12);
+  }
+  while (node != NULL) {
+    uint16_t count = load_be16(node + 2);
+    if (blen < 12 + 8 * (size_t)count) {
+      free(nodes);
+      return (-1);
+    }
+    for (uint16_t i = 0; i < count; i++) {
+      size_t ilen, flen, plen;
+      const unsigned char *info1 =
+          bom_block(buf, len, load_be32(node + 12 + 8 * i), &ilen);
+      const unsigned char *file =
+          bom_block(buf, len, load_be32(node + 16 + 8 * i), &flen);
+      const unsigned char *info2;
+      uint32_t id;
+
+      if (info1 == NULL || ilen < 8 || file == NULL || flen < 5 ||
+          memchr(file + 4, '\0', flen - 4) == NULL ||
+          (info2 = bom_block(buf, len, load_be32(info1 + 4), &plen)) ==
+              NULL) {
+        free(nodes);
+        return (-1);
+      }
+      id = load_be32(info1);
+      if (id == 0 || id > 0x1000000) {
+        free(nodes);
+        return (-1);
+      }
+      if (id > nnodes) {
+        size_t grown = nnodes * 2 > id ? nnodes * 2 : id;
+        nodes = realloc(nodes, grown * sizeof(*nodes));
+        if (nodes == NULL) {
+          fail_errno("realloc");
+        }
+        memset(nodes + nnodes, 0, (grown - nnodes) * sizeof(*nodes));
+        nnodes = grown;
+      }
+      nodes[id - 1].parent = load_be32(file);
+      nodes[id - 1].name = (const char *)file + 4;
+      nodes[id - 1].info = info2;
+      nodes[id - 1].info_len = plen;
+    }
+    index = load_be32(node + 4);
+    node = index != 0 ? bom_block(buf, len, index, &blen) : NULL;
+    if ((index != 0 && (node == NULL || blen < 12)) || guard-- == 0) {
+      free(nodes);
+      return (-1);
+    }
+  }
+
+  for (size_t i = 0; i < nnodes; i++) {
+    const unsigned char *info = nodes[i].info;
+    struct bom_entry *be;
+    char *path;
+
+    /* type, 1, arch, mode, uid, gid, mtime, size, 1, cksum, link len, link */
+    if (info == NULL || nodes[i].info_len < 31) {
+      continue;
+    }
+    path = bom_node_path(nodes, nnodes, (uint32_t)i + 1, 0);
+    if (path == NULL) {
+      free(nodes);
+      return (-1);
+    }
+    if (out->len == out->cap) {
+      out->cap = out->cap == 0 ? 256 : out->cap * 2;
+      out->items = realloc(out->items, out->cap * sizeof(*out->items));
+      if (out->items == NULL) {
+        fail_errno("realloc");
+      }
+    }
+    be = &out->items[out->len++];
+    if (path[0] == '.' && path[1] == '/') {
+      memmove(path, path + 2, strlen(path + 2) + 1);
+    }
+    be->path = path;
+    be->type = info[0];
+    be->mode = load_be16(info + 4);
+    be->mtime = (time_t)load_be32(info + 14);
+    be->size = load_be32(info + 18);
+    be->cksum = load_be32(info + 23);
+    be->link = NULL;
+    if (be->type == bom_symlink) {
+      uint32_t n = load_be32(info + 27);
+      if (n > nodes[i].info_len - 31) {
+        free(nodes);
+        return (-1);
+      }
+      be->link = strndup((const char *)info + 31, n);
+      if (be->link == NULL) {
+        fail_errno("strndup");
+      }
+    }
+  }
+  free(nodes);
+  return (0);
+}
+
+/*
+ * Add the file records of the Bom in buf to bom->expected, keyed under the
+ * Payload next to it. Returns -1 if buf is not a Bom this can walk.
+ */
+static int bom_load(struct bom_verify *bom, const char *payload,
+                    const unsigned char *buf, size_t len) {
+  struct bom_entries list = {0};
+
+  if (bom_parse(buf, len, &list) != 0) {
+    bom_entries_free(&list);
+    return (-1);
+  }
+  for (size_t i = 0; i < list.len; i++) {
+    struct bom_sum *sum;
+    char *key;
+
+    if (list.items[i].type != bom_file) {
+      continue;
+    }
+    sum = malloc(sizeof(*sum));
+    if (sum == NULL) {
+      fail_errno("malloc");
+    }
+    sum->size = list.items[i].size;
+    sum->cksum = list.items[i].cksum;
+    key = join_prefix_path(payload, list.items[i].path);
+    free(string_map_get(&bom->expected, key));
+    string_map_put(&bom->expected, key, sum);
+    free(key);
+  }
+  bom_entries_free(&list);
+  return (0);
+}
+
+/* Path of the Payload a Bom member describes: its sibling. */
+static char *bom_payload_path(const char *bom_member) {
+  const char *slash = strrchr(bom_member, '/');
+  char *dir;
+  char *payload;
+
+  if (slash == NULL) {
+    payload = strdup("Payload");
+    if (payload == NULL) {
+      fail_errno("strdup");
+    }
+    return (payload);
+  }
+  dir = strndup(bom_member, (size_t)(slash - bom_member));
+  if (dir == NULL) {
+    fail_errno("strndup");
+  }
+  payload = join_prefix_path(dir, "Payload");
+  free(dir);
+  return (payload);
+}
+
+static void bom_load_member(struct bom_verify *bom, const char *member,
+                            const unsigned char *buf, size_t len) {
+  char *payload = bom_payload_path(member);
+
+  if (bom_load(bom, payload, buf, len) != 0) {
+    fprintf(stderr, "%s: not a readable Bom\n", member);
+    exit(1);
+  }
+  pattern_list_add(&bom->boms, payload);
+  free(payload);
+}
+
+/* All of an extracted file, for small members like the Bom. */
+static unsigned char *read_file_data(const char *path, size_t *lenp) {
+  struct stat st;
+  unsigned char *buf;
+  size_t got = 0;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    fail_errno(path);
+  }
+  buf = malloc(st.st_size > 0 ? (size_t)st.st_size : 1);
+  if (buf == NULL) {
+    fail_errno("malloc");
+  }
+  while (got < (size_t)st.st_size) {
+    ssize_t n = read(fd, buf + got, (size_t)st.st_size - got);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      fail_errno(path);
+    }
+    got += (size_t)n;
+  }
+  close(fd);
+  *lenp = got;
+  return (buf);
+}
+
+/* What main() does with a Bom before the Payload it describes arrives. */
+struct bom_plan {
+  struct archive *matching;
+  const struct string_map *only;
+  int strip;
+  int prune;
+  int precreate;
+  int skeleton;
+  struct pattern_list pruned;
+};
+
+static void bom_plan_member(struct bom_plan *plan, const char *member,
+                            const unsigned char *buf, size_t len);
+
+/* Hand a Bom member to --verify-bom, to the plan, or both. */
+static void bom_use(struct bom_verify *bom, struct bom_plan *plan,
+                    const char *member, const unsigned char *buf,
+                    size_t len) {
+  if (bom != NULL) {
+    bom_load_member(bom, member, buf, len);
+  }
+  if (plan != NULL) {
+    bom_plan_member(plan, member, buf, len);
+  }
+}
+
+/* The Bom member was extracted: read it back from path. */
+static void bom_load_file(struct bom_verify *bom, struct bom_plan *plan,
+                          const char *member, const char *path) {
+  size_t len;
+  unsigned char *buf = read_file_data(path, &len);
+
+  bom_use(bom, plan, member, buf, len);
+  free(buf);
+}
+
+/* All of the current entry's data, for small members like the Bom. */
+static unsigned char *read_member_data(struct archive *a, const char *member,
+                                       size_t *lenp) {
+  unsigned char *buf = NULL;
+  size_t len = 0;
+  size_t cap = 0;
+  la_ssize_t n;
+
+  do {
+    if (cap - len < BSIZE) {
+      cap = cap == 0 ? 64 * 1024 : cap * 2;
+      buf = realloc(buf, cap);
+      if (buf == NULL) {
+        fail_errno("realloc");
+      }
+    }
+    n = archive_read_data(a, buf + len, cap - len);
+    if (n < 0) {
+      fail_archive(a, member);
+    }
+    len += (size_t)n;
+  } while (n > 0);
+  *lenp = len;
+  return (buf);
+}
+
+/* The Bom member is not extracted: read its data from the xar instead. */
+static void bom_load_data(struct bom_verify *bom, struct bom_plan *plan,
+                          const char *member, struct archive *a) {
+  size_t len;
+  unsigned char *buf = read_member_data(a, member, &len);
+
+  bom_use(bom, plan, member, buf, len);
+  free(buf);
+}
+
+static void bom_record_sum(struct bom_verify *bom, const char *prefix,
+                           const char *rel, const struct bom_sum *sum) {
+  char *key = join_prefix_path(prefix, rel);
+  struct bom_sum *copy = string_map_get(&bom->actual, key);
+
+  if (copy == NULL) {
+    copy = malloc(sizeof(*copy));
+    if (copy == NULL) {
+      fail_errno("malloc");
+    }
+    string_map_put(&bom->actual, key, copy);
+  }
+  *copy = *sum;
+  free(key);
+}
+
+/*
+ * Record the cksum of a regular file just extracted from the Payload at
+ * prefix: from the write itself when extract_regular_file() streamed it,
+ * otherwise (hardlinks, empty files, files kept or shared by --incremental,
+ * --dedup or --link-dest) by reading the output back. cpio may carry the
+ * data of linked files with the last name only, so a hardlink also updates
+ * its target (link_rel, unstripped).
+ */
+static void bom_record_entry(struct bom_verify *bom, const char *prefix,
+                             const char *rel, const char *link_rel,
+                             struct archive_entry *e) {
+  struct bom_sum sum;
+
+  if (archive_entry_filetype(e) != AE_IFREG) {
+    return;
+  }
+  if (bom->written && archive_entry_hardlink(e) == NULL) {
+    sum.cksum = bom->cksum;
+    sum.size = archive_entry_size(e);
+  } else {
+    const char *path = archive_entry_pathname(e);
+    unsigned char *buf = malloc(INPUT_BLOCK);
+    struct content_hash hash;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (buf == NULL) {
+      fail_errno("malloc");
+    }
+    if (fd < 0) {
+      fail_errno(path);
+    }
+    content_hash_init(&hash, content_hash_cksum);
+    for (;;) {
+      ssize_t n = read(fd, buf, INPUT_BLOCK);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n < 0) {
+        fail_errno(path);
+      }
+      if (n == 0) {
+        break;
+      }
+      content_hash_update(&hash, buf, (size_t)n, hash.next);
+    }
+    close(fd);
+    free(buf);
+    sum.cksum = cksum_final(hash.cksum, hash.next);
+    sum.size = hash.next;
+  }
+  bom_record_sum(bom, prefix, rel, &sum);
+  if (archive_entry_hardlink(e) != NULL && link_rel != NULL) {
+    bom_record_sum(bom, prefix, link_rel, &sum);
+  }
+}
+
+static const char *bom_payload_of(const struct bom_verify *bom,
+                                  const char *key) {
+  for (size_t i = 0; i < bom->payloads.len; i++) {
+    size_t n = strlen(bom->payloads.items[i]);
+    if (strncmp(key, bom->payloads.items[i], n) == 0 && key[n] == '/') {
+      return (bom->payloads.items[i]);
+    }
+  }
+  return (NULL);
+}
+
+static int bom_has(const struct pattern_list *list, const char *s) {
+  for (size_t i = 0; i < list->len; i++) {
+    if (strcmp(list->items[i], s) == 0) {
+      return (1);
+    }
+  }
+  return (0);
+}
+
+struct precreate_job {
+  char **paths;
+  int *ok;
+  const struct string_map *index;
+};
+
+static void precreate_dir_cb(void *ctx, size_t i) {
+  const struct precreate_job *job = ctx;
+  const char *path = job->paths[i];
+  const char *slash = strrchr(path, '/');
+  struct stat st;
+
+  job->ok[i] = 0;
+  if (slash != NULL) {
+    char *parent = strndup(path, (size_t)(slash - path));
+    const int *parent_ok;
+
+    if (parent == NULL) {
+      fail_errno("strndup");
+    }
+    /* Never create through something that is not a real directory. */
+    parent_ok = string_map_get(job->index, parent);
+    free(parent);
+    if (parent_ok != NULL && !*parent_ok) {
+      return;
+    }
+  }
+  if (mkdir(path, 0755) == 0) {
+    job->ok[i] = 1;
+  } else if (errno != EEXIST) {
+    fail_errno(path);
+  } else if (lstat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+    job->ok[i] = 1;
+  }
+}
+
+static int path_depth(const char *path) {
+  int depth = 0;
+
+  for (; *path != '\0'; path++) {
+    depth += *path == '/';
+  }
+  return (depth);
+}
+
+static int compare_path_depths(const void *a, const void *b) {
+  const char *pa = *(char *const *)a;
+  const char *pb = *(char *const *)b;
+  int da = path_depth(pa);
+  int db = path_depth(pb);
+
+  if (da != db) {
+    return (da < db ? -1 : 1);
+  }
+  return (strcmp(pa, pb));
+}
+
+/*
+ * Create the directories in dirs (relative to the working directory). Each
+ * depth is spread over the worker threads once the one above it is done.
+ * Those left uncreated, with everything below them, are added to failed.
+ */
+static void precreate_dirs(const struct string_map *dirs,
+                           struct string_map *failed) {
+  char **paths = malloc((dirs->len + 1) * sizeof(*paths));
+  int *ok = calloc(dirs->len + 1, sizeof(*ok));
+  struct string_map index = {0};
+  size_t n = 0;
+
+  if (paths == NULL || ok == NULL) {
+    fail_errno("malloc");
+  }
+  for (size_t i = 0; i < dirs->cap; i++) {
+    if (dirs->slots[i].key != NULL) {
+      paths[n++] = dirs->slots[i].key;
+    }
+  }
+  qsort(paths, n, sizeof(*paths), compare_path_depths);
+  for (size_t i = 0; i < n; i++) {
+    string_map_put(&index, paths[i], &ok[i]);
+  }
+  for (size_t start = 0; start < n;) {
+    size_t end = start;
+    int depth = path_depth(paths[start]);
+    struct precreate_job job = {
+        .paths = paths + start, .ok = ok + start, .index = &index};
+
+    while (end < n && path_depth(paths[end]) == depth) {
+      end++;
+    }
+    parallel_for(end - start, precreate_dir_cb, &job);
+    start = end;
+  }
+  for (size_t i = 0; i < n && failed != NULL; i++) {
+    if (!ok[i]) {
+      string_map_put(failed, paths[i], failed);
+    }
+  }
+  string_map_free(&index, NULL);
+  free(ok);
+  free(paths);
+}
+
+/* Add the directory path and those above it to dirs. */
+static void precreate_add(struct string_map *dirs, const char *path) {
+  char *dup = strdup(path);
+  char *slash;
+
+  if (dup == NULL) {
+    fail_errno("strdup");
+  }
+  while (string_map_put(dirs, dup, dirs) &&
+         (slash = strrchr(dup, '/')) != NULL) {
+    *slash = '\0';
+  }
+  free(dup);
+}
+
+struct skeleton_item {
+  const struct bom_entry *be;
+  char *out;
+};
+
+struct skeleton_job {
+  struct skeleton_item *items;
+  const struct string_map *failed;
+};
+
+static void skeleton_times(const char *path, time_t mtime) {
+  struct timespec ts[2] = {
+      {.tv_sec = mtime, .tv_nsec = 0},
+      {.tv_sec = mtime, .tv_nsec = 0},
+  };
+
+  (void)utimensat(AT_FDCWD, path, ts, AT_SYMLINK_NOFOLLOW);
+}
+
+/* A file becomes a hole of its Bom size; a symlink gets its target. */
+static void skeleton_entry_cb(void *ctx, size_t i) {
+  const struct skeleton_job *job = ctx;
+  const struct bom_entry *be = job->items[i].be;
+  const char *out = job->items[i].out;
+  const char *slash = strrchr(out, '/');
+
+  if (slash != NULL) {
+    char *parent = strndup(out, (size_t)(slash - out));
+    int unsafe;
+
+    if (parent == NULL) {
+      fail_errno("strndup");
+    }
+    unsafe = string_map_get(job->failed, parent) != NULL;
+    free(parent);
+    if (unsafe) {
+      return;
+    }
+  }
+  if (be->type == bom_file) {
+    int fd = open(out, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC,
+                  0600);
+    if (fd < 0 || ftruncate(fd, (off_t)be->size) != 0 ||
+        fchmod(fd, be->mode & 07777) != 0) {
+      fail_errno(out);
+    }
+    close(fd);
+  } else {
+    if (unlink(out) != 0 && errno != ENOENT) {
+      fail_errno(out);
+    }
+    if (symlink(be->link, out) != 0) {
+      fail_errno(out);
+    }
+  }
+  skeleton_times(out, be->mtime);
+}
+
+static int compare_skeleton_dirs(const void *a, const void *b) {
+  const struct skeleton_item *ia = a;
+  const struct skeleton_item *ib = b;
+
+  /* Deepest first, so a read-only parent is set after its children. */
+  return (compare_path_depths(&ib->out, &ia->out));
+}
+
+/*
+ * Build the selected Bom entries in place of the Payload for --skeleton:
+ * directories first, then files and symlinks on the worker threads, then
+ * directory modes and times.
+ */
+static void skeleton_build(struct skeleton_item *items, size_t n,
+                           const struct string_map *dirs) {
+  struct string_map failed = {0};
+  struct skeleton_job job = {.failed = &failed};
+  size_t ndirs = 0;
+
+  precreate_dirs(dirs, &failed);
+  for (size_t i = 0; i < n; i++) {
+    if (items[i].be->type == bom_dir) {
+      struct skeleton_item tmp = items[ndirs];
+      items[ndirs++] = items[i];
+      items[i] = tmp;
+    }
+  }
+  job.items = items + ndirs;
+  parallel_for(n - ndirs, skeleton_entry_cb, &job);
+  qsort(items, ndirs, sizeof(*items), compare_skeleton_dirs);
+  for (size_t i = 0; i < ndirs; i++) {
+    if (string_map_get(&failed, items[i].out) == NULL) {
+      (void)chmod(items[i].out, items[i].be->mode & 07777);
+      skeleton_times(items[i].out, items[i].be->mtime);
+    }
+  }
+  string_map_free(&failed, NULL);
+}
+
+/*
+ * Apply a Bom member to the plan before its Payload arrives. With prune,
+ * the Payload is added to plan->pruned when none of its paths pass the
+ * filters, so main() can skip it without decoding. With precreate, the
+ * directories its selected paths land in are created up front. With
+ * skeleton, the selected paths are built from the Bom alone. An unreadable
+ * Bom is left to the extractor, or fails --skeleton.
+ */
+static void bom_plan_member(struct bom_plan *plan, const char *member,
+                            const unsigned char *buf, size_t len) {
+  struct bom_entries list = {0};
+  struct string_map dirs = {0};
+  struct skeleton_item *items = NULL;
+  size_t nitems = 0;
+  char *payload;
+  int any = 0;
+  int want_dirs = plan->precreate || plan->skeleton;
+
+  if (bom_parse(buf, len, &list) != 0) {
+    bom_entries_free(&list);
+    if (plan->skeleton) {
+      fprintf(stderr, "%s: not a readable Bom\n", member);
+      exit(1);
+    }
+    return;
+  }
+  payload = bom_payload_path(member);
+  if (plan->skeleton) {
+    items = malloc((list.len + 1) * sizeof(*items));
+    if (items == NULL) {
+      fail_errno("malloc");
+    }
+  }
+  for (size_t i = 0; i < list.len && (want_dirs || !any); i++) {
+    const struct bom_entry *be = &list.items[i];
+    char *logical = strcmp(be->path, ".") == 0
+                        ? strdup(payload)
+                        : join_prefix_path(payload, be->path);
+    char *out;
+    char *slash;
+
+    if (logical == NULL) {
+      fail_errno("strdup");
+    }
+    if (!should_extract_path(plan->matching, logical) ||
+        (plan->only != NULL && string_map_get(plan->only, logical) == NULL)) {
+      free(logical);
+      continue;
+    }
+    any = 1;
+    out = want_dirs ? strip_components_path(logical, plan->strip) : NULL;
+    /* Devices are left out of a skeleton. */
+    if (out != NULL && plan->skeleton &&
+        (be->type == bom_file || be->type == bom_dir ||
+         be->type == bom_symlink)) {
+      items[nitems].be = be;
+      items[nitems].out = strdup(out);
+      if (items[nitems++].out == NULL) {
+        fail_errno("strdup");
+      }
+    }
+    if (out != NULL && be->type != bom_dir) {
+      slash = strrchr(out, '/');
+      if (slash != NULL) {
+        *slash = '\0';
+      } else {
+        out[0] = '\0';
+      }
+    }
+    if (out != NULL && out[0] != '\0') {
+      precreate_add(&dirs, out);
+    }
+    free(out);
+    free(logical);
+  }
+  if (plan->prune && !any) {
+    pattern_list_add(&plan->pruned, payload);
+  }
+  if (plan->skeleton) {
+    skeleton_build(items, nitems, &dirs);
+    for (size_t i = 0; i < nitems; i++) {
+      free(items[i].out);
+    }
+    free(items);
+  } else if (dirs.len > 0) {
+    precreate_dirs(&dirs, NULL);
+  }
+  string_map_free(&dirs, NULL);
+  free(payload);
+  bom_entries_free(&list);
+}
+
+/*
+ * Compare every extracted Payload file with its Bom record, in path order.
+ * The Bom stores sizes in 32 bits, so only the low bits are compared.
+ * Returns the number of problems reported.
+ */
+static size_t bom_verify_report(struct bom_verify *bom) {
+  struct string_map_slot **slots =
+      malloc((bom->actual.len + 1) * sizeof(*slots));
+  size_t problems = 0;
+  size_t n = 0;
+
+  if (slots == NULL) {
+    fail_errno("malloc");
+  }
+  for (size_t i = 0; i < bom->payloads.len; i++) {
+    if (!bom_has(&bom->boms, bom->payloads.items[i])) {
+      fprintf(stderr, "%s: no Bom to verify against\n",
+              bom->payloads.items[i]);
+      problems++;
+    }
+  }
+  for (size_t i = 0; i < bom->actual.cap; i++) {
+    if (bom->actual.slots[i].key != NULL) {
+      slots[n++] = &bom->actual.slots[i];
+    }
+  }
+  qsort(slots, n, sizeof(*slots), compare_map_keys);
+
+  for (size_t i = 0; i < n; i++) {
+    const char *path = slots[i]->key;
+    const struct bom_sum *got = slots[i]->value;
+    const struct bom_sum *want = string_map_get(&bom->expected, path);
+    const char *payload = bom_payload_of(bom, path);
+
+    if (payload == NULL || !bom_has(&bom->boms, payload)) {
+      continue;
+    }
+    if (want == NULL) {
+      fprintf(stderr, "%s: not in Bom\n", path);
+      problems++;
+    } else if ((uint32_t)got->size != (uint32_t)want->size) {
+      fprintf(stderr, "%s: size %" PRId64 ", Bom says %" PRId64 "\n", path,
+              (int64_t)got->size, (int64_t)want->size);
+      problems++;
+    } else if (got->cksum != want->cksum) {
+      fprintf(stderr, "%s: cksum %" PRIu32 ", Bom says %" PRIu32 "\n", path,
+              got->cksum, want->cksum);
+      problems++;
+    }
+  }
+  free(slots);
+  return (problems);
+}
+
+static void bom_verify_free(struct bom_verify *bom) {
+  string_map_free(&bom->expected, free);
+  string_map_free(&bom->actual, free);
+  pattern_list_free(&bom->payloads);
+  pattern_list_free(&bom->boms);
+}
+
+/*
+ * --verify PKG DIR: check a tree written by --expand-full (with the same
+ * filters) against the Boms in PKG without decoding any Payload. Every
+ * selected Bom record is checked on the worker threads, files by size and
+ * cksum, then DIR is walked for paths no record or pkg member accounts for.
+ */
+enum verify_status {
+  verify_ok = 0,
+  verify_missing,
+  verify_modified,
+};
+
+struct verify_item {
+  /* Output path under DIR, and the pkg path --repair extracts again. */
+  char *path;
+  char *logical;
+  const struct bom_entry *bom;
+  enum verify_status status;
+};
+
+struct verify_job {
+  const char *outdir;
+  struct verify_item *items;
+};
+
+static enum verify_status verify_file(const char *path,
+                                      const struct bom_entry *be) {
+  unsigned char buf[64 * 1024];
+  uint32_t crc = 0;
+  la_int64_t size = 0;
+  struct stat st;
+  int fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+
+  if (fd < 0) {
+    return (errno == ENOENT ? verify_missing : verify_modified);
+  }
+  if (fstat(fd, &st) != 0) {
+    fail_errno(path);
+  }
+  if (!S_ISREG(st.st_mode) || (uint32_t)st.st_size != be->size) {
+    close(fd);
+    return (verify_modified);
+  }
+  for (;;) {
+    ssize_t n = read(fd, buf, sizeof(buf));
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      fail_errno(path);
+    }
+    if (n == 0) {
+      break;
+    }
+    crc = cksum_update(crc, buf, (size_t)n);
+    size += n;
+  }
+  close(fd);
+  return (cksum_final(crc, size) == be->cksum ? verify_ok : verify_modified);
+}
+
+static void verify_item_cb(void *ctx, size_t i) {
+  struct verify_job *job = ctx;
+  struct verify_item *item = &job->items[i];
+  const struct bom_entry *be = item->bom;
+  char *path = join_prefix_path(job->outdir, item->path);
+  struct stat st;
+
+  if (be->type == bom_file) {
+    item->status = verify_file(path, be);
+  } else if (lstat(path, &st) != 0) {
+    if (errno != ENOENT) {
+      fail_errno(path);
+    }
+    item->status = verify_missing;
+  } else if (be->type == bom_dir) {
+    item->status = S_ISDIR(st.st_mode) ? verify_ok : verify_modified;
+  } else if (be->type == bom_symlink) {
+    /* One spare byte tells a longer target from an exact match. */
+    size_t want = be->link != NULL ? strlen(be->link) : 0;
+    char *target = malloc(want + 1);
+    ssize_t n = -1;
+
+    if (target == NULL) {
+      fail_errno("malloc");
+    }
+    if (S_ISLNK(st.st_mode) && be->link != NULL) {
+      n = readlink(path, target, want + 1);
+    }
+    item->status = n == (ssize_t)want && memcmp(target, be->link, want) == 0
+                       ? verify_ok
+                       : verify_modified;
+    free(target);
+  }
+  free(path);
+}
+
+/* Mark path and the directories above it as accounted for. */
+static void verify_expect(struct string_map *expected, const char *path) {
+  char *dup = strdup(path);
+  char *slash;
+
+  if (dup == NULL) {
+    fail_errno("strdup");
+  }
+  while (string_map_put(expected, dup, expected) &&
+         (slash = strrchr(dup, '/')) != NULL) {
+    *slash = '\0';
+  }
+  free(dup);
+}
+
+/* Collect what is under dir (relative to outdir) but not expected. */
+static void verify_walk(const char *outdir, const char *dir,
+                        const struct string_map *expected,
+                        const struct pattern_list *opaque,
+                        struct pattern_list *extra) {
+  char *full = join_prefix_path(outdir, dir != NULL ? dir : ".");
+  struct dirent *de;
+  DIR *d = opendir(full);
+
+  if (d == NULL) {
+    if (errno != ENOENT && errno != ENOTDIR) {
+      fail_errno(full);
+    }
+    free(full);
+    return;
+  }
+  while ((de = readdir(d)) != NULL) {
+    struct stat st;
+    char *child;
+    char *child_full;
+
+    if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+      continue;
+    }
+    child = join_prefix_path(dir, de->d_name);
+    if (bom_has(opaque, child)) {
+      free(child);
+      continue;
+    }
+    if (string_map_get(expected, child) == NULL) {
+      pattern_list_add(extra, child);
+      free(child);
+      continue;
+    }
+    child_full = join_prefix_path(outdir, child);
+    if (lstat(child_full, &st) == 0 && S_ISDIR(st.st_mode)) {
+      verify_walk(outdir, child, expected, opaque, extra);
+    }
+    free(child_full);
+    free(child);
+  }
+  closedir(d);
+  free(full);
+}
+
+static int compare_verify_items(const void *a, const void *b) {
+  return (strcmp(((const struct verify_item *)a)->path,
+                 ((const struct verify_item *)b)->path));
+}
+
+/*
+ * Print missing, modified and extra paths under outdir and return how many
+ * there were. With repair non-NULL, the pkg paths of missing and modified
+ * records and of their Payloads are added to it.
+ */
+static size_t verify_tree(const char *pkg, const char *outdir,
+                          struct archive *matching,
+                          const struct pattern_list *includes, int strip,
+                          struct string_map *repair) {
+  struct archive *xar = archive_read_new();
+  struct archive_entry *e;
+  struct pattern_list payloads = {0};
+  struct pattern_list opaque = {0};
+  struct pattern_list extra = {0};
+  struct string_map expected = {0};
+  struct bom_entries *boms = NULL;
+  char **bom_payloads = NULL;
+  size_t nboms = 0;
+  struct verify_item *items = NULL;
+  size_t nitems = 0;
+  size_t cap = 0;
+  size_t problems = 0;
+  int r;
+
+  if (xar == NULL) {
+    fail_errno("archive_read_new");
+  }
+  if (archive_match_set_inclusion_recursion(matching, 1) != ARCHIVE_OK) {
+    fail_archive(matching, "archive_match_set_inclusion_recursion");
+  }
+  archive_read_support_filter_all(xar);
+  archive_read_support_format_xar(xar);
+  if (strcmp(pkg, "-") == 0) {
+    r = archive_read_open_fd(xar, 0, 10240);
+  } else {
+    r = archive_read_open_filename(xar, pkg, 10240);
+  }
+  if (r != ARCHIVE_OK) {
+    fail_archive(xar, "open xar");
+  }
+
+  /* Only the Boms are read; members are otherwise skipped unread. */
+  while ((r = archive_read_next_header(xar, &e)) == ARCHIVE_OK) {
+    char *rel = normalize_rel_path(archive_entry_pathname(e));
+    int selected = should_extract_path(matching, rel);
+    char *out = strip_components_path(rel, strip);
+
+    if (should_be_treated_as_nested_archive(rel)) {
+      if (!selected && has_include_descendant(includes, rel)) {
+        selected = 1;
+      }
+      if (selected && is_payload_member(rel)) {
+        pattern_list_add(&payloads, rel);
+      } else if (selected) {
+        /* Scripts and the like: contents unknown without decoding. */
+        pattern_list_add(&opaque, out != NULL ? out : ".");
+      }
+    } else if (selected && out != NULL) {
+      verify_expect(&expected, out);
+    }
+    if (member_is(rel, "Bom") &&
+        !should_be_treated_as_nested_archive(rel)) {
+      size_t len;
+      unsigned char *buf = read_member_data(xar, rel, &len);
+
+      boms = realloc(boms, (nboms + 1) * sizeof(*boms));
+      bom_payloads = realloc(bom_payloads, (nboms + 1) * sizeof(char *));
+      if (boms == NULL || bom_payloads == NULL) {
+        fail_errno("realloc");
+      }
+      memset(&boms[nboms], 0, sizeof(*boms));
+      if (bom_parse(buf, len, &boms[nboms]) != 0) {
+        fprintf(stderr, "%s: not a readable Bom\n", rel);
+        exit(1);
+      }
+      bom_payloads[nboms++] = bom_payload_path(rel);
+      free(buf);
+    }
+    free(out);
+    free(rel);
+  }
+  if (r != ARCHIVE_EOF) {
+    fail_archive(xar, "read xar header");
+  }
+  archive_read_free(xar);
+
+  for (size_t p = 0; p < payloads.len; p++) {
+    const struct bom_entries *list = NULL;
+    char *root = strip_components_path(payloads.items[p], strip);
+
+    for (size_t b = 0; b < nboms; b++) {
+      if (strcmp(bom_payloads[b], payloads.items[p]) == 0) {
+        list = &boms[b];
+      }
+    }
+    if (list == NULL) {
+      fprintf(stderr, "%s: no Bom to verify against\n", payloads.items[p]);
+      pattern_list_add(&opaque, root != NULL ? root : ".");
+      problems++;
+      free(root);
+      continue;
+    }
+    if (root != NULL) {
+      verify_expect(&expected, root);
+    }
+    free(root);
+    for (size_t i = 0; i < list->len; i++) {
+      const struct bom_entry *be = &list->items[i];
+      char *logical;
+      char *out;
+
+      if (strcmp(be->path, ".") == 0 || be->type == bom_device) {
+        continue;
+      }
+      logical = join_prefix_path(payloads.items[p], be->path);
+      out = should_extract_path(matching, logical)
+                ? strip_components_path(logical, strip)
+                : NULL;
+      if (out == NULL) {
+        free(logical);
+        continue;
+      }
+      if (nitems == cap) {
+        cap = cap == 0 ? 1024 : cap * 2;
+        items = realloc(items, cap * sizeof(*items));
+        if (items == NULL) {
+          fail_errno("realloc");
+        }
+      }
+      verify_expect(&expected, out);
+      items[nitems].path = out;
+      items[nitems].logical = logical;
+      items[nitems].bom = be;
+      items[nitems].status = verify_ok;
+      nitems++;
+    }
+  }
+
+  {
+    struct verify_job job = {.outdir = outdir, .items = items};
+    parallel_for(nitems, verify_item_cb, &job);
+  }
+  qsort(items, nitems, sizeof(*items), compare_verify_items);
+  for (size_t i = 0; i < nitems; i++) {
+    if (items[i].status == verify_ok) {
+      continue;
+    }
+    printf("%s: %s\n",
+           items[i].status == verify_missing ? "missing" : "modified",
+           items[i].path);
+    problems++;
+    if (repair != NULL) {
+      const char *logical = items[i].logical;
+      string_map_put(repair, logical, repair);
+      for (size_t p = 0; p < payloads.len; p++) {
+        size_t n = strlen(payloads.items[p]);
+        if (strncmp(logical, payloads.items[p], n) == 0 &&
+            logical[n] == '/') {
+          string_map_put(repair, payloads.items[p], repair);
+        }
+      }
+    }
+  }
+  verify_walk(outdir, NULL, &expected, &opaque, &extra);
+  qsort(extra.items, extra.len, sizeof(*extra.items), compare_strings);
+  for (size_t i = 0; i < extra.len; i++) {
+    printf("extra: %s\n", extra.items[i]);
+    problems++;
+  }
+  if (fflush(stdout) != 0) {
+    fail_errno("stdout");
+  }
+
+  for (size_t i = 0; i < nitems; i++) {
+    free(items[i].path);
+    free(items[i].logical);
+  }
+  free(items);
+  for (size_t b = 0; b < nboms; b++) {
+    bom_entries_free(&boms[b]);
+    free(bom_payloads[b]);
+  }
+  free(boms);
+  free(bom_payloads);
+  pattern_list_free(&payloads);
+  pattern_list_free(&opaque);
+  pattern_list_free(&extra);
+  string_map_free(&expected, NULL);
+  return (problems);
 }
 
-static int contains_dotdot_segment(const char *path) {
-  const char *p = path;
-  while (*p != '\0') {
-    while (*p == '/') {
-      p++;
+static void json_put_string(FILE *out, const char *s) {
+  fputc('"', out);
+  for (; *s != '\0'; s++) {
+    unsigned char c = (unsigned char)*s;
+    if (c == '"' || c == '\\') {
+      fputc('\\', out);
+      fputc(c, out);
+    } else if (c < 0x20) {
+      fprintf(out, "\\u%04x", c);
+    } else {
+      fputc(c, out);
     }
-    const char *seg = p;
-    while (*p != '\0' && *p != '/') {
-      p++;
+  }
+  fputc('"', out);
+}
+
+struct payload_file {
+  char *path;
+  const struct bom_entry *bom;
+};
+
+static int compare_payload_files(const void *a, const void *b) {
+  return (strcmp(((const struct payload_file *)a)->path,
+                 ((const struct payload_file *)b)->path));
+}
+
+/* The Bom records of a pkg, under the paths --include matches, sorted. */
+struct pkg_boms {
+  struct bom_entries *boms;
+  char **payloads;
+  size_t nboms;
+  struct payload_file *files;
+  size_t nfiles;
+};
+
+/* Read only the Boms of pkg; Payloads are skipped without decoding. */
+static void pkg_boms_read(const char *pkg, struct archive *matching,
+                          struct pkg_boms *out) {
+  struct archive *xar = archive_read_new();
+  struct archive_entry *e;
+  size_t cap = 0;
+  int r;
+
+  if (xar == NULL) {
+    fail_errno("archive_read_new");
+  }
+  if (archive_match_set_inclusion_recursion(matching, 1) != ARCHIVE_OK) {
+    fail_archive(matching, "archive_match_set_inclusion_recursion");
+  }
+  archive_read_support_filter_all(xar);
+  archive_read_support_format_xar(xar);
+  if (strcmp(pkg, "-") == 0) {
+    r = archive_read_open_fd(xar, 0, 10240);
+  } else {
+    r = archive_read_open_filename(xar, pkg, 10240);
+  }
+  if (r != ARCHIVE_OK) {
+    fail_archive(xar, "open xar");
+  }
+
+  while ((r = archive_read_next_header(xar, &e)) == ARCHIVE_OK) {
+    char *rel = normalize_rel_path(archive_entry_pathname(e));
+    size_t len;
+    unsigned char *buf;
+
+    if (!member_is(rel, "Bom") || should_be_treated_as_nested_archive(rel)) {
+      free(rel);
+      continue;
     }
-    size_t len = (size_t)(p - seg);
-    if (len == 2 && seg[0] == '.' && seg[1] == '.') {
-      return (1);
+    buf = read_member_data(xar, rel, &len);
+    out->boms = realloc(out->boms, (out->nboms + 1) * sizeof(*out->boms));
+    out->payloads =
+        realloc(out->payloads, (out->nboms + 1) * sizeof(char *));
+    if (out->boms == NULL || out->payloads == NULL) {
+      fail_errno("realloc");
     }
+    memset(&out->boms[out->nboms], 0, sizeof(*out->boms));
+    if (bom_parse(buf, len, &out->boms[out->nboms]) != 0) {
+      fprintf(stderr, "%s: not a readable Bom\n", rel);
+      exit(1);
+    }
+    out->payloads[out->nboms++] = bom_payload_path(rel);
+    free(buf);
+    free(rel);
   }
-  return (0);
+  if (r != ARCHIVE_EOF) {
+    fail_archive(xar, "read xar header");
+  }
+  archive_read_free(xar);
+
+  for (size_t b = 0; b < out->nboms; b++) {
+    for (size_t i = 0; i < out->boms[b].len; i++) {
+      const struct bom_entry *be = &out->boms[b].items[i];
+      char *path = strcmp(be->path, ".") == 0
+                       ? strdup(out->payloads[b])
+                       : join_prefix_path(out->payloads[b], be->path);
+      if (path == NULL) {
+        fail_errno("strdup");
+      }
+      if (!should_extract_path(matching, path)) {
+        free(path);
+        continue;
+      }
+      if (out->nfiles == cap) {
+        cap = cap == 0 ? 1024 : cap * 2;
+        out->files = realloc(out->files, cap * sizeof(*out->files));
+        if (out->files == NULL) {
+          fail_errno("realloc");
+        }
+      }
+      out->files[out->nfiles].path = path;
+      out->files[out->nfiles].bom = be;
+      out->nfiles++;
+    }
+  }
+  qsort(out->files, out->nfiles, sizeof(*out->files), compare_payload_files);
 }
 
-static char *normalize_rel_path(const char *path) {
-  const char *rel = path;
-  if (rel == NULL) {
-    fprintf(stderr, "entry has empty pathname\n");
-    exit(1);
+static void pkg_boms_free(struct pkg_boms *p) {
+  for (size_t i = 0; i < p->nfiles; i++) {
+    free(p->files[i].path);
   }
-  if (rel[0] == '.' && rel[1] == '/') {
-    rel += 2;
+  free(p->files);
+  for (size_t b = 0; b < p->nboms; b++) {
+    bom_entries_free(&p->boms[b]);
+    free(p->payloads[b]);
   }
-  if (rel[0] == '\0') {
-    fprintf(stderr, "entry has empty pathname\n");
-    exit(1);
+  free(p->boms);
+  free(p->payloads);
+}
+
+/*
+ * --payload-files PKG: the Bom records of every component, named by the
+ * pkg path --include and --exclude match ("Payload/usr/bin/x"), sorted.
+ * Only the Boms are read. verbose adds mode, size and symlink target;
+ * json prints an array of objects instead.
+ */
+static int payload_files(const char *pkg, struct archive *matching,
+                         int verbose, int json) {
+  static const char *const type_names[] = {"other", "file", "dir",
+                                           "symlink", "device"};
+  struct pkg_boms list = {0};
+  struct payload_file *files;
+  size_t nfiles;
+
+  pkg_boms_read(pkg, matching, &list);
+  files = list.files;
+  nfiles = list.nfiles;
+  if (json) {
+    fputs("[", stdout);
   }
-  if (rel[0] == '/') {
-    fprintf(stderr, "entry pathname is absolute: %s\n", rel);
-    exit(1);
+  for (size_t i = 0; i < nfiles; i++) {
+    const struct bom_entry *be = files[i].bom;
+    if (json) {
+      fputs(i == 0 ? "\n  {\"path\": " : ",\n  {\"path\": ", stdout);
+      json_put_string(stdout, files[i].path);
+      printf(", \"type\": \"%s\", \"mode\": \"%04o\", \"size\": %" PRIu32,
+             type_names[be->type >= 0 && be->type <= bom_device ? be->type
+                                                                 : 0],
+             be->mode & 07777, be->size);
+      if (be->link != NULL) {
+        fputs(", \"link\": ", stdout);
+        json_put_string(stdout, be->link);
+      }
+      fputs("}", stdout);
+    } else if (verbose) {
+      printf("%06o\t%" PRIu32 "\t", be->mode, be->size);
+      cas_put_escaped(stdout, files[i].path);
+      if (be->link != NULL) {
+        fputs("\t", stdout);
+        cas_put_escaped(stdout, be->link);
+      }
+      fputc('\n', stdout);
+    } else {
+      cas_put_escaped(stdout, files[i].path);
+      fputc('\n', stdout);
+    }
   }
-  if (contains_dotdot_segment(rel)) {
-    fprintf(stderr, "entry pathname contains '..': %s\n", rel);
-    exit(1);
+  if (json) {
+    fputs(nfiles > 0 ? "\n]\n" : "]\n", stdout);
   }
-  char *dup = strdup(rel);
-  if (dup == NULL) {
-    fail_errno("strdup");
+  if (fflush(stdout) != 0 || ferror(stdout)) {
+    fail_errno("stdout");
   }
-  return (dup);
+  pkg_boms_free(&list);
+  return (0);
 }
 
-static void mkdirs_for_path(const char *path) {
-  char *tmp = strdup(path);
-  if (tmp == NULL) {
-    fail_errno("strdup");
+static int bom_entries_differ(const struct bom_entry *a,
+                              const struct bom_entry *b) {
+  if (a->type != b->type || a->mode != b->mode) {
+    return (1);
   }
-  size_t len = strlen(tmp);
-  while (len > 1 && tmp[len - 1] == '/') {
-    tmp[len - 1] = '\0';
-    len--;
+  if (a->type == bom_file) {
+    return (a->size != b->size || a->cksum != b->cksum);
   }
-  for (char *p = tmp + 1; *p != '\0'; p++) {
-    if (*p == '/') {
-      *p = '\0';
-      if (mkdir(tmp, 0755) != 0 && errno != EEXIST) {
-        free(tmp);
-        fail_errno("mkdir(parent)");
+  if (a->type == bom_symlink) {
+    return (strcmp(a->link, b->link) != 0);
+  }
+  return (0);
+}
+
+/*
+ * --diff OLD NEW: compare the Bom records of the two pkgs by path (type,
+ * mode, and size and cksum for files or the target for symlinks) and print
+ * what was added, removed or modified, sorted. Components match by their
+ * member path. No Payload is decoded. Returns 1 if anything differs.
+ */
+static int pkg_diff(const char *old_pkg, const char *new_pkg,
+                    struct archive *matching) {
+  struct pkg_boms old_list = {0};
+  struct pkg_boms new_list = {0};
+  size_t i = 0;
+  size_t j = 0;
+  int differ = 0;
+
+  pkg_boms_read(old_pkg, matching, &old_list);
+  pkg_boms_read(new_pkg, matching, &new_list);
+  while (i < old_list.nfiles || j < new_list.nfiles) {
+    int cmp;
+
+    if (i == old_list.nfiles) {
+      cmp = 1;
+    } else if (j == new_list.nfiles) {
+      cmp = -1;
+    } else {
+      cmp = strcmp(old_list.files[i].path, new_list.files[j].path);
+    }
+    if (cmp < 0) {
+      printf("removed: %s\n", old_list.files[i++].path);
+      differ = 1;
+    } else if (cmp > 0) {
+      printf("added: %s\n", new_list.files[j++].path);
+      differ = 1;
+    } else {
+      if (bom_entries_differ(old_list.files[i].bom, new_list.files[j].bom)) {
+        printf("modified: %s\n", new_list.files[j].path);
+        differ = 1;
       }
-      *p = '/';
+      i++;
+      j++;
     }
   }
-  if (mkdir(tmp, 0755) != 0 && errno != EEXIST) {
-    free(tmp);
-    fail_errno("mkdir(path)");
+  if (fflush(stdout) != 0 || ferror(stdout)) {
+    fail_errno("stdout");
   }
-  free(tmp);
+  pkg_boms_free(&old_list);
+  pkg_boms_free(&new_list);
+  return (differ);
 }
 
-static void ensure_outdir(const char *outdir, int force) {
-  if (outdir == NULL || outdir[0] == '\0') {
-    fail_errno("invalid output directory");
+/*
+ * --cat PATH PKG: copy one pkg path to stdout. A top-level member is copied
+ * as is; a path inside a nested archive is streamed out of it, and decoding
+ * stops after that entry. With a --payload-cache hit, the entries before it
+ * are skipped by seeking, so only the frames holding it are decompressed.
+ */
+static int cat_member(const char *pkg, const char *path,
+                      struct write_options *wopts) {
+  struct archive *xar = archive_read_new();
+  struct archive_entry *e;
+  struct cat_target cat = {0};
+  char *want = normalize_rel_path(path);
+  size_t want_len = strlen(want);
+  int r;
+
+  if (xar == NULL) {
+    fail_errno("archive_read_new");
   }
-  if (access(outdir, F_OK) == 0) {
+  cat.path = want;
+  wopts->cat = &cat;
+  archive_read_support_filter_all(xar);
+  archive_read_support_format_xar(xar);
+  if (strcmp(pkg, "-") == 0) {
+    r = archive_read_open_fd(xar, 0, 10240);
+  } else {
+    r = archive_read_open_filename(xar, pkg, 10240);
+  }
+  if (r != ARCHIVE_OK) {
+    fail_archive(xar, "open xar");
+  }
+
+  while (!cat.done && (r = archive_read_next_header(xar, &e)) == ARCHIVE_OK) {
+    char *rel = normalize_rel_path(archive_entry_pathname(e));
+    size_t rel_len = strlen(rel);
+
+    if (strcmp(rel, want) == 0) {
+      if (archive_entry_filetype(e) != AE_IFREG) {
+        fprintf(stderr, "%s: not a regular file\n", path);
+        exit(1);
+      }
+      cat_copy_data(xar, want);
+      cat.found = 1;
+      cat.done = 1;
+    } else if (should_be_treated_as_nested_archive(rel) &&
+               want_len > rel_len && strncmp(want, rel, rel_len) == 0 &&
+               want[rel_len] == '/') {
+      struct astream in = {.a = xar};
+
+      extract_nested_archive_from_stream(&in, ".", 0, NULL, 0, rel, wopts,
+                                         NULL);
+      /* A dataless link whose data never came is an empty file. */
+      cat.done = cat.found;
+    }
+    free(rel);
+  }
+  if (!cat.done && r != ARCHIVE_EOF) {
+    fail_archive(xar, "read xar header");
+  }
+  archive_read_free(xar);
+  if (fflush(stdout) != 0) {
+    fail_errno("stdout");
+  }
+  if (!cat.found) {
+    fprintf(stderr, "%s: not found in %s\n", path, pkg);
+  }
+  wopts->cat = NULL;
+  free(cat.alias);
+  free(want);
+  return (cat.found ? 0 : 1);
+}
+#endif
+
+static struct archive_entry *view_entry_clone(const struct view_list *views,
+                                              struct archive_entry *e) {
+  if (views == NULL || views->len == 0) {
+    return (NULL);
+  }
+  struct archive_entry *copy = archive_entry_clone(e);
+  if (copy == NULL) {
+    fail_errno("archive_entry_clone");
+  }
+  return (copy);
+}
+
+static int views_want_nested(const struct view_list *views, const char *path) {
+  for (size_t i = 0; views != NULL && i < views->len; i++) {
+    const struct view *v = &views->items[i];
+    if (v->flat) {
+      continue;
+    }
+    if (should_extract_path(v->matching, path) ||
+        (v->includes.len > 0 && has_include_descendant(&v->includes, path))) {
+      return (1);
+    }
+  }
+  return (0);
+}
+
+#if !defined(_WIN32)
+/*
+ * Write orig (pathname relative to the member at prefix) to every view
+ * that selects it. primary is the same entry as already extracted into
+ * the current directory, or NULL; its file supplies the data so the
+ * stream is read at most once.
+ */
+static void route_to_views(struct archive *a, struct archive_entry *orig,
+                           const char *prefix, struct archive_entry *primary,
+                           const struct view_list *views) {
+  char *src = NULL;
+  int back = -1;
+
+  if (orig == NULL || views == NULL || views->len == 0) {
     return;
   }
-  if (mkdir(outdir, 0755) != 0) {
-    fail_errno("mkdir(outdir)");
+  if (primary != NULL && archive_entry_filetype(primary) == AE_IFREG &&
+      archive_entry_hardlink(primary) == NULL) {
+    src = realpath(archive_entry_pathname(primary), NULL);
+  }
+
+  char *logical = join_prefix_path(prefix, archive_entry_pathname(orig));
+  for (size_t i = 0; i < views->len; i++) {
+    const struct view *v = &views->items[i];
+    if (v->flat ? prefix != NULL : !should_extract_path(v->matching, logical)) {
+      continue;
+    }
+    char *target = strip_components_path(logical, v->strip);
+    if (target == NULL) {
+      continue;
+    }
+    struct archive_entry *e = archive_entry_clone(orig);
+    if (e == NULL) {
+      fail_errno("archive_entry_clone");
+    }
+    archive_entry_set_pathname(e, target);
+    const char *hardlink = archive_entry_hardlink(orig);
+    if (hardlink != NULL) {
+      char *hl_logical = join_prefix_path(prefix, hardlink);
+      char *hl = strip_components_path(hl_logical, v->strip);
+      free(hl_logical);
+      if (hl == NULL) {
+        archive_entry_free(e);
+        free(target);
+        continue;
+      }
+      archive_entry_set_hardlink(e, hl);
+      free(hl);
+    }
+
+    if (back < 0 && (back = open(".", O_RDONLY | O_CLOEXEC)) < 0) {
+      fail_errno("open(cwd)");
+    }
+    if (fchdir(v->dirfd) != 0) {
+      fail_errno(v->outdir);
+    }
+    if (archive_entry_filetype(e) == AE_IFREG && hardlink == NULL &&
+        archive_entry_size(e) > 0) {
+      if (src == NULL) {
+        /* First taker of the data writes it; later views copy it. */
+        if (archive_read_extract2(a, e, v->disk) != ARCHIVE_OK) {
+          fail_archive(a, "extract view entry");
+        }
+        src = join_prefix_path(v->root, target);
+      } else {
+        struct stat st;
+        la_int64_t size = archive_entry_size(e);
+        archive_entry_set_size(e, 0);
+        if (archive_write_header(v->disk, e) != ARCHIVE_OK ||
+            archive_write_finish_entry(v->disk) != ARCHIVE_OK) {
+          fail_archive(v->disk, "write view entry");
+        }
+        archive_entry_set_size(e, size);
+        if (stat(src, &st) != 0 || unlink(target) != 0) {
+          fail_errno(target);
+        }
+        if ((!views->link || link(src, target) != 0) &&
+            copy_file_contents(src, target, &st) != 0) {
+          fail_errno(target);
+        }
+      }
+    } else if (archive_write_header(v->disk, e) != ARCHIVE_OK ||
+               archive_write_finish_entry(v->disk) != ARCHIVE_OK) {
+      fail_archive(v->disk, "write view entry");
+    }
+    archive_entry_free(e);
+    free(target);
+  }
+  free(logical);
+  free(src);
+  if (back >= 0) {
+    if (fchdir(back) != 0) {
+      fail_errno("fchdir(cwd)");
+    }
+    close(back);
+  }
+}
+
+/*
+ * Open e in the flat tree. Its data arrives through the astream tee while
+ * the nested extractor reads the member, so the pkg is only read once.
+ */
+static void flat_begin(const struct view *flat, struct archive_entry *e) {
+  int back = open(".", O_RDONLY | O_CLOEXEC);
+  if (back < 0) {
+    fail_errno("open(cwd)");
+  }
+  if (fchdir(flat->dirfd) != 0) {
+    fail_errno(flat->outdir);
+  }
+  if (archive_write_header(flat->disk, e) != ARCHIVE_OK) {
+    fail_archive(flat->disk, "write flat entry");
+  }
+  if (fchdir(back) != 0) {
+    fail_errno("fchdir(cwd)");
+  }
+  close(back);
+}
+
+static void flat_finish(const struct view *flat) {
+  int back = open(".", O_RDONLY | O_CLOEXEC);
+  if (back < 0) {
+    fail_errno("open(cwd)");
+  }
+  if (fchdir(flat->dirfd) != 0) {
+    fail_errno(flat->outdir);
   }
+  if (archive_write_finish_entry(flat->disk) != ARCHIVE_OK) {
+    fail_archive(flat->disk, "write flat entry");
+  }
+  if (fchdir(back) != 0) {
+    fail_errno("fchdir(cwd)");
+  }
+  close(back);
+}
+#else
+static void route_to_views(struct archive *a, struct archive_entry *orig,
+                           const char *prefix, struct archive_entry *primary,
+                           const struct view_list *views) {
+  (void)a;
+  (void)orig;
+  (void)prefix;
+  (void)primary;
+  (void)views;
 }
+#endif
 
 int main(int argc, char **argv) {
   const char *xar_path = NULL;
@@ -630,52 +8009,287 @@ int main(int argc, char **argv) {
   struct archive *xar;
   struct archive *matching;
   struct pattern_list includes = {0};
+  struct pattern_list excludes = {0};
+  struct view_list views = {0};
+#if !defined(_WIN32)
+  struct view *flat = NULL;
+#endif
+  struct archive *cur_matching;
+  struct pattern_list *cur_includes = &includes;
+  int *cur_strip;
   struct archive *disk;
   struct archive_entry *e;
   int r;
   int opt;
   const char *arg;
   int force = 0;
+  int replace = 0;
+  char *staging = NULL;
+#if !defined(_WIN32)
+  int origin_fd = -1;
+#endif
   int do_expand = 0;
   int do_expand_full = 0;
   int strip_components = 0;
+  struct write_options wopts = {0};
+#if !defined(_WIN32)
+  struct writeback_queue writeback = {0};
+  struct aligned_pool pool = {0};
+#endif
+  struct pattern_list written = {0};
+  struct string_map seen = {0};
+  struct string_map digests = {0};
+  struct string_map hashes = {0};
+  const char *hash_manifest_arg = NULL;
+  int verify_bom = 0;
+  int do_verify = 0;
+  int repair = 0;
+  int do_payload_files = 0;
+  int precreate = 0;
+  int skeleton = 0;
+  int do_diff = 0;
+  const char *cat_arg = NULL;
+#if !defined(_WIN32)
+  FILE *hash_manifest = NULL;
+  char *incremental_manifest = NULL;
+  int verbose = 0;
+  int json = 0;
+  struct bom_verify bom = {0};
+  struct string_map repair_paths = {0};
+  struct bom_plan plan = {0};
+#endif
+  char *root = NULL;
+  const char *link_dest_arg = NULL;
+  const char *flat_arg = NULL;
+  const char *store_arg = NULL;
+  int do_materialize = 0;
+  enum output_format output_format = output_format_dir;
+  struct archive *stream = NULL;
+#if !defined(_WIN32)
+  struct squashfs_image *image = NULL;
+  struct cas_output *cas = NULL;
+#endif
+  char *link_dest = NULL;
+  const char *result_cache_arg = NULL;
+  char *result_cache = NULL;
+  const char *payload_cache_arg = NULL;
+  char *payload_cache = NULL;
+  const char *pbzx_cache_arg = NULL;
+  char *pbzx_cache = NULL;
+  la_int64_t pbzx_cache_size = 0;
+  la_int64_t result_cache_size = 0;
+#if !defined(_WIN32)
+  char pkg_id[65];
+  char cache_key[65];
+  int cache_store = 1;
+#endif
+  int cache_hit = 0;
   int flags;
 
   matching = archive_match_new();
   if (matching == NULL) {
     fail_errno("archive_match_new");
   }
+  cur_matching = matching;
+  cur_strip = &strip_components;
+  sha256_kernel_init();
+  cksum_kernel_init();
 
   while ((opt = pkg_getopt(&argc, &argv, &arg)) != -1) {
     switch (opt) {
     case 'f':
       force = 1;
       break;
-    case 'h':
-      usage(stdout);
-      return (0);
-    case 'v':
+    case 'h':
+      usage(stdout);
+      return (0);
+    case 'v':
+#if !defined(_WIN32)
+      verbose = 1;
+#endif
+      break;
+    case 'X':
+      do_expand = 1;
+      break;
+    case 'E':
+      do_expand_full = 1;
+      break;
+    case opt_include:
+      pattern_list_add(cur_includes, arg);
+      if (archive_match_include_pattern(cur_matching, arg) != ARCHIVE_OK) {
+        fail_archive(cur_matching, "archive_match_include_pattern");
+      }
+      break;
+    case opt_exclude:
+      if (cur_matching == matching) {
+        pattern_list_add(&excludes, arg);
+      }
+      if (archive_match_exclude_pattern(cur_matching, arg) != ARCHIVE_OK) {
+        fail_archive(cur_matching, "archive_match_exclude_pattern");
+      }
+      break;
+    case opt_view: {
+      struct view *v;
+      views.items = realloc(views.items, (views.len + 1) * sizeof(*v));
+      if (views.items == NULL) {
+        fail_errno("realloc");
+      }
+      v = &views.items[views.len++];
+      memset(v, 0, sizeof(*v));
+      v->outdir = arg;
+      v->dirfd = -1;
+      v->matching = archive_match_new();
+      if (v->matching == NULL) {
+        fail_errno("archive_match_new");
+      }
+      if (archive_match_set_inclusion_recursion(v->matching, 1) !=
+          ARCHIVE_OK) {
+        fail_archive(v->matching, "archive_match_set_inclusion_recursion");
+      }
+      cur_matching = v->matching;
+      cur_includes = &v->includes;
+      cur_strip = &v->strip;
+      break;
+    }
+    case opt_flat:
+      flat_arg = arg;
+      break;
+    case opt_store:
+      store_arg = arg;
+      break;
+    case opt_materialize:
+      do_materialize = 1;
+      break;
+    case opt_hash_manifest:
+      hash_manifest_arg = arg;
+      break;
+    case opt_verify_bom:
+      verify_bom = 1;
+      break;
+    case opt_verify:
+      do_verify = 1;
       break;
-    case 'X':
-      do_expand = 1;
+    case opt_repair:
+      repair = 1;
       break;
-    case 'E':
-      do_expand_full = 1;
+    case opt_payload_files:
+      do_payload_files = 1;
       break;
-    case opt_include:
-      pattern_list_add(&includes, arg);
-      if (archive_match_include_pattern(matching, arg) != ARCHIVE_OK) {
-        fail_archive(matching, "archive_match_include_pattern");
+    case opt_json:
+#if !defined(_WIN32)
+      json = 1;
+#endif
+      break;
+    case opt_precreate_dirs:
+      precreate = 1;
+      break;
+    case opt_skeleton:
+      skeleton = 1;
+      break;
+    case opt_diff:
+      do_diff = 1;
+      break;
+    case opt_cat:
+      cat_arg = arg;
+      break;
+    case opt_output_format:
+      if (strcmp(arg, "dir") == 0) {
+        output_format = output_format_dir;
+      } else if (strcmp(arg, "tar") == 0) {
+        output_format = output_format_tar;
+      } else if (strcmp(arg, "tar.zst") == 0) {
+        output_format = output_format_tar_zstd;
+      } else if (strcmp(arg, "squashfs") == 0) {
+        output_format = output_format_squashfs;
+      } else if (strcmp(arg, "cas") == 0) {
+        output_format = output_format_cas;
+      } else {
+        fprintf(stderr, "invalid output format: %s\n", arg);
+        return (2);
       }
       break;
-    case opt_exclude:
-      if (archive_match_exclude_pattern(matching, arg) != ARCHIVE_OK) {
-        fail_archive(matching, "archive_match_exclude_pattern");
+    case opt_sparse:
+      wopts.sparse = 1;
+      break;
+    case opt_cache_policy:
+      if (strcmp(arg, "keep") == 0) {
+        wopts.cache_policy = cache_policy_keep;
+      } else if (strcmp(arg, "drop") == 0) {
+        wopts.cache_policy = cache_policy_drop;
+      } else {
+        fprintf(stderr, "invalid cache-policy: %s\n", arg);
+        return (2);
+      }
+      break;
+    case opt_direct_io:
+      if (parse_size(arg, &wopts.direct_threshold) != 0 ||
+          wopts.direct_threshold <= 0) {
+        fprintf(stderr, "invalid direct-io size: %s\n", arg);
+        return (2);
+      }
+      break;
+    case opt_sync:
+      if (strcmp(arg, "none") == 0) {
+        wopts.sync = sync_policy_none;
+      } else if (strcmp(arg, "end") == 0) {
+        wopts.sync = sync_policy_end;
+      } else if (strcmp(arg, "per-file") == 0) {
+        wopts.sync = sync_policy_per_file;
+      } else {
+        fprintf(stderr, "invalid sync mode: %s\n", arg);
+        return (2);
+      }
+      break;
+    case opt_replace:
+      replace = 1;
+      break;
+    case opt_dedup:
+      if (strcmp(arg, "hardlink") == 0) {
+        wopts.dedup = dedup_hardlink;
+      } else if (strcmp(arg, "reflink") == 0) {
+        wopts.dedup = dedup_reflink;
+      } else {
+        fprintf(stderr, "invalid dedup mode: %s\n", arg);
+        return (2);
+      }
+      break;
+    case opt_link_dest:
+      link_dest_arg = arg;
+      break;
+    case opt_result_cache:
+      result_cache_arg = arg;
+      break;
+    case opt_payload_cache:
+      payload_cache_arg = arg;
+      break;
+    case opt_pbzx_cache:
+      pbzx_cache_arg = arg;
+      break;
+    case opt_pbzx_cache_size:
+      if (parse_size(arg, &pbzx_cache_size) != 0 || pbzx_cache_size <= 0) {
+        fprintf(stderr, "invalid pbzx-cache size: %s\n", arg);
+        return (2);
+      }
+      break;
+    case opt_result_cache_size:
+      if (parse_size(arg, &result_cache_size) != 0 || result_cache_size <= 0) {
+        fprintf(stderr, "invalid result-cache size: %s\n", arg);
+        return (2);
+      }
+      break;
+    case opt_incremental:
+      if (strcmp(arg, "mtime") == 0) {
+        wopts.incremental = incremental_mtime;
+      } else if (strcmp(arg, "content") == 0) {
+        wopts.incremental = incremental_content;
+      } else {
+        fprintf(stderr, "invalid incremental mode: %s\n", arg);
+        return (2);
       }
       break;
     case opt_strip_components:
-      strip_components = atoi(arg);
-      if (strip_components < 0) {
+      *cur_strip = atoi(arg);
+      if (*cur_strip < 0) {
         fprintf(stderr, "invalid strip-components: %s\n", arg);
         return (2);
       }
@@ -686,20 +8300,403 @@ int main(int argc, char **argv) {
     }
   }
 
-  if (!do_expand && !do_expand_full) {
+  if (!do_expand && !do_expand_full && !do_materialize && !do_verify &&
+      !do_payload_files && !do_diff && cat_arg == NULL) {
     usage(stderr);
     return (2);
   }
 
-  if (argc != 2) {
+  if (do_payload_files) {
+    if (argc != 1) {
+      usage(stderr);
+      return (2);
+    }
+#if !defined(_WIN32)
+    return (payload_files(argv[0], matching, verbose, json));
+#else
+    fprintf(stderr, "--payload-files is not supported on this platform\n");
+    return (2);
+#endif
+  }
+
+  if (argc != (cat_arg != NULL ? 1 : 2)) {
     usage(stderr);
     return (2);
   }
 
   xar_path = argv[0];
-  outdir = argv[1];
+  outdir = cat_arg != NULL ? NULL : argv[1];
+  if (cat_arg != NULL && (do_expand || do_expand_full || do_materialize ||
+                          do_verify || do_diff)) {
+    fprintf(stderr, "--cat cannot be combined with another command\n");
+    return (2);
+  }
 
-  ensure_outdir(outdir, force);
+  if ((do_materialize || output_format == output_format_cas) &&
+      store_arg == NULL) {
+    fprintf(stderr, "%s requires --store\n",
+            do_materialize ? "--materialize" : "--output-format cas");
+    return (2);
+  }
+  if (do_materialize) {
+#if !defined(_WIN32)
+    return (materialize(argv[0], store_arg, outdir, force));
+#else
+    fprintf(stderr, "--materialize is not supported on this platform\n");
+    return (2);
+#endif
+  }
+  if (do_diff) {
+#if !defined(_WIN32)
+    return (pkg_diff(argv[0], argv[1], matching));
+#else
+    fprintf(stderr, "--diff is not supported on this platform\n");
+    return (2);
+#endif
+  }
+
+  if (repair && !do_verify) {
+    fprintf(stderr, "--repair requires --verify\n");
+    return (2);
+  }
+  if (do_verify) {
+    const char *conflict = NULL;
+    if (do_expand || do_expand_full) {
+      conflict = do_expand ? "--expand" : "--expand-full";
+    } else if (output_format != output_format_dir) {
+      conflict = "--output-format";
+    } else if (replace) {
+      conflict = "--replace";
+    } else if (result_cache_arg != NULL) {
+      conflict = "--result-cache";
+    } else if (views.len > 0) {
+      conflict = "--view";
+    } else if (flat_arg != NULL) {
+      conflict = "--flat";
+    } else if (hash_manifest_arg != NULL) {
+      conflict = "--hash-manifest";
+    } else if (repair && strcmp(xar_path, "-") == 0) {
+      conflict = "a pkg on stdin";
+    }
+    if (conflict != NULL) {
+      fprintf(stderr, "--verify cannot be combined with %s\n", conflict);
+      return (2);
+    }
+#if !defined(_WIN32)
+    if (verify_tree(xar_path, outdir, matching, &includes, strip_components,
+                    repair ? &repair_paths : NULL) == 0) {
+      return (0);
+    }
+    if (!repair) {
+      return (1);
+    }
+    /* Extract just the failing paths again, over what is there. */
+    origin_fd = open(".", O_RDONLY | O_CLOEXEC);
+    if (origin_fd < 0) {
+      fail_errno("open(cwd)");
+    }
+    wopts.only = &repair_paths;
+    do_expand_full = 1;
+    force = 1;
+#else
+    fprintf(stderr, "--verify is not supported on this platform\n");
+    return (2);
+#endif
+  }
+
+  if (replace && wopts.incremental != incremental_off) {
+    fprintf(stderr, "--incremental cannot be combined with --replace\n");
+    return (2);
+  }
+  if (result_cache_arg != NULL && wopts.incremental != incremental_off) {
+    fprintf(stderr, "--incremental cannot be combined with --result-cache\n");
+    return (2);
+  }
+  if (output_format != output_format_dir) {
+    const char *conflict = NULL;
+    if (replace) {
+      conflict = "--replace";
+    } else if (wopts.incremental != incremental_off) {
+      conflict = "--incremental";
+    } else if (wopts.sync != sync_policy_none) {
+      conflict = "--sync";
+    } else if (wopts.dedup != dedup_off) {
+      conflict = "--dedup";
+    } else if (link_dest_arg != NULL) {
+      conflict = "--link-dest";
+    } else if (result_cache_arg != NULL) {
+      conflict = "--result-cache";
+    } else if (views.len > 0) {
+      conflict = "--view";
+    } else if (flat_arg != NULL) {
+      conflict = "--flat";
+    }
+    if (conflict != NULL) {
+      fprintf(stderr, "--output-format cannot be combined with %s\n",
+              conflict);
+      return (2);
+    }
+  }
+  if (flat_arg != NULL && !do_expand_full) {
+    fprintf(stderr, "--flat requires --expand-full\n");
+    return (2);
+  }
+  if (result_cache_arg != NULL && flat_arg != NULL) {
+    fprintf(stderr, "--flat cannot be combined with --result-cache\n");
+    return (2);
+  }
+  if (result_cache_arg != NULL && views.len > 0) {
+    fprintf(stderr, "--view cannot be combined with --result-cache\n");
+    return (2);
+  }
+  /* Only the primary tree's files and filesystem are synced. */
+  if (wopts.sync != sync_policy_none && (views.len > 0 || flat_arg != NULL)) {
+    fprintf(stderr, "--sync cannot be combined with %s\n",
+            views.len > 0 ? "--view" : "--flat");
+    return (2);
+  }
+  if (hash_manifest_arg != NULL && output_format != output_format_dir) {
+    fprintf(stderr, "--hash-manifest requires --output-format dir\n");
+    return (2);
+  }
+  if (hash_manifest_arg != NULL && result_cache_arg != NULL) {
+    fprintf(stderr,
+            "--hash-manifest cannot be combined with --result-cache\n");
+    return (2);
+  }
+  if (precreate &&
+      (!do_expand_full || output_format != output_format_dir)) {
+    fprintf(stderr, "--precreate-dirs requires --expand-full with "
+                    "--output-format dir\n");
+    return (2);
+  }
+  if (skeleton) {
+    const char *conflict = NULL;
+    if (!do_expand_full) {
+      fprintf(stderr, "--skeleton requires --expand-full\n");
+      return (2);
+    }
+    if (output_format != output_format_dir) {
+      fprintf(stderr, "--skeleton requires --output-format dir\n");
+      return (2);
+    }
+    if (verify_bom) {
+      conflict = "--verify-bom";
+    } else if (hash_manifest_arg != NULL) {
+      conflict = "--hash-manifest";
+    } else if (wopts.incremental != incremental_off) {
+      conflict = "--incremental";
+    } else if (result_cache_arg != NULL) {
+      conflict = "--result-cache";
+    } else if (views.len > 0) {
+      conflict = "--view";
+    } else if (flat_arg != NULL) {
+      conflict = "--flat";
+    }
+    if (conflict != NULL) {
+      fprintf(stderr, "--skeleton cannot be combined with %s\n", conflict);
+      return (2);
+    }
+  }
+  if (verify_bom) {
+    const char *conflict = NULL;
+    if (!do_expand_full) {
+      fprintf(stderr, "--verify-bom requires --expand-full\n");
+      return (2);
+    }
+    if (output_format != output_format_dir) {
+      fprintf(stderr, "--verify-bom requires --output-format dir\n");
+      return (2);
+    }
+    if (result_cache_arg != NULL) {
+      conflict = "--result-cache";
+    } else if (views.len > 0) {
+      conflict = "--view";
+    } else if (flat_arg != NULL) {
+      conflict = "--flat";
+    }
+    if (conflict != NULL) {
+      fprintf(stderr, "--verify-bom cannot be combined with %s\n", conflict);
+      return (2);
+    }
+  }
+
+#if !defined(_WIN32)
+  if (link_dest_arg != NULL) {
+    /* Resolved now; extraction runs from inside the outdir. */
+    link_dest = realpath(link_dest_arg, NULL);
+    if (link_dest == NULL) {
+      fail_errno(link_dest_arg);
+    }
+    wopts.link_dest = link_dest;
+  }
+  if (result_cache_arg != NULL) {
+    if (mkdir(result_cache_arg, 0755) != 0 && errno != EEXIST) {
+      fail_errno(result_cache_arg);
+    }
+    result_cache = realpath(result_cache_arg, NULL);
+    if (result_cache == NULL) {
+      fail_errno(result_cache_arg);
+    }
+  }
+  if (payload_cache_arg != NULL) {
+    if (mkdir(payload_cache_arg, 0755) != 0 && errno != EEXIST) {
+      fail_errno(payload_cache_arg);
+    }
+    payload_cache = realpath(payload_cache_arg, NULL);
+    if (payload_cache == NULL) {
+      fail_errno(payload_cache_arg);
+    }
+  }
+  if (pbzx_cache_arg != NULL) {
+    if (mkdir(pbzx_cache_arg, 0755) != 0 && errno != EEXIST) {
+      fail_errno(pbzx_cache_arg);
+    }
+    pbzx_cache = realpath(pbzx_cache_arg, NULL);
+    if (pbzx_cache == NULL) {
+      fail_errno(pbzx_cache_arg);
+    }
+    wopts.pbzx_cache = pbzx_cache;
+  }
+  if (hash_manifest_arg != NULL) {
+    /* Opened now; extraction runs from inside the outdir. */
+    hash_manifest = strcmp(hash_manifest_arg, "-") == 0
+                        ? stdout
+                        : fopen(hash_manifest_arg, "w");
+    if (hash_manifest == NULL) {
+      fail_errno(hash_manifest_arg);
+    }
+    wopts.hashes = &hashes;
+  }
+  if (verify_bom) {
+    wopts.bom = &bom;
+  }
+  if (cat_arg != NULL) {
+    if (payload_cache != NULL && pkg_identity(xar_path, pkg_id) == 0) {
+      wopts.payload_cache = payload_cache;
+      wopts.pkg_id = pkg_id;
+    }
+    return (cat_member(xar_path, cat_arg, &wopts));
+  }
+#endif
+
+  if (replace) {
+#if !defined(_WIN32)
+    staging = make_staging_dir(outdir);
+    origin_fd = open(".", O_RDONLY | O_CLOEXEC);
+    if (origin_fd < 0) {
+      fail_errno("open(cwd)");
+    }
+#else
+    fprintf(stderr, "--replace is not supported on this platform\n");
+    return (2);
+#endif
+  } else if (output_format != output_format_dir) {
+#if !defined(_WIN32)
+    if (output_format == output_format_squashfs) {
+      if (strcmp(outdir, "-") == 0) {
+        fprintf(stderr, "squashfs output needs a file, not stdout\n");
+        return (2);
+      }
+      image = image_open(outdir);
+      wopts.image = image;
+    } else if (output_format == output_format_cas) {
+      cas = cas_open(store_arg, outdir);
+      wopts.cas = cas;
+    } else {
+      stream = output_stream_open(outdir, output_format);
+      wopts.stream = stream;
+    }
+#else
+    fprintf(stderr, "--output-format is not supported on this platform\n");
+    return (2);
+#endif
+  } else {
+#if !defined(_WIN32)
+    /* Only a tree this run created from scratch may be cached. */
+    if (result_cache != NULL && access(outdir, F_OK) == 0) {
+      cache_store = 0;
+    }
+#endif
+    ensure_outdir(outdir, force);
+  }
+
+#if !defined(_WIN32)
+  wopts.writeback = &writeback;
+  wopts.pool = &pool;
+#if defined(__linux__)
+  if (wopts.sync == sync_policy_per_file) {
+    wopts.written = &written;
+  }
+#else
+  if (wopts.sync != sync_policy_none) {
+    wopts.written = &written;
+  }
+#endif
+  if (wopts.incremental != incremental_off) {
+    incremental_manifest = incremental_manifest_path(outdir);
+    wopts.seen = &seen;
+    wopts.umask = umask(0);
+    umask(wopts.umask);
+  }
+#else
+  if (wopts.sync != sync_policy_none) {
+    fprintf(stderr, "--sync is not supported on this platform\n");
+    return (2);
+  }
+  if (wopts.incremental != incremental_off) {
+    fprintf(stderr, "--incremental is not supported on this platform\n");
+    return (2);
+  }
+  if (wopts.dedup != dedup_off) {
+    fprintf(stderr, "--dedup is not supported on this platform\n");
+    return (2);
+  }
+  if (link_dest_arg != NULL) {
+    fprintf(stderr, "--link-dest is not supported on this platform\n");
+    return (2);
+  }
+  if (result_cache_arg != NULL) {
+    fprintf(stderr, "--result-cache is not supported on this platform\n");
+    return (2);
+  }
+  if (payload_cache_arg != NULL) {
+    fprintf(stderr, "--payload-cache is not supported on this platform\n");
+    return (2);
+  }
+  if (pbzx_cache_arg != NULL) {
+    fprintf(stderr, "--pbzx-cache is not supported on this platform\n");
+    return (2);
+  }
+  if (views.len > 0) {
+    fprintf(stderr, "--view is not supported on this platform\n");
+    return (2);
+  }
+  if (flat_arg != NULL) {
+    fprintf(stderr, "--flat is not supported on this platform\n");
+    return (2);
+  }
+  if (hash_manifest_arg != NULL) {
+    fprintf(stderr, "--hash-manifest is not supported on this platform\n");
+    return (2);
+  }
+  if (verify_bom) {
+    fprintf(stderr, "--verify-bom is not supported on this platform\n");
+    return (2);
+  }
+  if (precreate) {
+    fprintf(stderr, "--precreate-dirs is not supported on this platform\n");
+    return (2);
+  }
+  if (skeleton) {
+    fprintf(stderr, "--skeleton is not supported on this platform\n");
+    return (2);
+  }
+  if (cat_arg != NULL) {
+    fprintf(stderr, "--cat is not supported on this platform\n");
+    return (2);
+  }
+#endif
 
   xar = archive_read_new();
   if (xar == NULL) {
@@ -726,10 +8723,48 @@ int main(int argc, char **argv) {
   archive_write_disk_set_options(disk, flags);
   archive_write_disk_set_standard_lookup(disk);
 
+#if !defined(_WIN32)
+  if (flat_arg != NULL) {
+    /* Set up with the views so top-level entries are shared the same way. */
+    views.items = realloc(views.items, (views.len + 1) * sizeof(*flat));
+    if (views.items == NULL) {
+      fail_errno("realloc");
+    }
+    flat = &views.items[views.len++];
+    memset(flat, 0, sizeof(*flat));
+    flat->outdir = flat_arg;
+    flat->flat = 1;
+  }
+  views.link = wopts.dedup == dedup_hardlink;
+  for (size_t i = 0; i < views.len; i++) {
+    struct view *v = &views.items[i];
+    ensure_outdir(v->outdir, force);
+    v->root = realpath(v->outdir, NULL);
+    if (v->root == NULL) {
+      fail_errno(v->outdir);
+    }
+    v->dirfd = open(v->root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (v->dirfd < 0) {
+      fail_errno(v->outdir);
+    }
+    v->disk = archive_write_disk_new();
+    if (v->disk == NULL) {
+      fail_errno("archive_write_disk_new");
+    }
+    archive_write_disk_set_options(v->disk, flags);
+    archive_write_disk_set_standard_lookup(v->disk);
+  }
+#endif
+
   archive_read_support_filter_all(xar);
   archive_read_support_format_xar(xar);
 
-  if (strcmp(xar_path, "-") == 0) {
+#if !defined(_WIN32)
+  if (wopts.cache_policy == cache_policy_drop) {
+    r = open_input_uncached(xar, xar_path);
+  } else
+#endif
+      if (strcmp(xar_path, "-") == 0) {
     r = archive_read_open_fd(xar, 0, 10240);
   } else {
     r = archive_read_open_filename(xar, xar_path, 10240);
@@ -738,15 +8773,57 @@ int main(int argc, char **argv) {
     fail_archive(xar, "open xar");
   }
 
-  if (chdir(outdir) != 0) {
+#if !defined(_WIN32)
+  if ((result_cache != NULL || payload_cache != NULL) &&
+      pkg_identity(xar_path, pkg_id) != 0) {
+    /* Only seekable pkg files can be keyed. */
+    free(result_cache);
+    result_cache = NULL;
+    free(payload_cache);
+    payload_cache = NULL;
+  }
+  if (result_cache != NULL) {
+    result_cache_key(pkg_id, do_expand_full, strip_components, &includes,
+                     &excludes, cache_key);
+  }
+  if (payload_cache != NULL) {
+    wopts.payload_cache = payload_cache;
+    wopts.pkg_id = pkg_id;
+  }
+#endif
+
+  if (output_format == output_format_dir &&
+      chdir(staging != NULL ? staging : outdir) != 0) {
     fail_errno("chdir(outdir)");
   }
+  if (wopts.dedup != dedup_off) {
+    root = getcwd(NULL, 0);
+    if (root == NULL) {
+      fail_errno("getcwd");
+    }
+    wopts.root = root;
+    wopts.digests = &digests;
+  }
 
   if (archive_match_set_inclusion_recursion(matching, 1) != ARCHIVE_OK) {
     fail_archive(matching, "archive_match_set_inclusion_recursion");
   }
 
-  while ((r = archive_read_next_header(xar, &e)) == ARCHIVE_OK) {
+#if !defined(_WIN32)
+  if (result_cache != NULL) {
+    /* Only --dedup hardlink already accepts files that share an inode. */
+    cache_hit = result_cache_fetch(result_cache, cache_key, ".",
+                                   wopts.dedup == dedup_hardlink) == 0;
+  }
+  plan.matching = matching;
+  plan.only = wopts.only;
+  plan.strip = strip_components;
+  plan.prune = includes.len > 0;
+  plan.precreate = precreate;
+  plan.skeleton = skeleton;
+#endif
+
+  while (!cache_hit && (r = archive_read_next_header(xar, &e)) == ARCHIVE_OK) {
     const char *p = archive_entry_pathname(e);
     char *rel = normalize_rel_path(p);
     archive_entry_set_pathname(e, rel);
@@ -758,13 +8835,38 @@ int main(int argc, char **argv) {
           has_include_descendant(&includes, logical_path)) {
         include_nested = 1;
       }
+      if (wopts.only != NULL &&
+          string_map_get(wopts.only, logical_path) == NULL) {
+        include_nested = 0;
+      }
+#if !defined(_WIN32)
+      /* Its Bom, when read first, may show that no path can match. */
+      if (include_nested && bom_has(&plan.pruned, rel)) {
+        include_nested = 0;
+      }
+      /* --skeleton builds Payloads from their Boms instead. */
+      if (plan.skeleton && is_payload_member(rel)) {
+        include_nested = 0;
+      }
+#endif
+      /* Members only the views want are decoded without touching OUTDIR. */
+      int primary_nested = include_nested;
+      if (!include_nested) {
+        include_nested = views_want_nested(&views, logical_path);
+      }
       free(logical_path);
       if (!include_nested) {
+        route_to_views(xar, e, NULL, NULL, &views);
         archive_read_data_skip(xar);
         free(rel);
         continue;
       }
 
+#if !defined(_WIN32)
+      if (wopts.bom != NULL && primary_nested && is_payload_member(rel)) {
+        pattern_list_add(&wopts.bom->payloads, rel);
+      }
+#endif
       char *nested_outdir = strip_components_path(rel, strip_components);
       int nested_strip = strip_components;
       int rel_components = path_component_count(rel);
@@ -781,7 +8883,20 @@ int main(int argc, char **argv) {
         nested_strip = 0;
       }
 
-      mkdirs_for_path(nested_outdir);
+      if (!primary_nested) {
+        free(nested_outdir);
+        nested_outdir = strdup(".");
+        if (nested_outdir == NULL) {
+          fail_errno("strdup");
+        }
+      } else if (output_format == output_format_dir) {
+        mkdirs_for_path(nested_outdir);
+        if (wopts.seen != NULL) {
+          char *seen_outdir = join_prefix_path(NULL, nested_outdir);
+          record_seen_path(&wopts, seen_outdir);
+          free(seen_outdir);
+        }
+      }
 
       {
         struct astream in = {
@@ -791,39 +8906,193 @@ int main(int argc, char **argv) {
             .pos = 0,
             .off = 0,
             .eof = 0,
+            .tee = NULL,
         };
 
-        extract_nested_archive_from_stream(&in, nested_outdir, flags, matching,
-                                           nested_strip, rel);
+#if !defined(_WIN32)
+        if (flat != NULL) {
+          /* The flat copy is written from the blocks the extractor reads. */
+          flat_begin(flat, e);
+          in.tee = flat->disk;
+        }
+#endif
+        extract_nested_archive_from_stream(&in, nested_outdir, flags,
+                                           primary_nested ? matching : NULL,
+                                           nested_strip, rel, &wopts, &views);
+#if !defined(_WIN32)
+        if (flat != NULL) {
+          int fr;
+          while ((fr = astream_fill(&in)) == ARCHIVE_OK) {
+          }
+          if (fr != ARCHIVE_EOF) {
+            fail_archive(xar, "read xar entry");
+          }
+          flat_finish(flat);
+        }
+#endif
       }
       free(nested_outdir);
       free(rel);
     } else {
       char *logical_path = join_prefix_path(NULL, rel);
-      if (!should_extract_path(matching, logical_path)) {
+#if !defined(_WIN32)
+      /* A Bom left out of the output is still read for --verify-bom. */
+      int load_bom = wopts.bom != NULL && member_is(rel, "Bom");
+      int plan_bom = do_expand_full &&
+                     (plan.prune || plan.precreate || plan.skeleton) &&
+                     member_is(rel, "Bom");
+#endif
+      if (!should_extract_path(matching, logical_path) ||
+          (wopts.only != NULL &&
+           string_map_get(wopts.only, logical_path) == NULL)) {
+        route_to_views(xar, e, NULL, NULL, &views);
+#if !defined(_WIN32)
+        if (load_bom || plan_bom) {
+          bom_load_data(wopts.bom, plan_bom ? &plan : NULL, rel, xar);
+        }
+#endif
         archive_read_data_skip(xar);
         free(logical_path);
         free(rel);
         continue;
       }
       free(logical_path);
+      struct archive_entry *orig = view_entry_clone(&views, e);
       if (apply_strip_components(e, strip_components)) {
+        route_to_views(xar, orig, NULL, NULL, &views);
+        archive_entry_free(orig);
+#if !defined(_WIN32)
+        if (load_bom || plan_bom) {
+          bom_load_data(wopts.bom, plan_bom ? &plan : NULL, rel, xar);
+        }
+#endif
         archive_read_data_skip(xar);
         free(rel);
         continue;
       }
-      r = archive_read_extract2(xar, e, disk);
+      r = extract_entry(xar, e, disk, NULL, &wopts);
       if (r != ARCHIVE_OK) {
         free(rel);
         fail_archive(xar, "extract entry");
       }
+#if !defined(_WIN32)
+      /* Other output formats leave no Bom on disk to read back. */
+      if (load_bom || (plan_bom && output_format == output_format_dir)) {
+        bom_load_file(wopts.bom, plan_bom ? &plan : NULL, rel,
+                      archive_entry_pathname(e));
+      }
+#endif
+      record_output_path(&wopts, NULL, e);
+      route_to_views(xar, orig, NULL, e, &views);
+      archive_entry_free(orig);
       free(rel);
     }
   }
 
   archive_write_free(disk);
   archive_read_free(xar);
+  if (stream != NULL) {
+    if (archive_write_close(stream) != ARCHIVE_OK) {
+      fail_archive(stream, "close output");
+    }
+    archive_write_free(stream);
+  }
+#if !defined(_WIN32)
+  if (image != NULL) {
+    image_close(image);
+  }
+  if (cas != NULL) {
+    cas_close(cas);
+  }
+#endif
+#if !defined(_WIN32)
+  if (views.len > 0) {
+    int here = open(".", O_RDONLY | O_CLOEXEC);
+    if (here < 0) {
+      fail_errno("open(cwd)");
+    }
+    /* Deferred directory times are applied relative to each view. */
+    for (size_t i = 0; i < views.len; i++) {
+      struct view *v = &views.items[i];
+      if (fchdir(v->dirfd) != 0) {
+        fail_errno(v->outdir);
+      }
+      archive_write_free(v->disk);
+      close(v->dirfd);
+      free(v->root);
+    }
+    if (fchdir(here) != 0) {
+      fail_errno("fchdir(cwd)");
+    }
+    close(here);
+  }
+#endif
+  for (size_t i = 0; i < views.len; i++) {
+    archive_match_free(views.items[i].matching);
+    pattern_list_free(&views.items[i].includes);
+  }
+  free(views.items);
+#if !defined(_WIN32)
+  writeback_queue_drain(&writeback);
+  aligned_pool_free(&pool);
+  if (wopts.seen != NULL) {
+    incremental_finish(&seen, incremental_manifest);
+  }
+  if (hash_manifest != NULL) {
+    hash_manifest_write(hash_manifest, hash_manifest_arg, &hashes);
+  }
+  if (result_cache != NULL && !cache_hit && cache_store) {
+    result_cache_store(result_cache, cache_key, ".",
+                       wopts.dedup == dedup_hardlink, result_cache_size);
+  }
+  if (pbzx_cache != NULL && pbzx_cache_size > 0) {
+    pbzx_cache_evict(pbzx_cache, pbzx_cache_size);
+  }
+  sync_output(wopts.sync, &written);
+  if (wopts.bom != NULL && bom_verify_report(wopts.bom) > 0) {
+    /* With --replace, DIR is left as it was and the staged tree kept. */
+    exit(1);
+  }
+  if (staging != NULL) {
+    if (fchdir(origin_fd) != 0) {
+      fail_errno("fchdir(cwd)");
+    }
+    close(origin_fd);
+    replace_outdir(staging, outdir);
+    if (wopts.sync != sync_policy_none) {
+      sync_parent_dir(outdir);
+    }
+    free(staging);
+  }
+  if (repair) {
+    /* Extras are never removed, so the tree may still not match. */
+    if (fchdir(origin_fd) != 0) {
+      fail_errno("fchdir(cwd)");
+    }
+    close(origin_fd);
+    if (verify_tree(xar_path, outdir, matching, &includes, strip_components,
+                    NULL) > 0) {
+      exit(1);
+    }
+  }
+#endif
+  pattern_list_free(&written);
+  string_map_free(&seen, NULL);
+  string_map_free(&hashes, free);
+#if !defined(_WIN32)
+  string_map_free(&digests, dedup_source_free);
+  free(incremental_manifest);
+  bom_verify_free(&bom);
+  string_map_free(&repair_paths, NULL);
+  pattern_list_free(&plan.pruned);
+#endif
+  free(root);
+  free(link_dest);
+  free(result_cache);
+  free(payload_cache);
+  free(pbzx_cache);
   archive_match_free(matching);
   pattern_list_free(&includes);
+  pattern_list_free(&excludes);
   return (0);
 }
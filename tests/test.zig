@@ -4,42 +4,249 @@ pub fn main() !void {
 	var gpa = std.heap.GeneralPurposeAllocator(.{}){};
 	defer _ = gpa.deinit();
 
-	const allocator = gpa.allocator();
+	var arena_state = std.heap.ArenaAllocator.init(gpa.allocator());
+	defer arena_state.deinit();
+
+	const allocator = arena_state.allocator();
 	const args = try std.process.argsAlloc(allocator);
-	defer std.process.argsFree(allocator, args);
 
 	if (args.len < 3) {
-		return usage();
+		usage();
 	}
 
-	const mode = args[1];
-	const expect_exists = if (std.mem.eql(u8, mode, "-e"))
-		true
-	else if (std.mem.eql(u8, mode, "-ne"))
-		false
-	else {
-		return usage();
-	};
+	// Steps are separated by ";" and run in order; @TMP@ is a scratch
+	// directory, so a step can check what an earlier step wrote.
+	const tmp: []const u8 = std.process.getEnvVarOwned(allocator, "TEST_TMPDIR") catch ".";
+	var start: usize = 1;
+	while (start < args.len) {
+		var end = start;
+		while (end < args.len and !std.mem.eql(u8, args[end], ";")) {
+			end += 1;
+		}
+
+		const step = try allocator.alloc([]const u8, end - start);
+		for (args[start..end], step) |arg, *out| {
+			out.* = try std.mem.replaceOwned(u8, allocator, arg, "@TMP@", tmp);
+		}
+		if (!runStep(allocator, step)) {
+			std.process.exit(1);
+		}
+		start = end + 1;
+	}
+}
+
+fn runStep(allocator: std.mem.Allocator, step: []const []const u8) bool {
+	if (step.len < 2) {
+		usage();
+	}
 
+	const mode = step[0];
 	var ok = true;
 
-	var i: usize = 2;
-	while (i < args.len) : (i += 1) {
-		const path = args[i];
-		const exists = pathExists(path);
+	if (std.mem.eql(u8, mode, "-e") or std.mem.eql(u8, mode, "-ne")) {
+		const expect_exists = std.mem.eql(u8, mode, "-e");
+		for (step[1..]) |path| {
+			const exists = pathExists(path);
+
+			if (expect_exists and !exists) {
+				ok = false;
+				eprint("missing: {s}\n", .{path});
+			} else if (!expect_exists and exists) {
+				ok = false;
+				eprint("unexpected: {s}\n", .{path});
+			}
+		}
+	} else if (std.mem.eql(u8, mode, "-nonempty")) {
+		for (step[1..]) |path| {
+			if (!dirHasEntries(path)) {
+				ok = false;
+			}
+		}
+	} else if (std.mem.eql(u8, mode, "-sparse")) {
+		for (step[1..]) |path| {
+			const st = statPath(path) orelse {
+				ok = false;
+				continue;
+			};
+			const used = @as(i64, @intCast(st.blocks)) * 512;
+			const size = @as(i64, @intCast(st.size));
+
+			if (used >= size) {
+				ok = false;
+				eprint("not sparse: {s} ({d} bytes in {d} allocated)\n", .{ path, size, used });
+			}
+		}
+	} else if (std.mem.eql(u8, mode, "-mode") or std.mem.eql(u8, mode, "-chmod")) {
+		if (step.len < 3) {
+			usage();
+		}
+		const want = std.fmt.parseInt(u32, step[1], 8) catch usage();
+		for (step[2..]) |path| {
+			if (std.mem.eql(u8, mode, "-chmod")) {
+				chmodPath(path, want) catch |err| {
+					ok = false;
+					eprint("error changing mode of {s}: {s}\n", .{ path, @errorName(err) });
+				};
+				continue;
+			}
+
+			const st = statPath(path) orelse {
+				ok = false;
+				continue;
+			};
+			const got = @as(u32, @intCast(st.mode)) & 0o7777;
+
+			if (got != want) {
+				ok = false;
+				eprint("mode {o}, want {o}: {s}\n", .{ got, want, path });
+			}
+		}
+	} else if (std.mem.eql(u8, mode, "-sha256sums")) {
+		if (step.len != 3) {
+			usage();
+		}
+		ok = checkSha256Sums(allocator, step[1], step[2]);
+	} else if (std.mem.eql(u8, mode, "-squashfs")) {
+		for (step[1..]) |path| {
+			if (!checkSquashfs(path)) {
+				ok = false;
+			}
+		}
+	} else if (std.mem.eql(u8, mode, "-nlink") or std.mem.eql(u8, mode, "-size") or std.mem.eql(u8, mode, "-blocks")) {
+		if (step.len < 3) {
+			usage();
+		}
+		const want = std.fmt.parseInt(u64, step[1], 10) catch usage();
+		for (step[2..]) |path| {
+			const st = statPath(path) orelse {
+				ok = false;
+				continue;
+			};
+			const got: u64 = if (std.mem.eql(u8, mode, "-nlink"))
+				@intCast(st.nlink)
+			else if (std.mem.eql(u8, mode, "-size"))
+				@intCast(st.size)
+			else
+				@intCast(st.blocks);
 
-		if (expect_exists and !exists) {
+			if (got != want) {
+				ok = false;
+				eprint("{s} {d}, want {d}: {s}\n", .{ mode[1..], got, want, path });
+			}
+		}
+	} else if (std.mem.eql(u8, mode, "-write")) {
+		if (step.len != 3) {
+			usage();
+		}
+		writeStart(step[1], step[2]) catch |err| {
+			ok = false;
+			eprint("error writing {s}: {s}\n", .{ step[1], @errorName(err) });
+		};
+	} else if (std.mem.eql(u8, mode, "-rm")) {
+		for (step[1..]) |path| {
+			std.fs.cwd().deleteFile(path) catch |err| {
+				ok = false;
+				eprint("error removing {s}: {s}\n", .{ path, @errorName(err) });
+			};
+		}
+	} else if (std.mem.eql(u8, mode, "-run")) {
+		const result = run(allocator, step[1..]) orelse return false;
+		ok = exitedWith(result, 0, step[1..]);
+	} else if (std.mem.eql(u8, mode, "-status")) {
+		if (step.len < 3) {
+			usage();
+		}
+		const want = std.fmt.parseInt(u8, step[1], 10) catch usage();
+		// Any number of "-contains <text>" pairs may precede the command.
+		var cmd: usize = 2;
+		while (cmd + 2 < step.len and std.mem.eql(u8, step[cmd], "-contains")) {
+			cmd += 2;
+		}
+		const result = run(allocator, step[cmd..]) orelse return false;
+		ok = exitedWith(result, want, step[cmd..]);
+		var i: usize = 2;
+		while (ok and i < cmd) : (i += 2) {
+			if (std.mem.indexOf(u8, result.stdout, step[i + 1]) == null) {
+				ok = false;
+				eprint("stdout does not contain: {s}\n", .{step[i + 1]});
+			}
+		}
+	} else if (std.mem.eql(u8, mode, "-stdout")) {
+		if (step.len < 3) {
+			usage();
+		}
+		const want = std.fs.cwd().readFileAlloc(allocator, step[1], 1 << 30) catch |err| {
+			eprint("error reading {s}: {s}\n", .{ step[1], @errorName(err) });
+			return false;
+		};
+		const result = run(allocator, step[2..]) orelse return false;
+		ok = exitedWith(result, 0, step[2..]);
+		if (ok and !std.mem.eql(u8, result.stdout, want)) {
 			ok = false;
-			eprint("missing: {s}\n", .{path});
-		} else if (!expect_exists and exists) {
+			eprint("stdout differs from {s} ({d} bytes, want {d})\n", .{ step[1], result.stdout.len, want.len });
+		}
+	} else if (std.mem.eql(u8, mode, "-contains")) {
+		if (step.len < 3) {
+			usage();
+		}
+		const result = run(allocator, step[2..]) orelse return false;
+		ok = exitedWith(result, 0, step[2..]);
+		if (ok and std.mem.indexOf(u8, result.stdout, step[1]) == null) {
+			ok = false;
+			eprint("stdout does not contain: {s}\n", .{step[1]});
+		}
+	} else if (std.mem.eql(u8, mode, "-contains-file")) {
+		if (step.len < 3) {
+			usage();
+		}
+		const want = std.fs.cwd().readFileAlloc(allocator, step[1], 1 << 30) catch |err| {
+			eprint("error reading {s}: {s}\n", .{ step[1], @errorName(err) });
+			return false;
+		};
+		const result = run(allocator, step[2..]) orelse return false;
+		ok = exitedWith(result, 0, step[2..]);
+		if (ok and std.mem.indexOf(u8, result.stdout, want) == null) {
 			ok = false;
-			eprint("unexpected: {s}\n", .{path});
+			eprint("stdout does not contain the bytes of {s}\n", .{step[1]});
 		}
+	} else {
+		usage();
+	}
+
+	return ok;
+}
+
+fn run(allocator: std.mem.Allocator, argv: []const []const u8) ?std.process.Child.RunResult {
+	// A runfiles path such as "pkgutil" has no slash and would be looked up
+	// in PATH.
+	const resolved = allocator.dupe([]const u8, argv) catch return null;
+	resolved[0] = std.fs.cwd().realpathAlloc(allocator, argv[0]) catch argv[0];
+
+	return std.process.Child.run(.{
+		.allocator = allocator,
+		.argv = resolved,
+		.max_output_bytes = 1 << 30,
+	}) catch |err| {
+		eprint("error running {s}: {s}\n", .{ argv[0], @errorName(err) });
+		return null;
+	};
+}
+
+fn exitedWith(result: std.process.Child.RunResult, want: u8, argv: []const []const u8) bool {
+	switch (result.term) {
+		.Exited => |code| if (code == want) {
+			return true;
+		},
+		else => {},
 	}
 
-	if (!ok) {
-		std.process.exit(1);
+	eprint("{s}", .{result.stderr});
+	eprint("unexpected exit ({any}, want {d}):", .{ result.term, want });
+	for (argv) |arg| {
+		eprint(" {s}", .{arg});
 	}
+	eprint("\n", .{});
+	return false;
 }
 
 fn pathExists(path: []const u8) bool {
@@ -55,8 +262,234 @@ fn pathExists(path: []const u8) bool {
 	}
 }
 
-fn usage() void {
-	eprint("usage: test.zig (-e|-ne) <path> [path...]\n", .{});
+fn dirHasEntries(path: []const u8) bool {
+	var dir = std.fs.cwd().openDir(path, .{ .iterate = true }) catch |err| {
+		eprint("error opening {s}: {s}\n", .{ path, @errorName(err) });
+		return false;
+	};
+	defer dir.close();
+
+	var it = dir.iterate();
+	const entry = it.next() catch |err| {
+		eprint("error reading {s}: {s}\n", .{ path, @errorName(err) });
+		return false;
+	};
+	if (entry == null) {
+		eprint("empty: {s}\n", .{path});
+		return false;
+	}
+	return true;
+}
+
+fn statPath(path: []const u8) ?std.posix.Stat {
+	return std.posix.fstatat(std.fs.cwd().fd, path, 0) catch |err| {
+		eprint("error accessing {s}: {s}\n", .{ path, @errorName(err) });
+		return null;
+	};
+}
+
+// Checks a sha256sum-style manifest against the tree at dir_path: every
+// line is well formed, paths are in byte order, each digest matches the
+// file, and there is one line per regular file.
+fn checkSha256Sums(allocator: std.mem.Allocator, manifest: []const u8, dir_path: []const u8) bool {
+	const text = std.fs.cwd().readFileAlloc(allocator, manifest, 1 << 30) catch |err| {
+		eprint("error reading {s}: {s}\n", .{ manifest, @errorName(err) });
+		return false;
+	};
+	var dir = std.fs.cwd().openDir(dir_path, .{ .iterate = true }) catch |err| {
+		eprint("error opening {s}: {s}\n", .{ dir_path, @errorName(err) });
+		return false;
+	};
+	defer dir.close();
+
+	if (text.len == 0 or text[text.len - 1] != '\n') {
+		eprint("empty or unterminated: {s}\n", .{manifest});
+		return false;
+	}
+	var lines: usize = 0;
+	var prev: []const u8 = "";
+	var it = std.mem.splitScalar(u8, text[0 .. text.len - 1], '\n');
+	while (it.next()) |raw| {
+		// A leading backslash marks a path with escaped '\\' and '\n'.
+		const escaped = raw.len > 0 and raw[0] == '\\';
+		const line = if (escaped) raw[1..] else raw;
+		if (line.len < 67 or !std.mem.eql(u8, line[64..66], "  ")) {
+			eprint("malformed line in {s}: {s}\n", .{ manifest, raw });
+			return false;
+		}
+		var path: []const u8 = line[66..];
+		if (escaped) {
+			path = unescapePath(allocator, path) orelse {
+				eprint("malformed line in {s}: {s}\n", .{ manifest, raw });
+				return false;
+			};
+		}
+		if (lines > 0 and std.mem.order(u8, prev, path) != .lt) {
+			eprint("not sorted in {s}: {s}\n", .{ manifest, path });
+			return false;
+		}
+		prev = path;
+		lines += 1;
+
+		var want: [32]u8 = undefined;
+		_ = std.fmt.hexToBytes(&want, line[0..64]) catch {
+			eprint("malformed line in {s}: {s}\n", .{ manifest, raw });
+			return false;
+		};
+		const got = sha256File(dir, path) orelse return false;
+		if (!std.mem.eql(u8, &got, &want)) {
+			eprint("digest differs: {s}\n", .{path});
+			return false;
+		}
+	}
+
+	var files: usize = 0;
+	var walker = dir.walk(allocator) catch |err| {
+		eprint("error walking {s}: {s}\n", .{ dir_path, @errorName(err) });
+		return false;
+	};
+	defer walker.deinit();
+	while (walker.next() catch |err| {
+		eprint("error walking {s}: {s}\n", .{ dir_path, @errorName(err) });
+		return false;
+	}) |entry| {
+		if (entry.kind == .file) {
+			files += 1;
+		}
+	}
+	if (files != lines) {
+		eprint("{d} lines in {s} for {d} files\n", .{ lines, manifest, files });
+		return false;
+	}
+	return true;
+}
+
+fn unescapePath(allocator: std.mem.Allocator, path: []const u8) ?[]const u8 {
+	const out = allocator.alloc(u8, path.len) catch return null;
+	var n: usize = 0;
+	var i: usize = 0;
+	while (i < path.len) : (i += 1) {
+		var c = path[i];
+		if (c == '\\') {
+			i += 1;
+			if (i == path.len) {
+				return null;
+			}
+			c = switch (path[i]) {
+				'\\' => '\\',
+				'n' => '\n',
+				else => return null,
+			};
+		}
+		out[n] = c;
+		n += 1;
+	}
+	return out[0..n];
+}
+
+fn sha256File(dir: std.fs.Dir, path: []const u8) ?[32]u8 {
+	const file = dir.openFile(path, .{}) catch |err| {
+		eprint("error opening {s}: {s}\n", .{ path, @errorName(err) });
+		return null;
+	};
+	defer file.close();
+
+	var hash = std.crypto.hash.sha2.Sha256.init(.{});
+	var buf: [1 << 16]u8 = undefined;
+	while (true) {
+		const n = std.posix.read(file.handle, &buf) catch |err| {
+			eprint("error reading {s}: {s}\n", .{ path, @errorName(err) });
+			return null;
+		};
+		if (n == 0) {
+			break;
+		}
+		hash.update(buf[0..n]);
+	}
+	var out: [32]u8 = undefined;
+	hash.final(&out);
+	return out;
+}
+
+// Checks that the SquashFS 4.0 superblock of path is self-consistent and
+// that its tables lie in order inside the file.
+fn checkSquashfs(path: []const u8) bool {
+	const file = std.fs.cwd().openFile(path, .{}) catch |err| {
+		eprint("error opening {s}: {s}\n", .{ path, @errorName(err) });
+		return false;
+	};
+	defer file.close();
+
+	var sb: [96]u8 = undefined;
+	const n = file.preadAll(&sb, 0) catch 0;
+	const size = file.getEndPos() catch 0;
+	if (n != sb.len) {
+		eprint("short superblock: {s}\n", .{path});
+		return false;
+	}
+
+	const magic = std.mem.readInt(u32, sb[0..4], .little);
+	const inodes = std.mem.readInt(u32, sb[4..8], .little);
+	const block_size = std.mem.readInt(u32, sb[12..16], .little);
+	const block_log = std.mem.readInt(u16, sb[22..24], .little);
+	const ids = std.mem.readInt(u16, sb[26..28], .little);
+	const major = std.mem.readInt(u16, sb[28..30], .little);
+	const minor = std.mem.readInt(u16, sb[30..32], .little);
+	const root = std.mem.readInt(u64, sb[32..40], .little);
+	const used = std.mem.readInt(u64, sb[40..48], .little);
+	const id_table = std.mem.readInt(u64, sb[48..56], .little);
+	const inode_table = std.mem.readInt(u64, sb[64..72], .little);
+	const dir_table = std.mem.readInt(u64, sb[72..80], .little);
+
+	var why: ?[]const u8 = null;
+	if (magic != 0x73717368) {
+		why = "bad magic";
+	} else if (major != 4 or minor != 0) {
+		why = "not version 4.0";
+	} else if (block_log > 20 or block_size != @as(u32, 1) << @intCast(block_log)) {
+		why = "block size does not match its log";
+	} else if (inodes == 0 or ids == 0) {
+		why = "no inodes or ids";
+	} else if (!(96 <= inode_table and inode_table < dir_table and dir_table < id_table and id_table < used)) {
+		why = "tables out of order";
+	} else if (used > size or size % 4096 != 0) {
+		why = "bytes used does not fit the padded file";
+	} else if ((root >> 16) >= dir_table - inode_table) {
+		why = "root inode outside the inode table";
+	}
+	if (why) |reason| {
+		eprint("{s}: {s}\n", .{ reason, path });
+		return false;
+	}
+	return true;
+}
+
+// Overwrites the start of path and keeps its size when it already exists.
+fn writeStart(path: []const u8, text: []const u8) !void {
+	const file = try std.fs.cwd().createFile(path, .{ .truncate = false });
+	defer file.close();
+
+	try file.writeAll(text);
+}
+
+fn chmodPath(path: []const u8, mode: u32) !void {
+	try std.posix.fchmodat(std.fs.cwd().fd, path, @intCast(mode), 0);
+}
+
+fn usage() noreturn {
+	eprint("usage: test.zig <step> [; <step>...]\n", .{});
+	eprint("steps: (-e|-ne|-nonempty|-sparse) <path> [path...]\n", .{});
+	eprint("       (-mode|-chmod) <octal> <path> [path...]\n", .{});
+	eprint("       (-nlink|-size|-blocks) <count> <path> [path...]\n", .{});
+	eprint("       -squashfs <image> [image...]\n", .{});
+	eprint("       -sha256sums <manifest> <dir>\n", .{});
+	eprint("       -write <path> <text>\n", .{});
+	eprint("       -rm <path> [path...]\n", .{});
+	eprint("       -run <cmd> [arg...]\n", .{});
+	eprint("       -status <code> [-contains <text>...] <cmd> [arg...]\n", .{});
+	eprint("       (-stdout <file>|-contains <text>) <cmd> [arg...]\n", .{});
+	eprint("       -contains-file <file> <cmd> [arg...]\n", .{});
+	eprint("@TMP@ in a step is replaced with $TEST_TMPDIR.\n", .{});
 	std.process.exit(2);
 }
 